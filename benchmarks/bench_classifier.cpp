@@ -0,0 +1,266 @@
+// Lines per second through the kernel line parsers and the event classifier.
+//
+// The baseline is the JournalTail::parseLine() the daemon started with,
+// copied below: it decoded each `journalctl -o short` line into a QString,
+// split it with QString::section and classified it with toLower() and
+// contains(). It is compared with the current parsers on the same
+// messages: JournalTail::parseJsonEntry() on `journalctl -o json` lines and
+// KmsgReader on a synthetic /dev/kmsg dump, classification included.
+//
+// The classifier figures compare the baseline keyword check with
+// EventClassifier, which scans each field once with one Aho-Corasick
+// automaton for all rules, and with matching one case-insensitive
+// QRegularExpression per rule, as rule sets are commonly written.
+//
+//   bench_classifier [lines]
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QRegularExpression>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include "eventclassifier.h"
+#include "journaltail.h"
+#include "kmsgreader.h"
+
+namespace {
+const char *const kMessages[] = {
+    "usb 1-2: new high-speed USB device number %1 using xhci_hcd",
+    "usb 1-2: device descriptor read/64, error -71",
+    "usb 1-2: reset high-speed USB device number %1 using xhci_hcd",
+    "usb 1-2: USB disconnect, device number %1",
+    "xhci_hcd 0000:00:14.0: WARN Set TR Deq Ptr cmd failed due to incorrect slot or ep state",
+    "hub 2-0:1.0: 4 ports detected",
+    "EXT4-fs (nvme0n1p2): mounted filesystem with ordered data mode. Quota mode: none.",
+    "ACPI: \\_SB_.PCI0.LPCB.EC0_: Event %1 timeout while waiting for response",
+    "wlp3s0: associated, signal -%1 dBm",
+    "audit: type=1400 audit(1700000000.%1:42): apparmor=\"STATUS\" operation=\"profile_load\"",
+};
+const int kMessageCount = sizeof(kMessages) / sizeof(kMessages[0]);
+
+QByteArray message(int line) {
+    return QByteArray(kMessages[line % kMessageCount]).replace("%1", QByteArray::number(line % 128));
+}
+
+// The fields the baseline parser filled in; UsbEvent has changed since.
+struct BaselineEvent {
+    QString timestamp;
+    QString source;
+    QString message;
+    QString subsystem;
+    QString level;
+    bool isUsb = false;
+    bool isError = false;
+};
+
+// JournalTail::handleReadyRead() and parseLine() as of the first commit.
+BaselineEvent baselineParseLine(const QByteArray &rawLine) {
+    const QString line = QString::fromUtf8(rawLine).trimmed();
+    BaselineEvent event;
+    event.timestamp = line.section(' ', 0, 2).trimmed();
+    event.source = line.section(' ', 3, 3).trimmed();
+    event.message = line.section(' ', 4).trimmed();
+    event.subsystem = QStringLiteral("kernel");
+
+    const QString lowered = line.toLower();
+    event.isUsb = lowered.contains("usb") || lowered.contains("xhci") || lowered.contains("usbhid") || lowered.contains("hub");
+    event.isError = lowered.contains("error") || lowered.contains("fail") || lowered.contains("timeout");
+    event.level = event.isError ? QStringLiteral("error") : QStringLiteral("info");
+
+    return event;
+}
+
+// The baseline's keyword check alone, on a message already decoded.
+void classifyBaseline(const QString &message, UsbEvent &event) {
+    const QString lowered = message.toLower();
+    event.isUsb = lowered.contains("usb") || lowered.contains("xhci") || lowered.contains("usbhid") || lowered.contains("hub");
+    event.isError = lowered.contains("error") || lowered.contains("fail") || lowered.contains("timeout");
+}
+
+QByteArray shortLine(int line) {
+    return "Jan 01 12:00:" + QByteArray::number(line % 60).rightJustified(2, '0') + " host kernel: " + message(line)
+        + "\n";
+}
+
+QByteArray jsonLine(int line) {
+    QByteArray text = message(line);
+    text.replace("\\", "\\\\").replace("\"", "\\\"");
+    QByteArray json = "{\"__CURSOR\":\"s=0;i=" + QByteArray::number(line, 16) + "\",\"__REALTIME_TIMESTAMP\":\""
+        + QByteArray::number(1700000000000000LL + qint64(line) * 1000) + "\",\"__MONOTONIC_TIMESTAMP\":\""
+        + QByteArray::number(qint64(line) * 1000) + "\",\"MESSAGE\":\"" + text + "\",";
+    if (line % kMessageCount < 4) {
+        json += "\"_KERNEL_SUBSYSTEM\":\"usb\",";
+    }
+    return json + "\"_HOSTNAME\":\"host\"}";
+}
+
+// The per-rule baseline: each rule is its own regular expression, tried on
+// every line, with the same veto and level semantics as EventClassifier.
+struct RegexRule {
+    QRegularExpression expression;
+    ClassificationRule rule;
+};
+
+void classifyWithRegexes(const QList<RegexRule> &rules, const QString &message, const QString &subsystem,
+                         UsbEvent &event) {
+    bool usb = false;
+    bool usbVeto = false;
+    bool error = false;
+    bool errorVeto = false;
+    for (const RegexRule &regex : rules) {
+        const QString &text = regex.rule.field == ClassificationRule::Subsystem ? subsystem : message;
+        if (!regex.expression.match(text).hasMatch()) {
+            continue;
+        }
+        if (regex.rule.usb) {
+            (*regex.rule.usb ? usb : usbVeto) = true;
+        }
+        if (regex.rule.error) {
+            (*regex.rule.error ? error : errorVeto) = true;
+        }
+        if (regex.rule.level == QLatin1String("error")) {
+            error = true;
+        }
+    }
+    event.isUsb = usb && !usbVeto;
+    event.isError = error && !errorVeto;
+}
+
+double parseSeconds(int lines, int &parsed) {
+    QTemporaryDir dir;
+    const QString path = dir.filePath("kmsg");
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return 0;
+    }
+    for (int line = 0; line < lines; ++line) {
+        // "<priority>,<sequence>,<timestamp us>,<flags>;<message>" and the
+        // continuation fields the kernel adds for device messages.
+        file.write("6," + QByteArray::number(line + 1) + "," + QByteArray::number(qint64(line) * 1000) + ",-;"
+                   + message(line) + "\n");
+        if (line % kMessageCount < 4) {
+            file.write(" SUBSYSTEM=usb\n DEVICE=+usb:1-2\n");
+        }
+    }
+    file.close();
+
+    KmsgReader reader(path);
+    parsed = 0;
+    QObject::connect(&reader, &KmsgReader::eventsParsed,
+                     [&parsed](const QVector<UsbEvent> &events) { parsed += events.size(); });
+    QElapsedTimer timer;
+    timer.start();
+    // A regular file is read to its end right away.
+    reader.start();
+    return timer.nsecsElapsed() / 1e9;
+}
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    const int lines = qMax(1, argc > 1 ? QByteArray(argv[1]).toInt() : 1000000);
+    QTextStream out(stdout);
+
+    QList<QByteArray> messages;
+    QList<QString> messageStrings;
+    QList<QByteArray> shortLines;
+    QList<QByteArray> jsonLines;
+    for (int line = 0; line < kMessageCount * 128; ++line) {
+        messages.append(message(line));
+        messageStrings.append(QString::fromUtf8(messages.last()));
+        shortLines.append(shortLine(line));
+        jsonLines.append(jsonLine(line));
+    }
+    const QByteArray subsystem("usb");
+    const QString subsystemString = QString::fromUtf8(subsystem);
+    const EventClassifier classifier;
+
+    out << "parsers, " << lines << " lines:\n";
+    int baselineUsb = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int line = 0; line < lines; ++line) {
+        baselineUsb += baselineParseLine(shortLines.at(line % shortLines.size())).isUsb;
+    }
+    const double baselineParse = timer.nsecsElapsed() / 1e9;
+    out << "  baseline parseLine (short): " << QString::number(lines / baselineParse / 1e6, 'f', 2)
+        << " M lines/s\n";
+
+    int jsonUsb = 0;
+    QByteArray cursor;
+    timer.restart();
+    for (int line = 0; line < lines; ++line) {
+        UsbEvent event;
+        if (JournalTail::parseJsonEntry(jsonLines.at(line % jsonLines.size()), classifier, event, cursor)) {
+            jsonUsb += event.isUsb;
+        }
+    }
+    const double jsonParse = timer.nsecsElapsed() / 1e9;
+    out << "  parseJsonEntry (json): " << QString::number(lines / jsonParse / 1e6, 'f', 2) << " M lines/s, "
+        << QString::number(baselineParse / jsonParse, 'f', 1) << "x baseline\n";
+
+    int parsed = 0;
+    const double parse = parseSeconds(lines, parsed);
+    if (parsed > 0) {
+        out << "  KmsgReader (kmsg): " << QString::number(parsed / parse / 1e6, 'f', 2) << " M lines/s, "
+            << QString::number((parsed / parse) / (lines / baselineParse), 'f', 1) << "x baseline\n";
+    } else {
+        out << "  KmsgReader (kmsg): could not write or read the dump\n";
+    }
+    // The baseline matched "hub" and "usb" anywhere in the line, the rules
+    // only in the message and subsystem, so the counts need not agree.
+    out << "  usb lines: baseline " << baselineUsb << ", json " << jsonUsb << "\n";
+
+    QList<RegexRule> regexes;
+    for (const ClassificationRule &rule : classifier.rules()) {
+        regexes.append({QRegularExpression(QRegularExpression::escape(QString::fromUtf8(rule.pattern)),
+                                           QRegularExpression::CaseInsensitiveOption),
+                        rule});
+        regexes.last().expression.optimize();
+    }
+
+    int baselineMatches = 0;
+    timer.restart();
+    for (int line = 0; line < lines; ++line) {
+        UsbEvent event;
+        classifyBaseline(messageStrings.at(line % messageStrings.size()), event);
+        baselineMatches += event.isUsb;
+    }
+    const double baseline = timer.nsecsElapsed() / 1e9;
+
+    int usbMatches = 0;
+    int errorMatches = 0;
+    timer.restart();
+    for (int line = 0; line < lines; ++line) {
+        UsbEvent event;
+        classifier.classify(messages.at(line % messages.size()), subsystem, event);
+        usbMatches += event.isUsb;
+        errorMatches += event.isError;
+    }
+    const double automaton = timer.nsecsElapsed() / 1e9;
+
+    int regexUsbMatches = 0;
+    int regexErrorMatches = 0;
+    timer.restart();
+    for (int line = 0; line < lines; ++line) {
+        UsbEvent event;
+        classifyWithRegexes(regexes, messageStrings.at(line % messageStrings.size()), subsystemString, event);
+        regexUsbMatches += event.isUsb;
+        regexErrorMatches += event.isError;
+    }
+    const double regex = timer.nsecsElapsed() / 1e9;
+
+    out << "classifier, " << classifier.rules().size() << " rules, " << lines << " lines:\n";
+    out << "  baseline toLower/contains: " << QString::number(lines / baseline / 1e6, 'f', 2) << " M lines/s, "
+        << baselineMatches << " usb\n";
+    out << "  Aho-Corasick: " << QString::number(lines / automaton / 1e6, 'f', 2) << " M lines/s, "
+        << QString::number(baseline / automaton, 'f', 1) << "x baseline\n";
+    out << "  regex per rule: " << QString::number(lines / regex / 1e6, 'f', 2) << " M lines/s\n";
+    if (usbMatches != regexUsbMatches || errorMatches != regexErrorMatches) {
+        out << "  results differ: usb " << usbMatches << " vs " << regexUsbMatches << ", error " << errorMatches
+            << " vs " << regexErrorMatches << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Compression ratio and read throughput of the persistent event log, with
+// and without compressed cold segments: bytes on disk, readSince and
+// readRange over the whole log, and the latency of short time-range
+// queries, which only decompress the blocks they touch.
+//
+//   bench_eventlog [events]
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include "eventlog.h"
+
+namespace {
+UsbEvent makeEvent(quint64 sequence) {
+    static const char *const kMessages[] = {
+        "usb 1-2: new high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: device descriptor read/64, error -71",
+        "usb 1-2: reset high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: USB disconnect, device number %1",
+        "xhci_hcd 0000:00:14.0: WARN Set TR Deq Ptr cmd failed due to incorrect slot or ep state",
+    };
+    UsbEvent event;
+    event.sequence = sequence;
+    event.timestampUs = 1700000000000000LL + static_cast<qint64>(sequence) * 1000;
+    event.monotonicUs = static_cast<qint64>(sequence) * 1000;
+    event.lastTimestampUs = event.timestampUs;
+    event.level = sequence % 7 == 0 ? QStringLiteral("error") : QStringLiteral("info");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("kernel");
+    event.deviceId = QStringLiteral("1-%1").arg(sequence % 4);
+    event.message = QString::fromLatin1(kMessages[sequence % 5]).arg(sequence % 128);
+    event.isUsb = true;
+    event.isError = sequence % 7 == 0;
+    return event;
+}
+
+struct Result {
+    qint64 bytes = 0;
+    double writeSeconds = 0;
+    double readSinceSeconds = 0;
+    double readRangeSeconds = 0;
+    double shortRangeSeconds = 0;
+    int eventsRead = 0;
+    int rangeEventsRead = 0;
+};
+
+// Queries of one second (1000 events) at random places in the log.
+const int kShortRanges = 1000;
+const qint64 kShortRangeUs = 1000000;
+
+Result run(int events, int uncompressedSegments) {
+    QTemporaryDir dir;
+    Result result;
+    {
+        EventLog log(dir.path());
+        log.setSegmentBytes(8 * 1024 * 1024);
+        log.setSyncInterval(60000);
+        log.setUncompressedSegments(uncompressedSegments);
+        log.open();
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 1; i <= events; ++i) {
+            log.append(makeEvent(static_cast<quint64>(i)));
+        }
+        log.sync();
+        // Compression runs on a worker thread and is swapped in through the
+        // event loop.
+        while (log.isCompressing()) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+        }
+        result.writeSeconds = timer.nsecsElapsed() / 1e9;
+        result.bytes = log.totalBytes();
+
+        timer.restart();
+        for (quint64 sequence = 1; sequence <= static_cast<quint64>(events); sequence += 10000) {
+            result.eventsRead += log.readSince(sequence, 10000).size();
+        }
+        result.readSinceSeconds = timer.nsecsElapsed() / 1e9;
+
+        timer.restart();
+        const qint64 startUs = makeEvent(1).timestampUs;
+        const qint64 stepUs = 10000LL * 1000;
+        for (qint64 from = startUs; from < startUs + events * 1000LL; from += stepUs) {
+            result.rangeEventsRead += log.readRange(from, from + stepUs - 1, 10000).size();
+        }
+        result.readRangeSeconds = timer.nsecsElapsed() / 1e9;
+
+        // The same places for both runs.
+        QRandomGenerator random(42);
+        timer.restart();
+        for (int i = 0; i < kShortRanges; ++i) {
+            const qint64 from = startUs + random.bounded(qMax<qint64>(1, events * 1000LL - kShortRangeUs));
+            log.readRange(from, from + kShortRangeUs - 1, 10000);
+        }
+        result.shortRangeSeconds = timer.nsecsElapsed() / 1e9;
+    }
+    return result;
+}
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    const int events = argc > 1 ? QByteArray(argv[1]).toInt() : 1000000;
+    QTextStream out(stdout);
+
+    const Result plain = run(events, -1);
+    const Result compressed = run(events, 0);
+    const double mib = 1024.0 * 1024.0;
+    out << "events: " << events << "\n";
+    for (const auto &[name, result] : {std::pair<const char *, Result>{"uncompressed", plain},
+                                       std::pair<const char *, Result>{"compressed", compressed}}) {
+        out << name << ": " << QString::number(result.bytes / mib, 'f', 1) << " MiB on disk, write "
+            << QString::number(result.writeSeconds, 'f', 2) << " s, readSince "
+            << QString::number(result.eventsRead / result.readSinceSeconds / 1e6, 'f', 2) << " M events/s, readRange "
+            << QString::number(result.rangeEventsRead / result.readRangeSeconds / 1e6, 'f', 2)
+            << " M events/s, 1 s range " << QString::number(result.shortRangeSeconds / kShortRanges * 1e6, 'f', 0)
+            << " us\n";
+    }
+    out << "bytes before/after compression: " << plain.bytes << " / " << compressed.bytes << ", ratio "
+        << QString::number(double(compressed.bytes) / plain.bytes, 'f', 3) << "\n";
+    return 0;
+}
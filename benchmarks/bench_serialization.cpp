@@ -0,0 +1,91 @@
+// Cost of marshalling events for D-Bus as the older QVariantList rows
+// (GetEventsSince) and as the typed (utxxxubbsssssa{sv}) structs
+// (GetEventsSince2, LogEvents). Both include building what is marshalled
+// from the stored events, as the daemon does for each reply.
+//
+//   bench_serialization [events] [rounds]
+
+#include <QCoreApplication>
+#include <QDBusArgument>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include <limits>
+
+#include "dbus_helpers.h"
+
+namespace {
+UsbEvent makeEvent(quint64 sequence) {
+    static const char *const kMessages[] = {
+        "usb 1-2: new high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: device descriptor read/64, error -71",
+        "usb 1-2: reset high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: USB disconnect, device number %1",
+        "xhci_hcd 0000:00:14.0: WARN Set TR Deq Ptr cmd failed due to incorrect slot or ep state",
+    };
+    UsbEvent event;
+    event.sequence = sequence;
+    event.timestampUs = 1700000000000000LL + static_cast<qint64>(sequence) * 1000;
+    event.monotonicUs = static_cast<qint64>(sequence) * 1000;
+    event.lastTimestampUs = event.timestampUs;
+    event.level = sequence % 7 == 0 ? QStringLiteral("error") : QStringLiteral("info");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("kernel");
+    event.deviceId = QStringLiteral("1-%1").arg(sequence % 4);
+    event.message = QString::fromLatin1(kMessages[sequence % 5]).arg(sequence % 128);
+    event.isUsb = true;
+    event.isError = sequence % 7 == 0;
+    return event;
+}
+
+// Fastest of rounds runs, to keep allocator warm-up out of the figures.
+template <typename Marshal>
+double bestSeconds(int rounds, Marshal marshal) {
+    double best = std::numeric_limits<double>::max();
+    for (int round = 0; round < rounds; ++round) {
+        QElapsedTimer timer;
+        timer.start();
+        marshal();
+        best = qMin(best, timer.nsecsElapsed() / 1e9);
+    }
+    return best;
+}
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    registerUsbDbusTypes();
+    const int count = qMax(1, argc > 1 ? QByteArray(argv[1]).toInt() : 100000);
+    const int rounds = qMax(1, argc > 2 ? QByteArray(argv[2]).toInt() : 5);
+    QTextStream out(stdout);
+
+    QList<UsbEvent> events;
+    events.reserve(count);
+    for (int i = 1; i <= count; ++i) {
+        events.append(makeEvent(static_cast<quint64>(i)));
+    }
+
+    const double variantSeconds = bestSeconds(rounds, [&]() {
+        QList<QVariantList> rows;
+        rows.reserve(events.size());
+        for (const UsbEvent &event : std::as_const(events)) {
+            rows.append(toVariant(event));
+        }
+        QDBusArgument argument;
+        argument << rows;
+    });
+    const double typedSeconds = bestSeconds(rounds, [&]() {
+        QDBusArgument argument;
+        argument << events;
+    });
+
+    out << "events: " << count << ", best of " << rounds << " rounds\n";
+    for (const auto &[name, seconds] : {std::pair<const char *, double>{"QVariantList", variantSeconds},
+                                        std::pair<const char *, double>{"typed struct", typedSeconds}}) {
+        out << name << ": " << QString::number(seconds * 1000, 'f', 1) << " ms, "
+            << QString::number(count / seconds / 1e6, 'f', 2) << " M events/s, "
+            << QString::number(seconds * 1e9 / count, 'f', 0) << " ns/event\n";
+    }
+    out << "typed / variant time: " << QString::number(typedSeconds / variantSeconds, 'f', 3) << "\n";
+    return 0;
+}
@@ -0,0 +1,159 @@
+// History reads through the shared event ring compared with D-Bus calls.
+//
+// First a ring of its own is written and read back, which needs no daemon.
+// Then, if usbscoped is running and offers its ring, the same ranges of its
+// newest events are read once from its ring and once with GetEventsSince2.
+//
+//   bench_sharedring [events] [page]
+
+#include <QCoreApplication>
+#include <QDBusInterface>
+#include <QDBusReply>
+#include <QDBusUnixFileDescriptor>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include <unistd.h>
+
+#include "dbus_helpers.h"
+#include "sharedeventring.h"
+
+namespace {
+UsbEvent makeEvent(quint64 sequence) {
+    static const char *const kMessages[] = {
+        "usb 1-2: new high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: device descriptor read/64, error -71",
+        "usb 1-2: reset high-speed USB device number %1 using xhci_hcd",
+        "usb 1-2: USB disconnect, device number %1",
+        "xhci_hcd 0000:00:14.0: WARN Set TR Deq Ptr cmd failed due to incorrect slot or ep state",
+    };
+    UsbEvent event;
+    event.sequence = sequence;
+    event.timestampUs = 1700000000000000LL + static_cast<qint64>(sequence) * 1000;
+    event.monotonicUs = static_cast<qint64>(sequence) * 1000;
+    event.lastTimestampUs = event.timestampUs;
+    event.level = sequence % 7 == 0 ? QStringLiteral("error") : QStringLiteral("info");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("kernel");
+    event.deviceId = QStringLiteral("1-%1").arg(sequence % 4);
+    event.message = QString::fromLatin1(kMessages[sequence % 5]).arg(sequence % 128);
+    event.isUsb = true;
+    event.isError = sequence % 7 == 0;
+    return event;
+}
+
+QString rate(qint64 events, double seconds) {
+    return QString::number(events / seconds / 1e6, 'f', 2) + " M events/s";
+}
+
+// Reads first..last in pages from ring; the events read, or -1 if the ring
+// no longer held some of them.
+qint64 readRing(const SharedEventRing &ring, quint64 first, quint64 last, int page) {
+    qint64 read = 0;
+    for (quint64 sequence = first; sequence <= last; sequence += static_cast<quint64>(page)) {
+        QList<UsbEvent> events;
+        if (!ring.readSince(sequence, page, events)) {
+            return -1;
+        }
+        read += events.size();
+    }
+    return read;
+}
+
+void benchLocalRing(QTextStream &out, int count, int page) {
+    SharedEventRing writer;
+    if (!writer.create(count)) {
+        out << "local ring: memfd_create failed\n";
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 1; i <= count; ++i) {
+        writer.write(makeEvent(static_cast<quint64>(i)));
+    }
+    const double writeSeconds = timer.nsecsElapsed() / 1e9;
+
+    // Read through a read-only mapping, as clients do.
+    SharedEventRing reader;
+    const int fd = writer.readOnlyDescriptor();
+    const bool attached = fd >= 0 && reader.attach(fd);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!attached) {
+        out << "local ring: attaching read-only failed\n";
+        return;
+    }
+    timer.restart();
+    const qint64 read = readRing(reader, reader.firstSequence(), reader.lastSequence(), page);
+    const double readSeconds = timer.nsecsElapsed() / 1e9;
+    out << "local ring, " << count << " events: write " << rate(count, writeSeconds) << ", readSince "
+        << rate(read, readSeconds) << "\n";
+}
+
+void benchDaemon(QTextStream &out, int count, int page) {
+    if (!isUsbScopeRunning()) {
+        out << "daemon: not running, D-Bus comparison skipped\n";
+        return;
+    }
+    QDBusInterface daemon("org.cachyos.USBscope", "/org/cachyos/USBscope/Daemon", "org.cachyos.USBscope1",
+                          usbscopeBus());
+    if (!(usbscopeBus().connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing)) {
+        out << "daemon: the bus cannot pass descriptors, D-Bus comparison skipped\n";
+        return;
+    }
+    QDBusReply<QDBusUnixFileDescriptor> reply = daemon.call("GetEventRing");
+    SharedEventRing ring;
+    if (!reply.isValid() || !ring.attach(reply.value().fileDescriptor())) {
+        out << "daemon: no shared ring (" << reply.error().message() << "), D-Bus comparison skipped\n";
+        return;
+    }
+    const quint64 last = ring.lastSequence();
+    if (last < ring.firstSequence()) {
+        out << "daemon: the ring is empty, D-Bus comparison skipped\n";
+        return;
+    }
+    // The newest count events the ring holds, so both sides read the same.
+    const quint64 first = qMax(ring.firstSequence(), last >= static_cast<quint64>(count)
+                                                         ? last - static_cast<quint64>(count) + 1
+                                                         : quint64(1));
+
+    QElapsedTimer timer;
+    timer.start();
+    const qint64 ringRead = readRing(ring, first, last, page);
+    const double ringSeconds = timer.nsecsElapsed() / 1e9;
+
+    timer.restart();
+    qint64 dbusRead = 0;
+    for (quint64 sequence = first; sequence <= last; sequence += static_cast<quint64>(page)) {
+        QDBusReply<QList<UsbEvent>> events =
+            daemon.call("GetEventsSince2", QVariant::fromValue<qulonglong>(sequence), page);
+        if (!events.isValid()) {
+            out << "daemon: GetEventsSince2 failed: " << events.error().message() << "\n";
+            return;
+        }
+        dbusRead += qMin<qint64>(events.value().size(), static_cast<qint64>(last - sequence + 1));
+    }
+    const double dbusSeconds = timer.nsecsElapsed() / 1e9;
+
+    out << "daemon, sequences " << first << ".." << last << " in pages of " << page << ":\n";
+    if (ringRead < 0) {
+        out << "  ring: overwritten while reading, rerun when the daemon is quieter\n";
+    } else {
+        out << "  ring: " << rate(ringRead, ringSeconds) << "\n";
+    }
+    out << "  GetEventsSince2: " << rate(dbusRead, dbusSeconds) << "\n";
+}
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    registerUsbDbusTypes();
+    const int count = qMax(1, argc > 1 ? QByteArray(argv[1]).toInt() : 16384);
+    const int page = qMax(1, argc > 2 ? QByteArray(argv[2]).toInt() : 1000);
+    QTextStream out(stdout);
+
+    benchLocalRing(out, count, page);
+    benchDaemon(out, count, page);
+    return 0;
+}
@@ -4,6 +4,9 @@
 #include <QDBusConnectionInterface>
 #include <QDBusError>
 #include <QDBusMetaType>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusUnixFileDescriptor>
 #include <QFileInfo>
 #include <QProcess>
 #include <QVariant>
@@ -12,11 +15,23 @@ namespace {
 const char *kServiceName = "org.cachyos.USBscope";
 const char *kObjectPath = "/org/cachyos/USBscope/Daemon";
 const char *kInterfaceName = "org.cachyos.USBscope1";
+// Events fetched per SyncEvents call while catching up.
+const int kSyncPageEvents = 1000;
+// Larger gaps are not fetched event by event; clients reload instead.
+const quint64 kMaxSyncEvents = 20000;
+// Versions of the typed structs, see dbus_helpers.h.
+const quint32 kEventStructVersion = 1;
+const quint32 kDeviceStructVersion = 1;
 }
 
 UsbscopeDBusClient::UsbscopeDBusClient(QObject *parent)
     : QObject(parent)
-    , m_interface(kServiceName, kObjectPath, kInterfaceName, usbscopeBus()) {
+    , m_interface(kServiceName, kObjectPath, kInterfaceName, usbscopeBus())
+    , m_watcher(kServiceName, usbscopeBus(), QDBusServiceWatcher::WatchForRegistration) {
+    // A restarted daemon may have stored events while nobody listened.
+    connect(&m_watcher, &QDBusServiceWatcher::serviceRegistered,
+            this, &UsbscopeDBusClient::handleServiceRegistered);
+
     QDBusConnection bus = usbscopeBus();
     bus.connect(
         kServiceName,
@@ -26,6 +41,40 @@ UsbscopeDBusClient::UsbscopeDBusClient(QObject *parent)
         this,
         SLOT(handleLogEvent(QVariantList)));
 
+    bus.connect(
+        kServiceName,
+        kObjectPath,
+        kInterfaceName,
+        "LogEvents",
+        this,
+        SLOT(handleLogEvents(QList<UsbEvent>)));
+
+    bus.connect(
+        kServiceName,
+        kObjectPath,
+        kInterfaceName,
+        "LogEventUpdated",
+        this,
+        SLOT(handleLogEventUpdated(UsbEvent)));
+
+    // Only sent to subscribers, so listening costs nothing until then, and
+    // nothing sent right after Subscribe returns is missed.
+    bus.connect(
+        kServiceName,
+        kObjectPath,
+        kInterfaceName,
+        "FilteredEvents",
+        this,
+        SLOT(handleFilteredEvents(uint,qulonglong,qulonglong,QList<UsbEvent>)));
+
+    bus.connect(
+        kServiceName,
+        kObjectPath,
+        kInterfaceName,
+        "FilteredEventUpdated",
+        this,
+        SLOT(handleFilteredEventUpdated(uint,UsbEvent)));
+
     bus.connect(
         kServiceName,
         kObjectPath,
@@ -43,8 +92,8 @@ UsbscopeDBusClient::UsbscopeDBusClient(QObject *parent)
         SLOT(handleErrorBurst(int,QString)));
 }
 
-QList<UsbEvent> UsbscopeDBusClient::getRecentEvents(int limit) {
-    QDBusReply<QList<QVariantList>> reply = m_interface.call("GetRecentEvents", limit);
+namespace {
+QList<UsbEvent> eventsFromReply(const QDBusReply<QList<QVariantList>> &reply) {
     QList<UsbEvent> events;
     if (!reply.isValid()) {
         return events;
@@ -54,8 +103,109 @@ QList<UsbEvent> UsbscopeDBusClient::getRecentEvents(int limit) {
     }
     return events;
 }
+}
+
+QList<UsbEvent> UsbscopeDBusClient::callEvents(const QString &method, const QVariantList &arguments) {
+    QDBusReply<QList<UsbEvent>> reply = m_interface.callWithArgumentList(QDBus::Block, method + "2", arguments);
+    if (reply.isValid()) {
+        return reply.value();
+    }
+    if (reply.error().type() != QDBusError::UnknownMethod) {
+        return {};
+    }
+    return eventsFromReply(m_interface.callWithArgumentList(QDBus::Block, method, arguments));
+}
+
+bool UsbscopeDBusClient::attachRing() {
+    if (m_ring) {
+        return true;
+    }
+    if (m_ringUnavailable) {
+        return false;
+    }
+    m_ringUnavailable = true;
+    if (!(usbscopeBus().connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing)) {
+        return false;
+    }
+    QDBusReply<QDBusUnixFileDescriptor> reply = m_interface.call("GetEventRing");
+    if (!reply.isValid() || !reply.value().isValid()) {
+        return false;
+    }
+    auto ring = std::make_unique<SharedEventRing>();
+    if (!ring->attach(reply.value().fileDescriptor())) {
+        return false;
+    }
+    m_ring = std::move(ring);
+    m_ringUnavailable = false;
+    return true;
+}
+
+QList<UsbEvent> UsbscopeDBusClient::getRecentEvents(int limit) {
+    QList<UsbEvent> events;
+    if (limit > 0 && attachRing()) {
+        // Only when the ring holds all limit events; the daemon may have
+        // more in memory than the ring.
+        const quint64 first = m_ring->firstSequence();
+        const quint64 last = m_ring->lastSequence();
+        if (last >= first && last - first + 1 >= static_cast<quint64>(limit)
+            && m_ring->readSince(last - static_cast<quint64>(limit) + 1, limit, events)) {
+            return events;
+        }
+    }
+    return callEvents("GetRecentEvents", {limit});
+}
+
+QList<UsbEvent> UsbscopeDBusClient::getEventsSince(quint64 sequence, int limit) {
+    QList<UsbEvent> events;
+    if (attachRing() && m_ring->readSince(sequence, limit, events)) {
+        return events;
+    }
+    return callEvents("GetEventsSince", {QVariant::fromValue<qulonglong>(sequence), limit});
+}
+
+bool UsbscopeDBusClient::syncEvents(quint64 sequence, int limit, QList<UsbEvent> &events,
+                                    quint64 &firstSequence, quint64 &lastSequence) {
+    if (attachRing()) {
+        // The ring holding sequence means nothing from there on was
+        // evicted, so its own oldest sequence serves as the daemon's.
+        const quint64 first = m_ring->firstSequence();
+        QList<UsbEvent> ringEvents;
+        if (m_ring->readSince(sequence, limit, ringEvents)) {
+            events = ringEvents;
+            firstSequence = first;
+            lastSequence = m_ring->lastSequence();
+            return true;
+        }
+    }
+    QDBusPendingReply<QList<UsbEvent>, qulonglong, qulonglong> reply =
+        m_interface.asyncCall("SyncEvents", QVariant::fromValue<qulonglong>(sequence), limit);
+    reply.waitForFinished();
+    if (!reply.isValid()) {
+        return false;
+    }
+    events = reply.argumentAt<0>();
+    firstSequence = reply.argumentAt<1>();
+    lastSequence = reply.argumentAt<2>();
+    return true;
+}
+
+QList<UsbEvent> UsbscopeDBusClient::getEventsInRange(qint64 startUs, qint64 endUs, int limit) {
+    return callEvents("GetEventsInRange",
+                      {QVariant::fromValue<qlonglong>(startUs), QVariant::fromValue<qlonglong>(endUs), limit});
+}
+
+QList<UsbEvent> UsbscopeDBusClient::searchEvents(const QString &query, int limit) {
+    return callEvents("SearchEvents", {query, limit});
+}
 
 QList<UsbDeviceInfo> UsbscopeDBusClient::getCurrentDevices() {
+    QDBusReply<QList<UsbDeviceInfo>> typedReply = m_interface.call("GetCurrentDevices2");
+    if (typedReply.isValid()) {
+        return typedReply.value();
+    }
+    if (typedReply.error().type() != QDBusError::UnknownMethod) {
+        return {};
+    }
     QDBusReply<QList<QVariantList>> reply = m_interface.call("GetCurrentDevices");
     QList<UsbDeviceInfo> devices;
     if (!reply.isValid()) {
@@ -67,13 +217,324 @@ QList<UsbDeviceInfo> UsbscopeDBusClient::getCurrentDevices() {
     return devices;
 }
 
+QList<UsbDeviceStats> UsbscopeDBusClient::getDeviceStats() {
+    QDBusReply<QList<QVariantList>> reply = m_interface.call("GetDeviceStats");
+    QList<UsbDeviceStats> stats;
+    if (!reply.isValid()) {
+        return stats;
+    }
+    for (const QVariantList &item : reply.value()) {
+        stats.append(deviceStatsFromVariant(item));
+    }
+    return stats;
+}
+
+void UsbscopeDBusClient::requestDeviceStats() {
+    if (m_deviceStatsPending) {
+        return;
+    }
+    m_deviceStatsPending = true;
+    auto *watcher = new QDBusPendingCallWatcher(m_interface.asyncCall("GetDeviceStats"), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *call) {
+        call->deleteLater();
+        m_deviceStatsPending = false;
+        const QDBusPendingReply<QList<QVariantList>> reply = *call;
+        if (!reply.isValid()) {
+            return;
+        }
+        QList<UsbDeviceStats> stats;
+        for (const QVariantList &item : reply.value()) {
+            stats.append(deviceStatsFromVariant(item));
+        }
+        emit DeviceStatsReceived(stats);
+    });
+}
+
 QVariantList UsbscopeDBusClient::getStateSummary() {
     QDBusReply<QVariantList> reply = m_interface.call("GetStateSummary");
     return reply.isValid() ? reply.value() : QVariantList{};
 }
 
+QList<UsbEvent> UsbscopeDBusClient::startSync(int limit) {
+    const QList<UsbEvent> events = getRecentEvents(limit);
+    m_lastSequence = 0;
+    m_lastTimestampUs = 0;
+    if (!events.isEmpty()) {
+        setDelivered(events.last());
+    }
+    return m_filter.matching(events);
+}
+
+bool UsbscopeDBusClient::setFilter(const EventFilter &filter) {
+    m_filter = filter;
+    return subscribe();
+}
+
+bool UsbscopeDBusClient::subscribe() {
+    if (m_subscriptionId != 0) {
+        m_interface.asyncCall("Unsubscribe", m_subscriptionId);
+        m_subscriptionId = 0;
+    }
+    if (m_filter.isEmpty()) {
+        listenToBroadcasts(true);
+        return true;
+    }
+    QDBusPendingReply<uint, qulonglong> reply = m_interface.asyncCall("Subscribe", m_filter.toSpec());
+    reply.waitForFinished();
+    if (!reply.isValid() || reply.argumentAt<0>() == 0) {
+        // Every event keeps coming and is filtered here.
+        listenToBroadcasts(true);
+        return false;
+    }
+    m_subscriptionId = reply.argumentAt<0>();
+    listenToBroadcasts(false);
+    if (m_lastSequence == 0) {
+        // Nothing delivered yet, so start with what comes next.
+        m_lastSequence = reply.argumentAt<1>();
+        m_lastTimestampUs = 0;
+    } else {
+        // The subscription starts after the daemon's newest event, so
+        // fetch what came since the last delivered one.
+        fillGap();
+    }
+    return true;
+}
+
+void UsbscopeDBusClient::listenToBroadcasts(bool enabled) {
+    if (enabled == m_broadcasts) {
+        return;
+    }
+    m_broadcasts = enabled;
+    QDBusConnection bus = usbscopeBus();
+    if (enabled) {
+        if (!m_batched) {
+            bus.connect(kServiceName, kObjectPath, kInterfaceName, "LogEvent",
+                        this, SLOT(handleLogEvent(QVariantList)));
+        }
+        bus.connect(kServiceName, kObjectPath, kInterfaceName, "LogEvents",
+                    this, SLOT(handleLogEvents(QList<UsbEvent>)));
+        bus.connect(kServiceName, kObjectPath, kInterfaceName, "LogEventUpdated",
+                    this, SLOT(handleLogEventUpdated(UsbEvent)));
+    } else {
+        if (!m_batched) {
+            bus.disconnect(kServiceName, kObjectPath, kInterfaceName, "LogEvent",
+                           this, SLOT(handleLogEvent(QVariantList)));
+        }
+        bus.disconnect(kServiceName, kObjectPath, kInterfaceName, "LogEvents",
+                       this, SLOT(handleLogEvents(QList<UsbEvent>)));
+        bus.disconnect(kServiceName, kObjectPath, kInterfaceName, "LogEventUpdated",
+                       this, SLOT(handleLogEventUpdated(UsbEvent)));
+    }
+}
+
+void UsbscopeDBusClient::resync() {
+    if (m_subscriptionId != 0) {
+        // Batches without a match send nothing, so the events since the
+        // last message are only fetched when a message was actually lost.
+        QDBusReply<qulonglong> reply = m_interface.call("GetSubscriptionSequence", m_subscriptionId);
+        if (!reply.isValid()) {
+            if (reply.error().type() == QDBusError::InvalidArgs) {
+                // The daemon no longer knows the subscription.
+                subscribe();
+            }
+            return;
+        }
+        if (reply.value() <= m_lastSequence) {
+            return;
+        }
+    }
+    fillGap();
+}
+
+void UsbscopeDBusClient::handleServiceRegistered() {
+    // A new daemon has its own ring and knows nothing of earlier
+    // subscriptions.
+    m_ring.reset();
+    m_ringUnavailable = false;
+    if (!m_filter.isEmpty()) {
+        m_subscriptionId = 0;
+        subscribe();
+    } else {
+        fillGap();
+    }
+}
+
+bool UsbscopeDBusClient::fillGap() {
+    if (m_lastSequence == 0 || m_resyncing) {
+        return true;
+    }
+    m_resyncing = true;
+    const quint64 start = m_lastSequence;
+    quint64 delivered = 0;
+    bool missed = false;
+    for (;;) {
+        // The last delivered event is requested too, when its timestamp is
+        // known, to check that the daemon still numbers the same history.
+        const bool anchored = m_lastTimestampUs != 0;
+        QList<UsbEvent> events;
+        quint64 firstSequence = 0;
+        quint64 lastSequence = 0;
+        if (!syncEvents(anchored ? m_lastSequence : m_lastSequence + 1, kSyncPageEvents, events,
+                        firstSequence, lastSequence)) {
+            // Unreachable or too old to know SyncEvents; a later resync
+            // continues from here.
+            m_resyncing = false;
+            return delivered > 0;
+        }
+        if (lastSequence < m_lastSequence || lastSequence - m_lastSequence + delivered > kMaxSyncEvents) {
+            m_resyncing = false;
+            emit HistoryReset();
+            return true;
+        }
+        int start = 0;
+        if (!anchored || firstSequence > m_lastSequence) {
+            // Nothing to compare against; the gap up to the oldest event
+            // still available is lost.
+            if (firstSequence > m_lastSequence + 1) {
+                missed = true;
+                emit EventsMissed(firstSequence - m_lastSequence - 1);
+            }
+        } else if (events.isEmpty() || events.first().sequence != m_lastSequence
+                   || events.first().timestampUs != m_lastTimestampUs) {
+            m_resyncing = false;
+            emit HistoryReset();
+            return true;
+        } else {
+            start = 1;
+        }
+        const QList<UsbEvent> fresh = events.mid(start);
+        if (!fresh.isEmpty()) {
+            setDelivered(fresh.last());
+            emitDelivered(fresh);
+            delivered += fresh.size();
+        }
+        if (m_lastSequence >= lastSequence || fresh.isEmpty()) {
+            break;
+        }
+    }
+    m_resyncing = false;
+    // Signals were lost, so repeat updates sent meanwhile may have been as
+    // well.
+    if (delivered > 0 || missed) {
+        recoverUpdates(start);
+    }
+    return true;
+}
+
+void UsbscopeDBusClient::recoverUpdates(quint64 sequence) {
+    QDBusPendingReply<QList<UsbEvent>, bool> reply =
+        m_interface.asyncCall("GetUpdatedEvents", QVariant::fromValue<qulonglong>(sequence));
+    reply.waitForFinished();
+    if (!reply.isValid()) {
+        // Older daemons cannot tell; counts of held events may lag behind.
+        return;
+    }
+    if (!reply.argumentAt<1>()) {
+        // Too many updates to know which held events are stale.
+        emit HistoryReset();
+        return;
+    }
+    for (const UsbEvent &event : reply.argumentAt<0>()) {
+        if (m_filter.matches(event)) {
+            emit LogEventUpdated(event);
+        }
+    }
+}
+
+void UsbscopeDBusClient::setDelivered(const UsbEvent &event) {
+    if (event.sequence != 0) {
+        m_lastSequence = event.sequence;
+        m_lastTimestampUs = event.timestampUs;
+    }
+}
+
+void UsbscopeDBusClient::emitDelivered(const QList<UsbEvent> &events) {
+    const QList<UsbEvent> matched = m_filter.matching(events);
+    if (matched.isEmpty()) {
+        return;
+    }
+    emit LogEvents(matched);
+    for (const UsbEvent &event : matched) {
+        emit LogEvent(event);
+    }
+}
+
+void UsbscopeDBusClient::deliver(const QList<UsbEvent> &events) {
+    QList<UsbEvent> fresh;
+    for (const UsbEvent &event : events) {
+        if (m_lastSequence != 0 && event.sequence != 0) {
+            if (event.sequence <= m_lastSequence) {
+                // Already delivered by a resync.
+                continue;
+            }
+            // Filling the gap delivers this event as well. If the daemon
+            // cannot be asked, it is delivered with the gap left open.
+            if (event.sequence > m_lastSequence + 1) {
+                emitDelivered(fresh);
+                fresh.clear();
+                if (fillGap()) {
+                    continue;
+                }
+            }
+        }
+        setDelivered(event);
+        fresh.append(event);
+    }
+    emitDelivered(fresh);
+}
+
 void UsbscopeDBusClient::handleLogEvent(const QVariantList &event) {
-    emit LogEvent(fromVariant(event));
+    deliver({fromVariant(event)});
+}
+
+void UsbscopeDBusClient::handleLogEvents(const QList<UsbEvent> &events) {
+    if (!m_batched) {
+        // The daemon sends batches, so the per-event signal only repeats
+        // them.
+        m_batched = true;
+        usbscopeBus().disconnect(kServiceName, kObjectPath, kInterfaceName, "LogEvent",
+                                 this, SLOT(handleLogEvent(QVariantList)));
+    }
+    deliver(events);
+}
+
+void UsbscopeDBusClient::handleLogEventUpdated(const UsbEvent &event) {
+    if (m_filter.matches(event)) {
+        emit LogEventUpdated(event);
+    }
+}
+
+void UsbscopeDBusClient::handleFilteredEvents(uint subscriptionId, qulonglong previousSequence,
+                                              qulonglong lastSequence, const QList<UsbEvent> &events) {
+    if (subscriptionId != m_subscriptionId || subscriptionId == 0) {
+        return;
+    }
+    // A message was lost if this one does not continue where the last one
+    // ended; filling the gap delivers these events as well.
+    if (m_lastSequence != 0 && previousSequence > m_lastSequence && fillGap()) {
+        return;
+    }
+    QList<UsbEvent> fresh;
+    for (const UsbEvent &event : events) {
+        if (event.sequence > m_lastSequence) {
+            fresh.append(event);
+        }
+    }
+    if (lastSequence > m_lastSequence) {
+        if (!fresh.isEmpty() && fresh.last().sequence == lastSequence) {
+            setDelivered(fresh.last());
+        } else {
+            m_lastSequence = lastSequence;
+            m_lastTimestampUs = 0;
+        }
+    }
+    emitDelivered(fresh);
+}
+
+void UsbscopeDBusClient::handleFilteredEventUpdated(uint subscriptionId, const UsbEvent &event) {
+    if (subscriptionId == m_subscriptionId && subscriptionId != 0) {
+        emit LogEventUpdated(event);
+    }
 }
 
 void UsbscopeDBusClient::handleDevicesChanged() {
@@ -96,9 +557,53 @@ QDBusConnection usbscopeBus() {
     return QDBusConnection::systemBus();
 }
 
+QDBusArgument &operator<<(QDBusArgument &argument, const UsbEvent &event) {
+    argument.beginStructure();
+    argument << kEventStructVersion << event.sequence << event.timestampUs << event.monotonicUs
+             << qMax(event.timestampUs, event.lastTimestampUs) << qMax(1u, event.repeatCount)
+             << event.isUsb << event.isError << event.level << event.subsystem << event.source
+             << event.deviceId << event.message << QVariantMap();
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, UsbEvent &event) {
+    quint32 version = 0;
+    QVariantMap extras;
+    argument.beginStructure();
+    argument >> version >> event.sequence >> event.timestampUs >> event.monotonicUs >> event.lastTimestampUs
+             >> event.repeatCount >> event.isUsb >> event.isError >> event.level >> event.subsystem
+             >> event.source >> event.deviceId >> event.message >> extras;
+    argument.endStructure();
+    event.repeatCount = qMax(1u, event.repeatCount);
+    return argument;
+}
+
+QDBusArgument &operator<<(QDBusArgument &argument, const UsbDeviceInfo &device) {
+    argument.beginStructure();
+    argument << kDeviceStructVersion << device.busId << device.deviceId << device.vendorId << device.productId
+             << device.summary << device.sysPath << device.busNumber << device.deviceNumber << QVariantMap();
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, UsbDeviceInfo &device) {
+    quint32 version = 0;
+    QVariantMap extras;
+    argument.beginStructure();
+    argument >> version >> device.busId >> device.deviceId >> device.vendorId >> device.productId
+             >> device.summary >> device.sysPath >> device.busNumber >> device.deviceNumber >> extras;
+    argument.endStructure();
+    return argument;
+}
+
 void registerUsbDbusTypes() {
     qRegisterMetaType<QList<QVariantList>>("QList<QVariantList>");
     qDBusRegisterMetaType<QList<QVariantList>>();
+    qDBusRegisterMetaType<UsbEvent>();
+    qDBusRegisterMetaType<QList<UsbEvent>>();
+    qDBusRegisterMetaType<UsbDeviceInfo>();
+    qDBusRegisterMetaType<QList<UsbDeviceInfo>>();
 }
 
 namespace {
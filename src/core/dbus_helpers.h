@@ -1,16 +1,43 @@
 #pragma once
 
+#include <QDBusArgument>
 #include <QDBusConnection>
 #include <QDBusInterface>
 #include <QDBusReply>
+#include <QDBusServiceWatcher>
 #include <QObject>
 
+#include <memory>
+
+#include "eventfilter.h"
+#include "sharedeventring.h"
 #include "usbtypes.h"
 
 // Thin client for talking to the usbscoped daemon over the
 // org.cachyos.USBscope1 D-Bus interface. Provides typed helpers for the
-// public methods (GetRecentEvents, GetCurrentDevices, GetStateSummary) and
-// re-emits the LogEvent / DevicesChanged / ErrorBurst signals as Qt signals.
+// public methods (GetRecentEvents, GetEventsSince, GetEventsInRange,
+// SearchEvents, GetCurrentDevices, GetDeviceStats, GetStateSummary) and
+// re-emits the LogEvent(s) / LogEventUpdated / DevicesChanged / ErrorBurst
+// signals as Qt signals. Once the daemon is seen sending LogEvents batches,
+// its per-event LogEvent signal is no longer listened to.
+//
+// Every stored event is delivered exactly once, in sequence order: the
+// client remembers the last sequence it delivered and fills any gap (a
+// missed signal, a daemon restart) with SyncEvents before delivering
+// newer events, so catching up costs as much as the gap. A gap also
+// fetches the repeat updates sent since the last delivered event
+// (GetUpdatedEvents) and re-emits them as LogEventUpdated. An update lost
+// without any event being lost goes unnoticed.
+//
+// With a filter set, the client subscribes to the daemon's matching events
+// only (FilteredEvents, sent to this client alone) and stops listening to
+// the broadcasts, so events nobody here wants do not wake it up.
+//
+// History reads (getRecentEvents, getEventsSince, syncEvents) are served
+// from the daemon's shared event ring when the daemon offers one and the
+// bus can pass descriptors, which avoids marshalling (the gain is not
+// measured; see bench_sharedring); whatever the ring no longer holds is
+// fetched with the method calls.
 
 class UsbscopeDBusClient : public QObject {
     Q_OBJECT
@@ -18,23 +45,124 @@ public:
     explicit UsbscopeDBusClient(QObject *parent = nullptr);
 
     QList<UsbEvent> getRecentEvents(int limit);
+    QList<UsbEvent> getEventsSince(quint64 sequence, int limit);
+    // Events with sequence >= sequence plus the oldest sequence the daemon
+    // still has and its newest one; false if the call failed.
+    bool syncEvents(quint64 sequence, int limit, QList<UsbEvent> &events, quint64 &firstSequence,
+                    quint64 &lastSequence);
+    QList<UsbEvent> getEventsInRange(qint64 startUs, qint64 endUs, int limit);
+    QList<UsbEvent> searchEvents(const QString &query, int limit);
     QList<UsbDeviceInfo> getCurrentDevices();
+    QList<UsbDeviceStats> getDeviceStats();
+    // Asks for the device statistics without waiting for the reply, which
+    // arrives as DeviceStatsReceived; nothing is emitted if the call fails.
+    // While a request is pending, further ones are ignored.
+    void requestDeviceStats();
     QVariantList getStateSummary();
 
+    // Fetches the newest limit events and continues delivery right after
+    // the newest of them. Returns those that match the filter.
+    QList<UsbEvent> startSync(int limit);
+
+    // Delivers only events matching filter from now on; an empty filter
+    // delivers every event. False if the daemon could not subscribe (it is
+    // not running or predates subscriptions); the filter is then applied
+    // here and the subscription retried when the daemon appears.
+    bool setFilter(const EventFilter &filter);
+    EventFilter filter() const { return m_filter; }
+
+public slots:
+    // Delivers the events stored since the last delivered one. Runs on its
+    // own when a gap is seen or the daemon reappears on the bus; calling it
+    // periodically also catches a lost final signal. While subscribed it
+    // only fetches when the daemon sent a message this client missed.
+    void resync();
+
 signals:
+    // New events, oldest first, once per received batch or resync page.
+    void LogEvents(const QList<UsbEvent> &events);
+    // Each event of LogEvents on its own, after the batch.
     void LogEvent(const UsbEvent &event);
+    // count events after the last delivered one were evicted before they
+    // could be fetched; delivery continues after them.
+    void EventsMissed(quint64 count);
+    // The daemon no longer knows the last delivered event (it restarted
+    // without persisted history) or the gap is too large to fetch; call
+    // startSync() to reload.
+    void HistoryReset();
+    // An earlier event, identified by its sequence, got more repeats.
+    void LogEventUpdated(const UsbEvent &event);
     void DevicesChanged();
     void ErrorBurst(int count, const QString &lastMessage);
+    void DeviceStatsReceived(const QList<UsbDeviceStats> &stats);
 
 private slots:
     void handleLogEvent(const QVariantList &event);
+    void handleLogEvents(const QList<UsbEvent> &events);
+    void handleLogEventUpdated(const UsbEvent &event);
+    void handleFilteredEvents(uint subscriptionId, qulonglong previousSequence, qulonglong lastSequence,
+                              const QList<UsbEvent> &events);
+    void handleFilteredEventUpdated(uint subscriptionId, const UsbEvent &event);
+    void handleServiceRegistered();
     void handleDevicesChanged();
     void handleErrorBurst(int count, const QString &lastMessage);
 
 private:
+    // Calls the typed variant of method (its name plus "2"), or method
+    // itself on daemons that predate the typed structs.
+    QList<UsbEvent> callEvents(const QString &method, const QVariantList &arguments);
+    // Emits the events that were not delivered before; a gap before one
+    // triggers a resync instead.
+    void deliver(const QList<UsbEvent> &events);
+    void emitDelivered(const QList<UsbEvent> &events);
+    void setDelivered(const UsbEvent &event);
+    // Delivers the events after the last delivered one; false if the daemon
+    // could not be asked.
+    bool fillGap();
+    // Emits LogEventUpdated for the events updated after sequence was
+    // stored, or HistoryReset if the daemon no longer knows them all.
+    void recoverUpdates(quint64 sequence);
+    // Subscribes with the current filter, replacing any subscription.
+    bool subscribe();
+    // Maps the daemon's shared event ring on first use; false if it offers
+    // none.
+    bool attachRing();
+    void listenToBroadcasts(bool enabled);
+
     QDBusInterface m_interface;
+    QDBusServiceWatcher m_watcher;
+    // Sequence and timestamp of the last delivered event; 0 until then or
+    // when the daemon does not number its events. With a subscription the
+    // sequence may be of an event that did not match, whose timestamp is
+    // not known (0).
+    quint64 m_lastSequence = 0;
+    qint64 m_lastTimestampUs = 0;
+    bool m_resyncing = false;
+    bool m_deviceStatsPending = false;
+    bool m_batched = false;
+    bool m_broadcasts = true;
+    EventFilter m_filter;
+    // 0 while not subscribed.
+    uint m_subscriptionId = 0;
+    std::unique_ptr<SharedEventRing> m_ring;
+    // GetEventRing failed; asked again once the daemon reappears.
+    bool m_ringUnavailable = false;
 };
 
+// Typed D-Bus structs of events and devices, streamed field by field:
+//   event  (u version, t sequence, x timestampUs, x monotonicUs,
+//           x lastTimestampUs, u repeatCount, b isUsb, b isError, s level,
+//           s subsystem, s source, s deviceId, s message, a{sv} extras)
+//   device (u version, s busId, s deviceId, s vendorId, s productId,
+//           s summary, s sysPath, i busNumber, i deviceNumber, a{sv} extras)
+// Fields added later go into extras under their name and bump the version,
+// so the signature stays the same and older readers skip what they do not
+// know.
+QDBusArgument &operator<<(QDBusArgument &argument, const UsbEvent &event);
+const QDBusArgument &operator>>(const QDBusArgument &argument, UsbEvent &event);
+QDBusArgument &operator<<(QDBusArgument &argument, const UsbDeviceInfo &device);
+const QDBusArgument &operator>>(const QDBusArgument &argument, UsbDeviceInfo &device);
+
 QDBusConnection usbscopeBus();
 void registerUsbDbusTypes();
 bool isUsbScopeRunning();
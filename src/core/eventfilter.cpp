@@ -0,0 +1,105 @@
+#include "eventfilter.h"
+
+namespace {
+bool readStrings(const QVariant &value, QStringList &strings) {
+    if (value.typeId() == QMetaType::QStringList) {
+        strings = value.toStringList();
+        return true;
+    }
+    if (value.typeId() == QMetaType::QString) {
+        strings = {value.toString()};
+        return true;
+    }
+    return false;
+}
+}
+
+bool EventFilter::fromSpec(const QVariantMap &spec, EventFilter &filter, QString *errorString) {
+    EventFilter parsed;
+    for (auto it = spec.cbegin(); it != spec.cend(); ++it) {
+        const QString &key = it.key();
+        const QVariant &value = it.value();
+        bool ok = true;
+        if (key == QLatin1String("level")) {
+            ok = readStrings(value, parsed.m_levels);
+        } else if (key == QLatin1String("deviceId")) {
+            ok = readStrings(value, parsed.m_deviceIds);
+        } else if (key == QLatin1String("isUsb")) {
+            ok = value.typeId() == QMetaType::Bool;
+            parsed.m_isUsb = value.toBool();
+        } else if (key == QLatin1String("isError")) {
+            ok = value.typeId() == QMetaType::Bool;
+            parsed.m_isError = value.toBool();
+        } else if (key == QLatin1String("text")) {
+            ok = value.typeId() == QMetaType::QString;
+            parsed.m_text = value.toString();
+        } else {
+            if (errorString) {
+                *errorString = QStringLiteral("Unknown filter field \"%1\"").arg(key);
+            }
+            return false;
+        }
+        if (!ok) {
+            if (errorString) {
+                *errorString = QStringLiteral("Filter field \"%1\" has the wrong type").arg(key);
+            }
+            return false;
+        }
+    }
+    filter = parsed;
+    return true;
+}
+
+QVariantMap EventFilter::toSpec() const {
+    QVariantMap spec;
+    if (!m_levels.isEmpty()) {
+        spec.insert("level", m_levels);
+    }
+    if (m_isUsb) {
+        spec.insert("isUsb", *m_isUsb);
+    }
+    if (m_isError) {
+        spec.insert("isError", *m_isError);
+    }
+    if (!m_deviceIds.isEmpty()) {
+        spec.insert("deviceId", m_deviceIds);
+    }
+    if (!m_text.isEmpty()) {
+        spec.insert("text", m_text);
+    }
+    return spec;
+}
+
+bool EventFilter::isEmpty() const {
+    return m_levels.isEmpty() && !m_isUsb && !m_isError && m_deviceIds.isEmpty() && m_text.isEmpty();
+}
+
+bool EventFilter::matches(const UsbEvent &event) const {
+    // Cheapest checks first; the text search runs only on what is left.
+    if (m_isUsb && event.isUsb != *m_isUsb) {
+        return false;
+    }
+    if (m_isError && event.isError != *m_isError) {
+        return false;
+    }
+    if (!m_levels.isEmpty() && !m_levels.contains(event.level)) {
+        return false;
+    }
+    if (!m_deviceIds.isEmpty() && !m_deviceIds.contains(event.deviceId)) {
+        return false;
+    }
+    return m_text.isEmpty() || event.message.contains(m_text, Qt::CaseInsensitive);
+}
+
+QList<UsbEvent> EventFilter::matching(const QList<UsbEvent> &events) const {
+    if (isEmpty()) {
+        return events;
+    }
+    QList<UsbEvent> matched;
+    for (const UsbEvent &event : events) {
+        if (matches(event)) {
+            matched.append(event);
+        }
+    }
+    return matched;
+}
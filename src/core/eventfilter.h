@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QStringList>
+#include <QVariantMap>
+
+#include <optional>
+
+#include "usbtypes.h"
+
+// Predicate over events, exchanged over D-Bus as a dictionary of the fields
+// to match. Every given field must match:
+//   "level"    as  the event has one of these levels
+//   "isUsb"    b
+//   "isError"  b
+//   "deviceId" as  the event comes from one of these devices
+//   "text"     s   the message contains it, ignoring case
+// An empty filter matches every event.
+class EventFilter {
+public:
+    // False, with the reason in errorString, for unknown keys or values of
+    // the wrong type.
+    static bool fromSpec(const QVariantMap &spec, EventFilter &filter, QString *errorString = nullptr);
+    QVariantMap toSpec() const;
+
+    void setLevels(const QStringList &levels) { m_levels = levels; }
+    void setUsb(bool isUsb) { m_isUsb = isUsb; }
+    void setError(bool isError) { m_isError = isError; }
+    void setDeviceIds(const QStringList &deviceIds) { m_deviceIds = deviceIds; }
+    void setText(const QString &text) { m_text = text; }
+
+    bool isEmpty() const;
+    bool matches(const UsbEvent &event) const;
+    QList<UsbEvent> matching(const QList<UsbEvent> &events) const;
+
+private:
+    QStringList m_levels;
+    std::optional<bool> m_isUsb;
+    std::optional<bool> m_isError;
+    QStringList m_deviceIds;
+    QString m_text;
+};
@@ -0,0 +1,301 @@
+#include "sharedeventring.h"
+
+#include <QByteArray>
+
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+const char kMagic[8] = {'U', 'S', 'B', 'R', 'I', 'N', 'G', '1'};
+// A slot that keeps changing under a reader is given up on after this
+// many attempts; the caller then falls back to D-Bus.
+const int kMaxReadAttempts = 64;
+
+enum SlotFlag : quint8 {
+    UsbFlag = 1 << 0,
+    ErrorFlag = 1 << 1,
+    // The strings did not fit the slot and were left out.
+    IncompleteFlag = 1 << 2,
+};
+
+static_assert(std::atomic<quint64>::is_always_lock_free,
+              "The ring is shared between processes and needs lock-free 64-bit atomics");
+}
+
+// Both structs live in shared memory and are only ever accessed through the
+// mapping, so they are plain data in native byte order.
+struct SharedEventRing::Header {
+    char magic[8];
+    quint32 version;
+    quint32 slotCount;
+    quint32 slotBytes;
+    quint32 reserved;
+    // First sequence ever written and the newest one; 0 before the first.
+    std::atomic<quint64> firstSequence;
+    std::atomic<quint64> lastSequence;
+    char padding[24];
+};
+
+struct SharedEventRing::Slot {
+    // Odd while the writer is changing the slot.
+    std::atomic<quint64> version;
+    quint64 sequence;
+    qint64 timestampUs;
+    qint64 monotonicUs;
+    qint64 lastTimestampUs;
+    quint32 repeatCount;
+    quint8 flags;
+    quint8 reserved[3];
+    // UTF-8 byte lengths of level, subsystem, source, device id and
+    // message, stored back to back in strings.
+    quint16 lengths[5];
+    quint16 reserved2;
+    char strings[kSlotBytes - 60];
+};
+
+SharedEventRing::~SharedEventRing() {
+    close();
+}
+
+void SharedEventRing::close() {
+    if (m_data) {
+        ::munmap(m_data, static_cast<size_t>(m_size));
+        m_data = nullptr;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_size = 0;
+    m_slotCount = 0;
+}
+
+SharedEventRing::Header *SharedEventRing::header() const {
+    return reinterpret_cast<Header *>(m_data);
+}
+
+SharedEventRing::Slot *SharedEventRing::slotFor(quint64 sequence) const {
+    return reinterpret_cast<Slot *>(m_data + sizeof(Header)) + sequence % m_slotCount;
+}
+
+bool SharedEventRing::create(int slotCount) {
+    static_assert(sizeof(Header) == 64, "Header layout changed");
+    static_assert(sizeof(Slot) == kSlotBytes, "Slot layout changed");
+    close();
+    if (slotCount <= 0) {
+        return false;
+    }
+    const int fd = ::memfd_create("usbscope-events", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return false;
+    }
+    const qint64 size = static_cast<qint64>(sizeof(Header)) + static_cast<qint64>(slotCount) * kSlotBytes;
+    // Clients cannot resize the memory under the daemon or each other.
+    if (::ftruncate(fd, size) != 0
+        || ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        ::close(fd);
+        return false;
+    }
+    m_fd = fd;
+    if (!map(fd, true)) {
+        close();
+        return false;
+    }
+    // The memfd starts zeroed, so every slot version and sequence is 0.
+    Header *ring = header();
+    std::memcpy(ring->magic, kMagic, sizeof(kMagic));
+    ring->version = kFormatVersion;
+    ring->slotCount = static_cast<quint32>(slotCount);
+    ring->slotBytes = kSlotBytes;
+    m_slotCount = static_cast<quint32>(slotCount);
+    return true;
+}
+
+bool SharedEventRing::map(int fd, bool writable) {
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(Header))) {
+        return false;
+    }
+    void *data = ::mmap(nullptr, static_cast<size_t>(info.st_size),
+                        writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    m_data = static_cast<char *>(data);
+    m_size = info.st_size;
+    return true;
+}
+
+int SharedEventRing::readOnlyDescriptor() const {
+    if (m_fd < 0) {
+        return -1;
+    }
+    // Reopening through /proc gives a descriptor that cannot be mapped
+    // writable, unlike a duplicate of the memfd itself.
+    const QByteArray path = "/proc/self/fd/" + QByteArray::number(m_fd);
+    return ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+}
+
+bool SharedEventRing::attach(int fd) {
+    close();
+    if (!map(fd, false)) {
+        return false;
+    }
+    const Header *ring = header();
+    if (std::memcmp(ring->magic, kMagic, sizeof(kMagic)) != 0 || ring->version != kFormatVersion
+        || ring->slotBytes != kSlotBytes || ring->slotCount == 0
+        || static_cast<qint64>(sizeof(Header)) + static_cast<qint64>(ring->slotCount) * kSlotBytes > m_size) {
+        close();
+        return false;
+    }
+    m_slotCount = ring->slotCount;
+    return true;
+}
+
+void SharedEventRing::write(const UsbEvent &event) {
+    if (!m_data || event.sequence == 0) {
+        return;
+    }
+    Slot *slot = slotFor(event.sequence);
+    const quint64 version = slot->version.load(std::memory_order_relaxed);
+    slot->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->sequence = event.sequence;
+    slot->timestampUs = event.timestampUs;
+    slot->monotonicUs = event.monotonicUs;
+    slot->lastTimestampUs = qMax(event.timestampUs, event.lastTimestampUs);
+    slot->repeatCount = qMax(1u, event.repeatCount);
+    slot->flags = (event.isUsb ? UsbFlag : 0) | (event.isError ? ErrorFlag : 0);
+    const QByteArray strings[5] = {event.level.toUtf8(), event.subsystem.toUtf8(), event.source.toUtf8(),
+                                   event.deviceId.toUtf8(), event.message.toUtf8()};
+    size_t total = 0;
+    for (const QByteArray &string : strings) {
+        total += static_cast<size_t>(string.size());
+    }
+    if (total > sizeof(slot->strings)) {
+        slot->flags |= IncompleteFlag;
+        std::memset(slot->lengths, 0, sizeof(slot->lengths));
+    } else {
+        char *out = slot->strings;
+        for (int i = 0; i < 5; ++i) {
+            slot->lengths[i] = static_cast<quint16>(strings[i].size());
+            std::memcpy(out, strings[i].constData(), static_cast<size_t>(strings[i].size()));
+            out += strings[i].size();
+        }
+    }
+
+    slot->version.store(version + 2, std::memory_order_release);
+    Header *ring = header();
+    if (ring->firstSequence.load(std::memory_order_relaxed) == 0) {
+        ring->firstSequence.store(event.sequence, std::memory_order_release);
+    }
+    ring->lastSequence.store(event.sequence, std::memory_order_release);
+}
+
+void SharedEventRing::updateRepeat(const UsbEvent &event) {
+    if (!m_data || event.sequence == 0) {
+        return;
+    }
+    Slot *slot = slotFor(event.sequence);
+    if (slot->sequence != event.sequence) {
+        return;
+    }
+    const quint64 version = slot->version.load(std::memory_order_relaxed);
+    slot->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->lastTimestampUs = qMax(event.timestampUs, event.lastTimestampUs);
+    slot->repeatCount = qMax(1u, event.repeatCount);
+    slot->version.store(version + 2, std::memory_order_release);
+}
+
+quint64 SharedEventRing::firstSequence() const {
+    if (!m_data) {
+        return 1;
+    }
+    const quint64 last = lastSequence();
+    const quint64 first = header()->firstSequence.load(std::memory_order_acquire);
+    if (first == 0) {
+        return last + 1;
+    }
+    return last >= m_slotCount ? qMax(first, last - m_slotCount + 1) : first;
+}
+
+quint64 SharedEventRing::lastSequence() const {
+    return m_data ? header()->lastSequence.load(std::memory_order_acquire) : 0;
+}
+
+bool SharedEventRing::readSlot(quint64 sequence, UsbEvent &event) const {
+    const Slot *slot = slotFor(sequence);
+    Slot copy;
+    for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+        const quint64 before = slot->version.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        // A write racing with the copy changes the version, and the copy is
+        // then discarded.
+        std::memcpy(reinterpret_cast<char *>(&copy) + sizeof(copy.version),
+                    reinterpret_cast<const char *>(slot) + sizeof(slot->version),
+                    sizeof(Slot) - sizeof(slot->version));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->version.load(std::memory_order_relaxed) != before) {
+            continue;
+        }
+        if (copy.sequence != sequence || (copy.flags & IncompleteFlag)) {
+            return false;
+        }
+        size_t total = 0;
+        for (quint16 length : copy.lengths) {
+            total += length;
+        }
+        if (total > sizeof(copy.strings)) {
+            return false;
+        }
+        const char *in = copy.strings;
+        QString *strings[5] = {&event.level, &event.subsystem, &event.source, &event.deviceId, &event.message};
+        for (int i = 0; i < 5; ++i) {
+            *strings[i] = QString::fromUtf8(in, copy.lengths[i]);
+            in += copy.lengths[i];
+        }
+        event.sequence = copy.sequence;
+        event.timestampUs = copy.timestampUs;
+        event.monotonicUs = copy.monotonicUs;
+        event.lastTimestampUs = copy.lastTimestampUs;
+        event.repeatCount = qMax(1u, copy.repeatCount);
+        event.isUsb = copy.flags & UsbFlag;
+        event.isError = copy.flags & ErrorFlag;
+        return true;
+    }
+    return false;
+}
+
+bool SharedEventRing::readSince(quint64 sequence, int limit, QList<UsbEvent> &events) const {
+    if (!m_data) {
+        return false;
+    }
+    const quint64 last = lastSequence();
+    if (last == 0 || sequence < firstSequence() || sequence > last + 1) {
+        return false;
+    }
+    if (sequence > last || limit <= 0) {
+        return true;
+    }
+    const quint64 end = qMin(last, sequence + static_cast<quint64>(limit) - 1);
+    QList<UsbEvent> read;
+    read.reserve(static_cast<qsizetype>(end - sequence + 1));
+    for (quint64 current = sequence; current <= end; ++current) {
+        UsbEvent event;
+        // Overwritten while reading: the rest is not in the ring anymore.
+        if (!readSlot(current, event)) {
+            return false;
+        }
+        read.append(event);
+    }
+    events.append(read);
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QList>
+#include <QtGlobal>
+
+#include "usbtypes.h"
+
+// Fixed-size ring of the newest stored events in a memfd that the daemon
+// writes and local clients map read-only, so reading history does not go
+// through D-Bus marshalling.
+//
+// The memory holds a small header (magic, format version, slot count and
+// size, first and last sequence written) followed by slots of kSlotBytes;
+// the event with sequence s lives in slot s % slotCount. Each slot is a
+// seqlock: the writer makes its version odd, writes the fields and strings
+// and makes it even again, and readers copy the slot and retry if the
+// version changed meanwhile. There is exactly one writer, so readers never
+// wait for a lock and never block the daemon. Events whose strings do not
+// fit a slot are marked incomplete and must be fetched over D-Bus.
+class SharedEventRing {
+public:
+    static constexpr quint32 kFormatVersion = 1;
+    static constexpr int kSlotBytes = 512;
+
+    SharedEventRing() = default;
+    ~SharedEventRing();
+    SharedEventRing(const SharedEventRing &) = delete;
+    SharedEventRing &operator=(const SharedEventRing &) = delete;
+
+    // Writer side. Creates a sealed memfd of slotCount slots.
+    bool create(int slotCount);
+    // Stores an event whose sequence is set and greater than the last one.
+    void write(const UsbEvent &event);
+    // Rewrites the repeat count and last timestamp of an event still in
+    // the ring.
+    void updateRepeat(const UsbEvent &event);
+    // A new read-only descriptor of the memfd for a client; the caller
+    // owns it. -1 on failure.
+    int readOnlyDescriptor() const;
+
+    // Reader side. Maps fd read-only; fd may be closed afterwards.
+    bool attach(int fd);
+    void close();
+
+    bool isOpen() const { return m_data != nullptr; }
+    int slotCount() const { return static_cast<int>(m_slotCount); }
+    // Oldest sequence still in the ring and the newest one; firstSequence()
+    // > lastSequence() while the ring is empty.
+    quint64 firstSequence() const;
+    quint64 lastSequence() const;
+    // Appends the up to limit events from sequence on. False, with events
+    // untouched, if one of them is no longer in the ring or incomplete.
+    bool readSince(quint64 sequence, int limit, QList<UsbEvent> &events) const;
+
+private:
+    struct Header;
+    struct Slot;
+
+    bool map(int fd, bool writable);
+    Header *header() const;
+    Slot *slotFor(quint64 sequence) const;
+    // Copies the slot of sequence consistently and decodes it; false if it
+    // holds another sequence or is incomplete.
+    bool readSlot(quint64 sequence, UsbEvent &event) const;
+
+    char *m_data = nullptr;
+    qint64 m_size = 0;
+    quint32 m_slotCount = 0;
+    // The memfd, kept by the writer only.
+    int m_fd = -1;
+};
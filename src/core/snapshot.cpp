@@ -0,0 +1,359 @@
+#include "snapshot.h"
+
+#include <QDateTime>
+#include <QHash>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace {
+const char kMagic[8] = {'U', 'S', 'B', 'S', 'N', 'A', 'P', '1'};
+// Header: magic, format version, header size, time of writing, then offset
+// and count of the event, device, statistics and metadata tables, and
+// offset and size of the string blob.
+const qint64 kHeaderBytes = 104;
+// String reference: offset into the string blob, length in bytes.
+const qint64 kStringBytes = 8;
+// Event: sequence, timestamp, monotonic time, last timestamp, repeat count,
+// flags, then level, subsystem, source, device and message.
+const qint64 kEventBytes = 4 * 8 + 2 * 4 + 5 * kStringBytes;
+// Device: bus id, device id, vendor id, product id, summary, sys path, bus
+// number, device number.
+const qint64 kDeviceBytes = 6 * kStringBytes + 2 * 4;
+// Statistics: device id, then the eight counters in UsbDeviceStats order.
+const qint64 kStatsBytes = kStringBytes + 8 * 8;
+// Metadata: key, value.
+const qint64 kMetadataBytes = 2 * kStringBytes;
+// Events are written in chunks of about this many bytes.
+const qsizetype kWriteChunkBytes = 256 * 1024;
+
+enum EventFlag : quint32 {
+    UsbFlag = 1 << 0,
+    ErrorFlag = 1 << 1,
+};
+
+template <typename T>
+void put(QByteArray &out, T value) {
+    const T little = qToLittleEndian(value);
+    out.append(reinterpret_cast<const char *>(&little), sizeof(T));
+}
+
+template <typename T>
+T get(const char *data) {
+    return qFromLittleEndian<T>(data);
+}
+
+// Collects the string blob while records are written. Short strings that
+// repeat across records are stored once.
+class StringBlob {
+public:
+    void append(QByteArray &record, const QString &value) {
+        put<quint32>(record, static_cast<quint32>(m_bytes.size()));
+        const QByteArray utf8 = value.toUtf8();
+        put<quint32>(record, static_cast<quint32>(utf8.size()));
+        m_bytes.append(utf8);
+    }
+
+    void intern(QByteArray &record, const QString &value) {
+        auto it = m_interned.constFind(value);
+        if (it == m_interned.constEnd()) {
+            const QByteArray utf8 = value.toUtf8();
+            it = m_interned.insert(value, {static_cast<quint32>(m_bytes.size()), static_cast<quint32>(utf8.size())});
+            m_bytes.append(utf8);
+        }
+        put<quint32>(record, it->first);
+        put<quint32>(record, it->second);
+    }
+
+    const QByteArray &bytes() const { return m_bytes; }
+
+private:
+    QByteArray m_bytes;
+    QHash<QString, std::pair<quint32, quint32>> m_interned;
+};
+
+// Whether count records of recordBytes starting at offset fit in size.
+bool tableFits(qint64 offset, quint64 count, qint64 recordBytes, qint64 size) {
+    if (offset < kHeaderBytes || offset > size) {
+        return false;
+    }
+    return count <= static_cast<quint64>((size - offset) / recordBytes);
+}
+}
+
+Snapshot::~Snapshot() {
+    close();
+}
+
+bool Snapshot::write(const QString &path,
+                     const QVector<UsbEvent> &events,
+                     const QList<UsbDeviceInfo> &devices,
+                     const QList<UsbDeviceStats> &deviceStats,
+                     const QMap<QString, QString> &metadata,
+                     QString *errorString) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        if (errorString) {
+            *errorString = file.errorString();
+        }
+        return false;
+    }
+
+    StringBlob strings;
+    QByteArray chunk;
+    chunk.reserve(kWriteChunkBytes + kEventBytes);
+    // Placeholder, rewritten once the table offsets are known.
+    file.write(QByteArray(kHeaderBytes, '\0'));
+
+    const qint64 eventsOffset = kHeaderBytes;
+    for (const UsbEvent &event : events) {
+        put<quint64>(chunk, event.sequence);
+        put<qint64>(chunk, event.timestampUs);
+        put<qint64>(chunk, event.monotonicUs);
+        put<qint64>(chunk, qMax(event.timestampUs, event.lastTimestampUs));
+        put<quint32>(chunk, qMax(1u, event.repeatCount));
+        put<quint32>(chunk, (event.isUsb ? UsbFlag : 0) | (event.isError ? ErrorFlag : 0));
+        strings.intern(chunk, event.level);
+        strings.intern(chunk, event.subsystem);
+        strings.intern(chunk, event.source);
+        strings.intern(chunk, event.deviceId);
+        strings.append(chunk, event.message);
+        if (chunk.size() >= kWriteChunkBytes) {
+            file.write(chunk);
+            chunk.clear();
+        }
+    }
+
+    const qint64 devicesOffset = eventsOffset + events.size() * kEventBytes;
+    for (const UsbDeviceInfo &device : devices) {
+        strings.intern(chunk, device.busId);
+        strings.intern(chunk, device.deviceId);
+        strings.intern(chunk, device.vendorId);
+        strings.intern(chunk, device.productId);
+        strings.append(chunk, device.summary);
+        strings.append(chunk, device.sysPath);
+        put<qint32>(chunk, device.busNumber);
+        put<qint32>(chunk, device.deviceNumber);
+    }
+
+    const qint64 statsOffset = devicesOffset + devices.size() * kDeviceBytes;
+    for (const UsbDeviceStats &stats : deviceStats) {
+        strings.intern(chunk, stats.deviceId);
+        put<quint64>(chunk, stats.totalEvents);
+        put<quint64>(chunk, stats.errors);
+        put<quint64>(chunk, stats.resets);
+        put<quint64>(chunk, stats.disconnects);
+        put<qint64>(chunk, stats.lastErrorUs);
+        put<quint64>(chunk, stats.errorsLastMinute);
+        put<quint64>(chunk, stats.errorsLast15Minutes);
+        put<quint64>(chunk, stats.errorsLastHour);
+    }
+
+    const qint64 metadataOffset = statsOffset + deviceStats.size() * kStatsBytes;
+    for (auto it = metadata.cbegin(); it != metadata.cend(); ++it) {
+        strings.append(chunk, it.key());
+        strings.append(chunk, it.value());
+    }
+    file.write(chunk);
+
+    const qint64 stringsOffset = metadataOffset + metadata.size() * kMetadataBytes;
+    if (strings.bytes().size() > std::numeric_limits<quint32>::max()) {
+        if (errorString) {
+            *errorString = QStringLiteral("Too much text for one snapshot");
+        }
+        file.cancelWriting();
+        return false;
+    }
+    file.write(strings.bytes());
+
+    QByteArray header;
+    header.append(kMagic, sizeof(kMagic));
+    put<quint32>(header, kFormatVersion);
+    put<quint32>(header, static_cast<quint32>(kHeaderBytes));
+    put<qint64>(header, QDateTime::currentMSecsSinceEpoch() * 1000);
+    put<quint64>(header, static_cast<quint64>(eventsOffset));
+    put<quint64>(header, static_cast<quint64>(events.size()));
+    put<quint64>(header, static_cast<quint64>(devicesOffset));
+    put<quint64>(header, static_cast<quint64>(devices.size()));
+    put<quint64>(header, static_cast<quint64>(statsOffset));
+    put<quint64>(header, static_cast<quint64>(deviceStats.size()));
+    put<quint64>(header, static_cast<quint64>(metadataOffset));
+    put<quint64>(header, static_cast<quint64>(metadata.size()));
+    put<quint64>(header, static_cast<quint64>(stringsOffset));
+    put<quint64>(header, static_cast<quint64>(strings.bytes().size()));
+    if (!file.seek(0) || file.write(header) != header.size() || !file.commit()) {
+        if (errorString) {
+            *errorString = file.errorString();
+        }
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::open(const QString &path) {
+    close();
+    m_errorString.clear();
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        return fail(m_file.errorString());
+    }
+    m_size = m_file.size();
+    if (m_size < kHeaderBytes) {
+        return fail(QStringLiteral("Not a USBscope snapshot"));
+    }
+    const uchar *map = m_file.map(0, m_size);
+    if (!map) {
+        return fail(m_file.errorString());
+    }
+    const char *data = reinterpret_cast<const char *>(map);
+    m_data = data;
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0) {
+        return fail(QStringLiteral("Not a USBscope snapshot"));
+    }
+    const quint32 version = get<quint32>(data + 8);
+    if (version != kFormatVersion) {
+        return fail(QStringLiteral("Unsupported snapshot version %1").arg(version));
+    }
+    if (get<quint32>(data + 12) < kHeaderBytes) {
+        return fail(QStringLiteral("Corrupt snapshot header"));
+    }
+    m_createdUs = get<qint64>(data + 16);
+    m_eventsOffset = static_cast<qint64>(get<quint64>(data + 24));
+    m_eventCount = get<quint64>(data + 32);
+    m_devicesOffset = static_cast<qint64>(get<quint64>(data + 40));
+    m_deviceCount = get<quint64>(data + 48);
+    m_statsOffset = static_cast<qint64>(get<quint64>(data + 56));
+    m_statsCount = get<quint64>(data + 64);
+    m_metadataOffset = static_cast<qint64>(get<quint64>(data + 72));
+    m_metadataCount = get<quint64>(data + 80);
+    m_stringsOffset = static_cast<qint64>(get<quint64>(data + 88));
+    m_stringsBytes = static_cast<qint64>(get<quint64>(data + 96));
+    if (m_eventCount > static_cast<quint64>(std::numeric_limits<int>::max())
+        || !tableFits(m_eventsOffset, m_eventCount, kEventBytes, m_size)
+        || !tableFits(m_devicesOffset, m_deviceCount, kDeviceBytes, m_size)
+        || !tableFits(m_statsOffset, m_statsCount, kStatsBytes, m_size)
+        || !tableFits(m_metadataOffset, m_metadataCount, kMetadataBytes, m_size)
+        || !tableFits(m_stringsOffset, static_cast<quint64>(m_stringsBytes), 1, m_size)) {
+        return fail(QStringLiteral("Corrupt snapshot header"));
+    }
+    return true;
+}
+
+void Snapshot::close() {
+    if (m_data) {
+        m_file.unmap(reinterpret_cast<uchar *>(const_cast<char *>(m_data)));
+        m_data = nullptr;
+    }
+    m_file.close();
+    m_size = 0;
+    m_eventCount = 0;
+    m_deviceCount = 0;
+    m_statsCount = 0;
+    m_metadataCount = 0;
+}
+
+bool Snapshot::fail(const QString &message) {
+    m_errorString = message;
+    close();
+    return false;
+}
+
+const char *Snapshot::eventRecord(int index) const {
+    return m_data + m_eventsOffset + index * kEventBytes;
+}
+
+QString Snapshot::string(const char *reference) const {
+    const quint32 offset = get<quint32>(reference);
+    const quint32 length = get<quint32>(reference + 4);
+    // Out-of-range references of a damaged file read as empty strings.
+    if (offset > m_stringsBytes || length > m_stringsBytes - offset) {
+        return {};
+    }
+    return QString::fromUtf8(m_data + m_stringsOffset + offset, length);
+}
+
+UsbEvent Snapshot::event(int index) const {
+    const char *record = eventRecord(index);
+    UsbEvent event;
+    event.sequence = get<quint64>(record);
+    event.timestampUs = get<qint64>(record + 8);
+    event.monotonicUs = get<qint64>(record + 16);
+    event.lastTimestampUs = get<qint64>(record + 24);
+    event.repeatCount = qMax(1u, get<quint32>(record + 32));
+    const quint32 flags = get<quint32>(record + 36);
+    event.isUsb = flags & UsbFlag;
+    event.isError = flags & ErrorFlag;
+    event.level = string(record + 40);
+    event.subsystem = string(record + 48);
+    event.source = string(record + 56);
+    event.deviceId = string(record + 64);
+    event.message = string(record + 72);
+    return event;
+}
+
+quint64 Snapshot::sequence(int index) const {
+    return get<quint64>(eventRecord(index));
+}
+
+qint64 Snapshot::timestampUs(int index) const {
+    return get<qint64>(eventRecord(index) + 8);
+}
+
+bool Snapshot::isUsb(int index) const {
+    return get<quint32>(eventRecord(index) + 36) & UsbFlag;
+}
+
+bool Snapshot::isError(int index) const {
+    return get<quint32>(eventRecord(index) + 36) & ErrorFlag;
+}
+
+QList<UsbDeviceInfo> Snapshot::devices() const {
+    QList<UsbDeviceInfo> devices;
+    devices.reserve(static_cast<qsizetype>(m_deviceCount));
+    for (quint64 i = 0; i < m_deviceCount; ++i) {
+        const char *record = m_data + m_devicesOffset + i * kDeviceBytes;
+        UsbDeviceInfo device;
+        device.busId = string(record);
+        device.deviceId = string(record + 8);
+        device.vendorId = string(record + 16);
+        device.productId = string(record + 24);
+        device.summary = string(record + 32);
+        device.sysPath = string(record + 40);
+        device.busNumber = get<qint32>(record + 48);
+        device.deviceNumber = get<qint32>(record + 52);
+        devices.append(device);
+    }
+    return devices;
+}
+
+QList<UsbDeviceStats> Snapshot::deviceStats() const {
+    QList<UsbDeviceStats> stats;
+    stats.reserve(static_cast<qsizetype>(m_statsCount));
+    for (quint64 i = 0; i < m_statsCount; ++i) {
+        const char *record = m_data + m_statsOffset + i * kStatsBytes;
+        UsbDeviceStats device;
+        device.deviceId = string(record);
+        device.totalEvents = get<quint64>(record + 8);
+        device.errors = get<quint64>(record + 16);
+        device.resets = get<quint64>(record + 24);
+        device.disconnects = get<quint64>(record + 32);
+        device.lastErrorUs = get<qint64>(record + 40);
+        device.errorsLastMinute = get<quint64>(record + 48);
+        device.errorsLast15Minutes = get<quint64>(record + 56);
+        device.errorsLastHour = get<quint64>(record + 64);
+        stats.append(device);
+    }
+    return stats;
+}
+
+QMap<QString, QString> Snapshot::metadata() const {
+    QMap<QString, QString> metadata;
+    for (quint64 i = 0; i < m_metadataCount; ++i) {
+        const char *record = m_data + m_metadataOffset + i * kMetadataBytes;
+        metadata.insert(string(record), string(record + 8));
+    }
+    return metadata;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QFile>
+#include <QList>
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include "usbtypes.h"
+
+// Self-contained binary copy of the daemon's state for offline analysis:
+// events, the device table, per-device statistics and free-form metadata
+// (host, kernel, time of writing, ...).
+//
+// The file starts with a fixed header (magic, format version and the offset
+// and count of each table) followed by tables of fixed-size little-endian
+// records and one UTF-8 string blob that records point into by offset and
+// length. Repeated short strings such as levels and device ids are stored
+// once. Because every record has a fixed size, opening a snapshot only maps
+// the file and checks the header; events are decoded when they are read.
+class Snapshot {
+public:
+    static constexpr quint32 kFormatVersion = 1;
+
+    Snapshot() = default;
+    ~Snapshot();
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    // Writes a snapshot atomically. Events should be in sequence order.
+    static bool write(const QString &path,
+                      const QVector<UsbEvent> &events,
+                      const QList<UsbDeviceInfo> &devices,
+                      const QList<UsbDeviceStats> &deviceStats,
+                      const QMap<QString, QString> &metadata,
+                      QString *errorString = nullptr);
+
+    // Maps the file read-only; the mapping lives as long as this object.
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const { return m_data != nullptr; }
+    QString path() const { return m_file.fileName(); }
+    QString errorString() const { return m_errorString; }
+
+    qint64 createdUs() const { return m_createdUs; }
+    int eventCount() const { return static_cast<int>(m_eventCount); }
+    UsbEvent event(int index) const;
+    // Single fields of an event, read without decoding its strings.
+    quint64 sequence(int index) const;
+    qint64 timestampUs(int index) const;
+    bool isUsb(int index) const;
+    bool isError(int index) const;
+
+    QList<UsbDeviceInfo> devices() const;
+    QList<UsbDeviceStats> deviceStats() const;
+    QMap<QString, QString> metadata() const;
+
+private:
+    bool fail(const QString &message);
+    const char *eventRecord(int index) const;
+    QString string(const char *reference) const;
+
+    QFile m_file;
+    const char *m_data = nullptr;
+    qint64 m_size = 0;
+    QString m_errorString;
+    qint64 m_createdUs = 0;
+    qint64 m_eventsOffset = 0;
+    quint64 m_eventCount = 0;
+    qint64 m_devicesOffset = 0;
+    quint64 m_deviceCount = 0;
+    qint64 m_statsOffset = 0;
+    quint64 m_statsCount = 0;
+    qint64 m_metadataOffset = 0;
+    quint64 m_metadataCount = 0;
+    qint64 m_stringsOffset = 0;
+    qint64 m_stringsBytes = 0;
+};
@@ -1,15 +1,44 @@
 #include "usbtypes.h"
 
+#include <QDateTime>
+
+namespace {
+// Format of the legacy string timestamp carried in field 0 of the event
+// variant, kept so older clients keep displaying and filtering events.
+const char *kLegacyTimestampFormat = "MMM dd hh:mm:ss";
+
+qint64 parseLegacyTimestamp(const QString &timestamp) {
+    QDateTime time = QDateTime::fromString(timestamp, Qt::ISODate);
+    if (!time.isValid()) {
+        time = QDateTime::fromString(timestamp, kLegacyTimestampFormat);
+        // The legacy format has no year.
+        if (time.isValid()) {
+            time.setDate(QDate(QDate::currentDate().year(), time.date().month(), time.date().day()));
+        }
+    }
+    return time.isValid() ? time.toMSecsSinceEpoch() * 1000 : 0;
+}
+}
+
+QString formatTimestamp(qint64 timestampUs) {
+    return QDateTime::fromMSecsSinceEpoch(timestampUs / 1000).toString("MMM dd hh:mm:ss.zzz");
+}
+
 QVariantList toVariant(const UsbEvent &event) {
     return {
-        event.timestamp,
+        QDateTime::fromMSecsSinceEpoch(event.timestampUs / 1000).toString(kLegacyTimestampFormat),
         event.level,
         event.subsystem,
         event.source,
         event.message,
         event.isUsb,
         event.isError,
-        event.deviceId
+        event.deviceId,
+        event.timestampUs,
+        event.monotonicUs,
+        event.sequence,
+        event.repeatCount,
+        event.lastTimestampUs
     };
 }
 
@@ -18,7 +47,6 @@ UsbEvent fromVariant(const QVariantList &data) {
     if (data.size() < 8) {
         return event;
     }
-    event.timestamp = data.at(0).toString();
     event.level = data.at(1).toString();
     event.subsystem = data.at(2).toString();
     event.source = data.at(3).toString();
@@ -26,6 +54,23 @@ UsbEvent fromVariant(const QVariantList &data) {
     event.isUsb = data.at(5).toBool();
     event.isError = data.at(6).toBool();
     event.deviceId = data.at(7).toString();
+    if (data.size() >= 10) {
+        event.timestampUs = data.at(8).toLongLong();
+        event.monotonicUs = data.at(9).toLongLong();
+        if (data.size() >= 11) {
+            event.sequence = data.at(10).toULongLong();
+        }
+        if (data.size() >= 13) {
+            event.repeatCount = qMax(1u, data.at(11).toUInt());
+            event.lastTimestampUs = data.at(12).toLongLong();
+        }
+    } else {
+        // Daemons predating numeric timestamps only send the display string.
+        event.timestampUs = parseLegacyTimestamp(data.at(0).toString());
+    }
+    if (event.lastTimestampUs == 0) {
+        event.lastTimestampUs = event.timestampUs;
+    }
     return event;
 }
 
@@ -36,7 +81,9 @@ QVariantList toVariant(const UsbDeviceInfo &device) {
         device.vendorId,
         device.productId,
         device.summary,
-        device.sysPath
+        device.sysPath,
+        device.busNumber,
+        device.deviceNumber
     };
 }
 
@@ -51,5 +98,45 @@ UsbDeviceInfo deviceFromVariant(const QVariantList &data) {
     device.productId = data.at(3).toString();
     device.summary = data.at(4).toString();
     device.sysPath = data.at(5).toString();
+    if (data.size() >= 8) {
+        device.busNumber = data.at(6).toInt();
+        device.deviceNumber = data.at(7).toInt();
+    }
     return device;
 }
+
+QVariantList toVariant(const UsbDeviceStats &stats) {
+    return {
+        stats.deviceId,
+        stats.totalEvents,
+        stats.errors,
+        stats.resets,
+        stats.disconnects,
+        stats.lastErrorUs,
+        stats.errorsLastMinute,
+        stats.errorsLast15Minutes,
+        stats.errorsLastHour,
+        stats.firstEventUs
+    };
+}
+
+UsbDeviceStats deviceStatsFromVariant(const QVariantList &data) {
+    UsbDeviceStats stats;
+    if (data.size() < 9) {
+        return stats;
+    }
+    stats.deviceId = data.at(0).toString();
+    stats.totalEvents = data.at(1).toULongLong();
+    stats.errors = data.at(2).toULongLong();
+    stats.resets = data.at(3).toULongLong();
+    stats.disconnects = data.at(4).toULongLong();
+    stats.lastErrorUs = data.at(5).toLongLong();
+    stats.errorsLastMinute = data.at(6).toULongLong();
+    stats.errorsLast15Minutes = data.at(7).toULongLong();
+    stats.errorsLastHour = data.at(8).toULongLong();
+    // Older daemons do not report the start of their counters.
+    if (data.size() > 9) {
+        stats.firstEventUs = data.at(9).toLongLong();
+    }
+    return stats;
+}
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <QMetaType>
 #include <QString>
 #include <QVariantList>
 
 struct UsbEvent {
-    QString timestamp;
+    // Realtime clock, microseconds since the Unix epoch.
+    qint64 timestampUs = 0;
+    // CLOCK_MONOTONIC of the boot the event was logged in, microseconds;
+    // 0 when the source does not provide it.
+    qint64 monotonicUs = 0;
     QString level;
     QString subsystem;
     QString source;
@@ -12,6 +17,15 @@ struct UsbEvent {
     bool isUsb = false;
     bool isError = false;
     QString deviceId;
+    // Position in the daemon's event store, increasing by one per stored
+    // event and never reused; 0 for events that were not stored.
+    quint64 sequence = 0;
+    // Consecutive occurrences of the same message from the same device that
+    // were coalesced into this event; timestampUs is the first of them.
+    quint32 repeatCount = 1;
+    // Timestamp of the last occurrence. Log sources leave it 0; stored
+    // events carry timestampUs here when they were not repeated.
+    qint64 lastTimestampUs = 0;
 };
 
 struct UsbDeviceInfo {
@@ -21,10 +35,39 @@ struct UsbDeviceInfo {
     QString productId;
     QString summary;
     QString sysPath;
+    int busNumber = 0;
+    int deviceNumber = 0;
 };
 
+// Counters the daemon keeps per device since it started (including the
+// history it restored). The error windows end at the time of the query.
+struct UsbDeviceStats {
+    QString deviceId;
+    quint64 totalEvents = 0;
+    quint64 errors = 0;
+    quint64 resets = 0;
+    quint64 disconnects = 0;
+    // Timestamp of the newest error, microseconds since the epoch; 0 if none.
+    qint64 lastErrorUs = 0;
+    quint64 errorsLastMinute = 0;
+    quint64 errorsLast15Minutes = 0;
+    quint64 errorsLastHour = 0;
+    // Timestamp of the oldest event counted, microseconds since the epoch;
+    // the counters cover the time since then. 0 if unknown.
+    qint64 firstEventUs = 0;
+};
+
+Q_DECLARE_METATYPE(UsbEvent)
+Q_DECLARE_METATYPE(UsbDeviceInfo)
+
+// Human-readable local time for display, with millisecond precision.
+QString formatTimestamp(qint64 timestampUs);
+
 QVariantList toVariant(const UsbEvent &event);
 UsbEvent fromVariant(const QVariantList &data);
 
 QVariantList toVariant(const UsbDeviceInfo &device);
 UsbDeviceInfo deviceFromVariant(const QVariantList &data);
+
+QVariantList toVariant(const UsbDeviceStats &stats);
+UsbDeviceStats deviceStatsFromVariant(const QVariantList &data);
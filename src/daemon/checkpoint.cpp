@@ -0,0 +1,107 @@
+#include "checkpoint.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <unistd.h>
+
+namespace {
+QByteArray readBootId() {
+    QFile file("/proc/sys/kernel/random/boot_id");
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+    return file.readAll().trimmed();
+}
+}
+
+Checkpoint::Checkpoint(const QString &path, QObject *parent)
+    : QObject(parent), m_path(path), m_bootId(readBootId()) {
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(5000);
+    connect(&m_flushTimer, &QTimer::timeout, this, &Checkpoint::flush);
+}
+
+QString Checkpoint::defaultPath() {
+    if (::geteuid() == 0) {
+        return QStringLiteral("/var/lib/usbscope/checkpoint");
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/checkpoint";
+}
+
+void Checkpoint::setFlushInterval(int msec) {
+    m_flushTimer.setInterval(msec);
+}
+
+void Checkpoint::load() {
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return;
+    }
+    while (!file.atEnd()) {
+        const QByteArray line = file.readLine().trimmed();
+        const qsizetype separator = line.indexOf('=');
+        if (separator <= 0) {
+            continue;
+        }
+        const QByteArray key = line.left(separator);
+        const QByteArray value = line.mid(separator + 1);
+        if (key == "journal-cursor") {
+            m_journalCursor = value;
+        } else if (key == "kmsg-boot-id") {
+            m_kmsgBootId = value;
+        } else if (key == "kmsg-sequence") {
+            m_kmsgSequence = value.toULongLong();
+        }
+    }
+}
+
+bool Checkpoint::hasKmsgSequence() const {
+    return !m_bootId.isEmpty() && m_kmsgBootId == m_bootId;
+}
+
+void Checkpoint::setJournalCursor(const QByteArray &cursor) {
+    m_journalCursor = cursor;
+    markDirty();
+}
+
+void Checkpoint::setKmsgSequence(quint64 sequence) {
+    m_kmsgSequence = sequence;
+    m_kmsgBootId = m_bootId;
+    markDirty();
+}
+
+void Checkpoint::markDirty() {
+    m_dirty = true;
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void Checkpoint::flush() {
+    if (!m_dirty) {
+        return;
+    }
+    m_flushTimer.stop();
+
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        qWarning() << "USBscope: cannot write checkpoint" << m_path << ":" << file.errorString();
+        return;
+    }
+    if (!m_journalCursor.isEmpty()) {
+        file.write("journal-cursor=" + m_journalCursor + "\n");
+    }
+    if (!m_kmsgBootId.isEmpty()) {
+        file.write("kmsg-boot-id=" + m_kmsgBootId + "\n");
+        file.write("kmsg-sequence=" + QByteArray::number(m_kmsgSequence) + "\n");
+    }
+    if (file.commit()) {
+        m_dirty = false;
+    }
+}
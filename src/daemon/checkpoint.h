@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QObject>
+#include <QTimer>
+
+// Persists the position of the last kernel message handed to the daemon (a
+// journal cursor or a kmsg sequence number) so a restart resumes right after
+// it. Positions are kept in memory and written atomically at most once per
+// flush interval, plus once on shutdown.
+class Checkpoint : public QObject {
+    Q_OBJECT
+public:
+    explicit Checkpoint(const QString &path, QObject *parent = nullptr);
+
+    static QString defaultPath();
+
+    void load();
+    void setFlushInterval(int msec);
+
+    QByteArray journalCursor() const { return m_journalCursor; }
+    // kmsg sequence numbers restart on every boot, so a stored sequence is
+    // only reported when it was recorded during the current boot.
+    bool hasKmsgSequence() const;
+    quint64 kmsgSequence() const { return m_kmsgSequence; }
+
+public slots:
+    void setJournalCursor(const QByteArray &cursor);
+    void setKmsgSequence(quint64 sequence);
+    void flush();
+
+private:
+    void markDirty();
+
+    QString m_path;
+    QByteArray m_bootId;
+    QByteArray m_journalCursor;
+    QByteArray m_kmsgBootId;
+    quint64 m_kmsgSequence = 0;
+    bool m_dirty = false;
+    QTimer m_flushTimer;
+};
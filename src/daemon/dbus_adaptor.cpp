@@ -1,9 +1,48 @@
 #include "dbus_adaptor.h"
 
+#include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusReply>
+#include <QDateTime>
+
+#include <unistd.h>
+#include <utility>
+
+#include "dbus_helpers.h"
 #include "usbdaemon.h"
 
+namespace {
+const char *kObjectPath = "/org/cachyos/USBscope/Daemon";
+const char *kInterfaceName = "org.cachyos.USBscope1";
+// Bounds on the budget SetMemoryBudget accepts.
+const qint64 kMinMemoryBudgetBytes = 1024 * 1024;
+const qint64 kMaxMemoryBudgetBytes = 4096LL * 1024 * 1024;
+// Each quota gets its own ring; levels are a handful of words.
+const int kMaxLevelQuotas = 16;
+// Minimum time between snapshots requested over D-Bus.
+const qint64 kSnapshotIntervalMsecs = 10 * 1000;
+}
+
 UsbscopeDBusAdaptor::UsbscopeDBusAdaptor(UsbDaemon *daemon)
     : QDBusAbstractAdaptor(daemon), m_daemon(daemon) {
+    m_batchTimer.setSingleShot(true);
+    m_batchTimer.setInterval(50);
+    connect(&m_batchTimer, &QTimer::timeout, this, &UsbscopeDBusAdaptor::flushLogEvents);
+
+    m_subscriberWatcher.setConnection(usbscopeBus());
+    m_subscriberWatcher.setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+    connect(&m_subscriberWatcher, &QDBusServiceWatcher::serviceUnregistered,
+            this, &UsbscopeDBusAdaptor::removeSubscriber);
+}
+
+void UsbscopeDBusAdaptor::setBatching(int msec, int maxEvents) {
+    m_batchTimer.setInterval(qMax(0, msec));
+    m_batchMaxEvents = qMax(1, maxEvents);
+}
+
+void UsbscopeDBusAdaptor::setPerEventSignal(bool enabled) {
+    m_perEventSignal = enabled;
 }
 
 QString UsbscopeDBusAdaptor::GetVersion() {
@@ -14,16 +53,285 @@ QList<QVariantList> UsbscopeDBusAdaptor::GetRecentEvents(int limit) {
     return m_daemon ? m_daemon->recentEventsVariant(limit) : QList<QVariantList>{};
 }
 
+QList<QVariantList> UsbscopeDBusAdaptor::GetEventsSince(qulonglong sequence, int limit) {
+    return m_daemon ? m_daemon->eventsSinceVariant(sequence, limit) : QList<QVariantList>{};
+}
+
+QList<QVariantList> UsbscopeDBusAdaptor::GetEventsInRange(qlonglong startUs, qlonglong endUs, int limit) {
+    return m_daemon ? m_daemon->eventsInRangeVariant(startUs, endUs, limit) : QList<QVariantList>{};
+}
+
+QList<QVariantList> UsbscopeDBusAdaptor::SearchEvents(const QString &query, int limit) {
+    return m_daemon ? m_daemon->searchEventsVariant(query, limit) : QList<QVariantList>{};
+}
+
 QList<QVariantList> UsbscopeDBusAdaptor::GetCurrentDevices() {
     return m_daemon ? m_daemon->currentDevicesVariant() : QList<QVariantList>{};
 }
 
+QList<UsbEvent> UsbscopeDBusAdaptor::GetRecentEvents2(int limit) {
+    return m_daemon ? m_daemon->recentEvents(limit) : QList<UsbEvent>{};
+}
+
+QList<UsbEvent> UsbscopeDBusAdaptor::GetEventsSince2(qulonglong sequence, int limit) {
+    return m_daemon ? m_daemon->eventsSince(sequence, limit) : QList<UsbEvent>{};
+}
+
+QList<UsbEvent> UsbscopeDBusAdaptor::GetEventsInRange2(qlonglong startUs, qlonglong endUs, int limit) {
+    return m_daemon ? m_daemon->eventsInRange(startUs, endUs, limit) : QList<UsbEvent>{};
+}
+
+QList<UsbEvent> UsbscopeDBusAdaptor::SearchEvents2(const QString &query, int limit) {
+    return m_daemon ? m_daemon->searchEvents(query, limit) : QList<UsbEvent>{};
+}
+
+QList<UsbDeviceInfo> UsbscopeDBusAdaptor::GetCurrentDevices2() {
+    return m_daemon ? m_daemon->devices() : QList<UsbDeviceInfo>{};
+}
+
+QList<UsbEvent> UsbscopeDBusAdaptor::SyncEvents(qulonglong sequence, int limit, qulonglong &firstSequence,
+                                                qulonglong &lastSequence) {
+    if (!m_daemon) {
+        firstSequence = 0;
+        lastSequence = 0;
+        return {};
+    }
+    firstSequence = m_daemon->firstAvailableSequence();
+    lastSequence = m_daemon->lastSequence();
+    return m_daemon->eventsSince(sequence, limit);
+}
+
+QList<UsbEvent> UsbscopeDBusAdaptor::GetUpdatedEvents(qulonglong sequence, bool &complete) {
+    if (!m_daemon) {
+        complete = false;
+        return {};
+    }
+    return m_daemon->updatedEventsSince(sequence, complete);
+}
+
+QList<QVariantList> UsbscopeDBusAdaptor::GetDeviceStats() {
+    return m_daemon ? m_daemon->deviceStatsVariant() : QList<QVariantList>{};
+}
+
 QVariantList UsbscopeDBusAdaptor::GetStateSummary() {
     return m_daemon ? m_daemon->stateSummary() : QVariantList{};
 }
 
+QList<QVariantList> UsbscopeDBusAdaptor::GetRuleHits() {
+    return m_daemon ? m_daemon->ruleHitsVariant() : QList<QVariantList>{};
+}
+
+bool UsbscopeDBusAdaptor::ReloadRules() {
+    return m_daemon && callerIsPrivileged() && m_daemon->reloadRules();
+}
+
+bool UsbscopeDBusAdaptor::SetMemoryBudget(qlonglong budgetBytes, const QVariantMap &levelQuotas) {
+    if (!m_daemon || !callerIsPrivileged()) {
+        return false;
+    }
+    if (budgetBytes < kMinMemoryBudgetBytes || budgetBytes > kMaxMemoryBudgetBytes) {
+        if (calledFromDBus()) {
+            sendErrorReply(QDBusError::InvalidArgs,
+                           QStringLiteral("Budget must be between %1 and %2 bytes")
+                               .arg(kMinMemoryBudgetBytes)
+                               .arg(kMaxMemoryBudgetBytes));
+        }
+        return false;
+    }
+    if (levelQuotas.size() > kMaxLevelQuotas) {
+        if (calledFromDBus()) {
+            sendErrorReply(QDBusError::InvalidArgs, QStringLiteral("Too many level quotas"));
+        }
+        return false;
+    }
+    QHash<QString, qint64> quotas;
+    qint64 reserved = 0;
+    for (auto it = levelQuotas.cbegin(); it != levelQuotas.cend(); ++it) {
+        bool ok = false;
+        const qint64 quota = it.value().toLongLong(&ok);
+        if (!ok || quota < 0 || quota > budgetBytes - reserved) {
+            if (calledFromDBus()) {
+                sendErrorReply(QDBusError::InvalidArgs,
+                               QStringLiteral("Invalid quota for level %1").arg(it.key()));
+            }
+            return false;
+        }
+        reserved += quota;
+        quotas.insert(it.key(), quota);
+    }
+    m_daemon->setMemoryBudget(budgetBytes, quotas);
+    return true;
+}
+
+QString UsbscopeDBusAdaptor::WriteSnapshot(const QString &fileName) {
+    if (!m_daemon || !callerIsPrivileged()) {
+        return {};
+    }
+    if (calledFromDBus()) {
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (m_lastSnapshotMsecs && now - m_lastSnapshotMsecs < kSnapshotIntervalMsecs) {
+            sendErrorReply(QDBusError::LimitsExceeded, QStringLiteral("A snapshot was written less than %1 s ago")
+                                                           .arg(kSnapshotIntervalMsecs / 1000));
+            return {};
+        }
+        m_lastSnapshotMsecs = now;
+    }
+    return m_daemon->writeSnapshot(fileName);
+}
+
+uint UsbscopeDBusAdaptor::Subscribe(const QVariantMap &filterSpec, qulonglong &lastSequence) {
+    lastSequence = m_daemon ? m_daemon->lastSequence() : 0;
+    if (!calledFromDBus()) {
+        return 0;
+    }
+    EventFilter filter;
+    QString error;
+    if (!EventFilter::fromSpec(filterSpec, filter, &error)) {
+        sendErrorReply(QDBusError::InvalidArgs, error);
+        return 0;
+    }
+    Subscription subscription;
+    subscription.client = message().service();
+    subscription.filter = filter;
+    // Events still waiting for the next batch are covered by lastSequence.
+    subscription.coveredSequence = lastSequence;
+    const uint id = m_nextSubscriptionId++;
+    m_subscriptions.insert(id, subscription);
+    if (!m_subscriberWatcher.watchedServices().contains(subscription.client)) {
+        m_subscriberWatcher.addWatchedService(subscription.client);
+    }
+    return id;
+}
+
+bool UsbscopeDBusAdaptor::Unsubscribe(uint subscriptionId) {
+    auto it = m_subscriptions.find(subscriptionId);
+    if (it == m_subscriptions.end() || (calledFromDBus() && it->client != message().service())) {
+        return false;
+    }
+    const QString client = it->client;
+    m_subscriptions.erase(it);
+    for (const Subscription &subscription : std::as_const(m_subscriptions)) {
+        if (subscription.client == client) {
+            return true;
+        }
+    }
+    m_subscriberWatcher.removeWatchedService(client);
+    return true;
+}
+
+qulonglong UsbscopeDBusAdaptor::GetSubscriptionSequence(uint subscriptionId) {
+    auto it = m_subscriptions.constFind(subscriptionId);
+    if (it == m_subscriptions.cend() || (calledFromDBus() && it->client != message().service())) {
+        if (calledFromDBus()) {
+            sendErrorReply(QDBusError::InvalidArgs, QStringLiteral("Unknown subscription"));
+        }
+        return 0;
+    }
+    return it->coveredSequence;
+}
+
+QDBusUnixFileDescriptor UsbscopeDBusAdaptor::GetEventRing() {
+    const int fd = m_daemon && m_daemon->sharedRing().isOpen() ? m_daemon->sharedRing().readOnlyDescriptor() : -1;
+    if (fd < 0) {
+        if (calledFromDBus()) {
+            sendErrorReply(QDBusError::NotSupported, QStringLiteral("No shared event ring"));
+        }
+        return {};
+    }
+    // The descriptor duplicates fd.
+    QDBusUnixFileDescriptor descriptor(fd);
+    ::close(fd);
+    return descriptor;
+}
+
+bool UsbscopeDBusAdaptor::callerIsPrivileged() {
+    if (!calledFromDBus()) {
+        return true;
+    }
+    // Root, or the user the daemon runs as when it serves a session bus.
+    const QDBusReply<uint> uid = connection().interface()->serviceUid(message().service());
+    if (uid.isValid() && (uid.value() == 0 || uid.value() == ::getuid())) {
+        return true;
+    }
+    sendErrorReply(QDBusError::AccessDenied, QStringLiteral("Not permitted to call %1").arg(message().member()));
+    return false;
+}
+
+void UsbscopeDBusAdaptor::removeSubscriber(const QString &client) {
+    for (auto it = m_subscriptions.begin(); it != m_subscriptions.end();) {
+        if (it->client == client) {
+            it = m_subscriptions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_subscriberWatcher.removeWatchedService(client);
+}
+
+void UsbscopeDBusAdaptor::sendFilteredEvents(const QList<UsbEvent> &events) {
+    const quint64 lastSequence = events.last().sequence;
+    for (auto it = m_subscriptions.begin(); it != m_subscriptions.end(); ++it) {
+        Subscription &subscription = it.value();
+        QList<UsbEvent> matched;
+        for (const UsbEvent &event : events) {
+            if (event.sequence > subscription.coveredSequence && subscription.filter.matches(event)) {
+                matched.append(event);
+            }
+        }
+        // Nothing is sent when nothing matched, so idle subscribers are not
+        // woken up; the next message covers these sequences as well.
+        if (matched.isEmpty()) {
+            continue;
+        }
+        QDBusMessage signal = QDBusMessage::createTargetedSignal(
+            subscription.client, kObjectPath, kInterfaceName, "FilteredEvents");
+        signal << it.key() << QVariant::fromValue<qulonglong>(subscription.coveredSequence)
+               << QVariant::fromValue<qulonglong>(lastSequence) << QVariant::fromValue(matched);
+        usbscopeBus().send(signal);
+        subscription.coveredSequence = qMax(subscription.coveredSequence, lastSequence);
+    }
+}
+
 void UsbscopeDBusAdaptor::emitLogEvent(const UsbEvent &event) {
-    emit LogEvent(toVariant(event));
+    if (m_perEventSignal) {
+        emit LogEvent(toVariant(event));
+    }
+    m_pendingEvents.append(event);
+    if (m_pendingEvents.size() >= m_batchMaxEvents) {
+        flushLogEvents();
+    } else if (!m_batchTimer.isActive()) {
+        m_batchTimer.start();
+    }
+}
+
+void UsbscopeDBusAdaptor::flushLogEvents() {
+    m_batchTimer.stop();
+    if (m_pendingEvents.isEmpty()) {
+        return;
+    }
+    emit LogEvents(m_pendingEvents);
+    if (!m_subscriptions.isEmpty()) {
+        sendFilteredEvents(m_pendingEvents);
+    }
+    m_pendingEvents.clear();
+}
+
+void UsbscopeDBusAdaptor::emitLogEventUpdated(const UsbEvent &event) {
+    // The queue is in sequence order; updates of events sent earlier leave
+    // it to its batch window.
+    if (!m_pendingEvents.isEmpty() && event.sequence >= m_pendingEvents.first().sequence) {
+        flushLogEvents();
+    }
+    emit LogEventUpdated(event);
+    for (auto it = m_subscriptions.cbegin(); it != m_subscriptions.cend(); ++it) {
+        if (!it->filter.matches(event)) {
+            continue;
+        }
+        QDBusMessage signal = QDBusMessage::createTargetedSignal(
+            it->client, kObjectPath, kInterfaceName, "FilteredEventUpdated");
+        signal << it.key() << QVariant::fromValue(event);
+        usbscopeBus().send(signal);
+    }
 }
 
 void UsbscopeDBusAdaptor::emitDevicesChanged() {
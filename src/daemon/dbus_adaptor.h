@@ -1,34 +1,129 @@
 #pragma once
 
 #include <QDBusAbstractAdaptor>
+#include <QDBusContext>
+#include <QDBusServiceWatcher>
+#include <QDBusUnixFileDescriptor>
+#include <QHash>
 #include <QObject>
+#include <QTimer>
 
+#include "eventfilter.h"
 #include "usbtypes.h"
 
 class UsbDaemon;
 
-class UsbscopeDBusAdaptor : public QDBusAbstractAdaptor {
+class UsbscopeDBusAdaptor : public QDBusAbstractAdaptor, protected QDBusContext {
     Q_OBJECT
     Q_CLASSINFO("D-Bus Interface", "org.cachyos.USBscope1")
 public:
     explicit UsbscopeDBusAdaptor(UsbDaemon *daemon);
 
+    // LogEvents sends the pending events once the oldest has waited msec
+    // (0: once the current batch of work is done) or maxEvents are pending.
+    void setBatching(int msec, int maxEvents);
+    // Whether every event is also sent on its own through LogEvent, for
+    // clients that predate LogEvents.
+    void setPerEventSignal(bool enabled);
+
 public slots:
     QString GetVersion();
+    // Events and devices as QVariantLists, for clients that predate the
+    // typed structs.
     QList<QVariantList> GetRecentEvents(int limit);
+    QList<QVariantList> GetEventsSince(qulonglong sequence, int limit);
+    QList<QVariantList> GetEventsInRange(qlonglong startUs, qlonglong endUs, int limit);
+    QList<QVariantList> SearchEvents(const QString &query, int limit);
     QList<QVariantList> GetCurrentDevices();
+    // The same as typed structs, see dbus_helpers.h.
+    QList<UsbEvent> GetRecentEvents2(int limit);
+    QList<UsbEvent> GetEventsSince2(qulonglong sequence, int limit);
+    QList<UsbEvent> GetEventsInRange2(qlonglong startUs, qlonglong endUs, int limit);
+    QList<UsbEvent> SearchEvents2(const QString &query, int limit);
+    QList<UsbDeviceInfo> GetCurrentDevices2();
+    // GetEventsSince2 plus the oldest sequence still available and the
+    // newest one, so clients can tell whether events they missed were
+    // evicted and whether they have caught up.
+    QList<UsbEvent> SyncEvents(qulonglong sequence, int limit, qulonglong &firstSequence,
+                               qulonglong &lastSequence);
+    // The stored events whose repeat count changed after event sequence
+    // was stored, with their current count, so a client that missed
+    // LogEventUpdated signals can catch up. complete is false if the daemon
+    // no longer remembers all updates that old.
+    QList<UsbEvent> GetUpdatedEvents(qulonglong sequence, bool &complete);
+    QList<QVariantList> GetDeviceStats();
     QVariantList GetStateSummary();
+    QList<QVariantList> GetRuleHits();
+    // Root only (see callerIsPrivileged).
+    bool ReloadRules();
+    // Root only (see callerIsPrivileged); the budget must lie between 1 MiB
+    // and 4 GiB and the quotas must fit into it.
+    bool SetMemoryBudget(qlonglong budgetBytes, const QVariantMap &levelQuotas);
+    // Root only, at most one call every 10 s; see UsbDaemon::writeSnapshot.
+    QString WriteSnapshot(const QString &fileName);
+    // Sends the caller the events matching filterSpec (see eventfilter.h)
+    // as FilteredEvents / FilteredEventUpdated signals addressed to it
+    // alone, in the same batches as LogEvents. Returns the subscription id
+    // and the newest sequence at the time of subscribing. Subscriptions end
+    // with Unsubscribe or when the caller leaves the bus.
+    uint Subscribe(const QVariantMap &filterSpec, qulonglong &lastSequence);
+    bool Unsubscribe(uint subscriptionId);
+    // Newest sequence the last FilteredEvents of the subscription covered,
+    // so a subscriber can tell whether it missed a message without
+    // fetching events. Fails with InvalidArgs for unknown subscriptions.
+    qulonglong GetSubscriptionSequence(uint subscriptionId);
+    // A read-only memfd holding the newest events, see sharedeventring.h.
+    // Fails with NotSupported when the ring is disabled.
+    QDBusUnixFileDescriptor GetEventRing();
 
 signals:
     void LogEvent(const QVariantList &event);
+    void LogEvents(const QList<UsbEvent> &events);
+    // A coalesced event got more repeats; carries its new count.
+    void LogEventUpdated(const UsbEvent &event);
     void DevicesChanged();
     void ErrorBurst(int count, const QString &lastMessage);
+    // Sent to one subscriber only, never emitted; declared for
+    // introspection. events are the matches among the sequences after
+    // previousSequence up to lastSequence.
+    void FilteredEvents(uint subscriptionId, qulonglong previousSequence, qulonglong lastSequence,
+                        const QList<UsbEvent> &events);
+    void FilteredEventUpdated(uint subscriptionId, const UsbEvent &event);
 
 public:
+    // Sends LogEvent right away and queues the event for LogEvents.
     void emitLogEvent(const UsbEvent &event);
+    void flushLogEvents();
+    // Sends the pending LogEvents batch first if it holds the event being
+    // updated, so clients already have it.
+    void emitLogEventUpdated(const UsbEvent &event);
     void emitDevicesChanged();
     void emitErrorBurst(int count, const QString &lastMessage);
 
 private:
+    struct Subscription {
+        QString client;
+        EventFilter filter;
+        // Newest sequence the subscriber has been told about, matching or
+        // not; FilteredEvents carries it so gaps can be told apart from
+        // events that did not match.
+        quint64 coveredSequence = 0;
+    };
+
+    // Whether the D-Bus caller may change the daemon's state: root, or the
+    // daemon's own user. Replies AccessDenied otherwise. Direct calls from
+    // within the daemon are always allowed.
+    bool callerIsPrivileged();
+    void sendFilteredEvents(const QList<UsbEvent> &events);
+    void removeSubscriber(const QString &client);
+
     UsbDaemon *m_daemon;
+    QHash<uint, Subscription> m_subscriptions;
+    uint m_nextSubscriptionId = 1;
+    QDBusServiceWatcher m_subscriberWatcher;
+    QList<UsbEvent> m_pendingEvents;
+    QTimer m_batchTimer;
+    int m_batchMaxEvents = 256;
+    bool m_perEventSignal = true;
+    qint64 m_lastSnapshotMsecs = 0;
 };
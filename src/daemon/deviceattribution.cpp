@@ -0,0 +1,175 @@
+#include "deviceattribution.h"
+
+namespace {
+// USB char devices use major 189 with minor (bus - 1) * 128 + (devnum - 1).
+QString charDeviceAlias(const UsbDeviceInfo &device) {
+    if (device.busNumber <= 0 || device.deviceNumber <= 0) {
+        return {};
+    }
+    const int minor = (device.busNumber - 1) * 128 + (device.deviceNumber - 1);
+    return QStringLiteral("c189:%1").arg(minor);
+}
+
+// Root hubs sit directly below their host controller, e.g.
+// /sys/devices/pci0000:00/0000:00:14.0/usb1.
+QString controllerAlias(const UsbDeviceInfo &device) {
+    if (!device.busId.startsWith(QLatin1String("usb"))) {
+        return {};
+    }
+    const qsizetype end = device.sysPath.lastIndexOf(u'/');
+    const qsizetype begin = end > 0 ? device.sysPath.lastIndexOf(u'/', end - 1) : -1;
+    if (begin < 0) {
+        return {};
+    }
+    return device.sysPath.mid(begin + 1, end - begin - 1);
+}
+
+bool isDigit(QChar ch) {
+    return ch >= u'0' && ch <= u'9';
+}
+
+// Length of the "<bus>-<port>[.<port>...]" prefix of name, 0 if none.
+qsizetype busPathLength(QStringView name) {
+    qsizetype i = 0;
+    while (i < name.size() && isDigit(name.at(i))) {
+        ++i;
+    }
+    if (i == 0 || i >= name.size() || name.at(i) != u'-') {
+        return 0;
+    }
+    qsizetype end = ++i;
+    while (i < name.size() && (isDigit(name.at(i)) || name.at(i) == u'.')) {
+        if (isDigit(name.at(i))) {
+            end = i + 1;
+        }
+        ++i;
+    }
+    return end > 0 && isDigit(name.at(end - 1)) ? end : 0;
+}
+
+// Port number of a "-port<N>" suffix at name[pos], or an empty view.
+QStringView portSuffix(QStringView name, qsizetype pos) {
+    const QStringView suffix = name.sliced(pos);
+    if (!suffix.startsWith(QLatin1String("-port")) || suffix.size() <= 5) {
+        return {};
+    }
+    return suffix.sliced(5);
+}
+}
+
+DeviceAttribution::DeviceAttribution(QObject *parent)
+    : QObject(parent) {
+}
+
+void DeviceAttribution::setDevices(const QList<UsbDeviceInfo> &devices) {
+    m_aliases.clear();
+    for (const UsbDeviceInfo &device : devices) {
+        addDevice(device);
+    }
+}
+
+void DeviceAttribution::addDevice(const UsbDeviceInfo &device) {
+    if (device.busId.isEmpty()) {
+        return;
+    }
+    const QString charAlias = charDeviceAlias(device);
+    if (!charAlias.isEmpty()) {
+        m_aliases.insert(charAlias, device.busId);
+    }
+    const QString controller = controllerAlias(device);
+    // A controller with several root hubs (USB 2 and 3) is attributed to the
+    // first one seen.
+    if (!controller.isEmpty() && !m_aliases.contains(controller)) {
+        m_aliases.insert(controller, device.busId);
+    }
+}
+
+void DeviceAttribution::removeDevice(const UsbDeviceInfo &device) {
+    const QString charAlias = charDeviceAlias(device);
+    if (!charAlias.isEmpty() && m_aliases.value(charAlias) == device.busId) {
+        m_aliases.remove(charAlias);
+    }
+    // Controller aliases are kept: messages about the controller still
+    // refer to the same root hub when it comes back.
+}
+
+void DeviceAttribution::processEvents(const QVector<UsbEvent> &events) {
+    QVector<UsbEvent> attributed = events;
+    for (UsbEvent &event : attributed) {
+        // kmsg records may already name the device through DEVICE=.
+        const QString deviceId = event.deviceId.isEmpty()
+            ? attribute(event.message)
+            : resolve(event.deviceId);
+        if (!deviceId.isEmpty()) {
+            event.deviceId = deviceId;
+            event.isUsb = true;
+        }
+    }
+    emit eventsAttributed(attributed);
+}
+
+QString DeviceAttribution::attribute(QStringView message) const {
+    // dev_printk() output is "<driver> <device name>: <text>". Text-mode
+    // journal lines additionally start with the "kernel: " identifier.
+    if (message.startsWith(QLatin1String("kernel: "))) {
+        message = message.sliced(8);
+    }
+    const qsizetype space = message.indexOf(u' ');
+    if (space <= 0) {
+        return {};
+    }
+    const qsizetype end = message.indexOf(QLatin1String(": "), space + 1);
+    if (end <= space + 1) {
+        return {};
+    }
+    const QStringView name = message.sliced(space + 1, end - space - 1);
+    if (name.contains(u' ')) {
+        return {};
+    }
+    return resolve(name);
+}
+
+QString DeviceAttribution::resolve(QStringView name) const {
+    // Bus path, optionally followed by an interface (":1.0") or a hub port
+    // ("-port3", which is where the child device "<hub>.3" is attached).
+    const qsizetype pathLength = busPathLength(name);
+    if (pathLength > 0) {
+        const QStringView path = name.first(pathLength);
+        const QStringView port = portSuffix(name, pathLength);
+        if (path.endsWith(QLatin1String("-0")) && port.isEmpty()) {
+            // "<N>-0" is the root hub's own interface path.
+            QString id = QStringLiteral("usb");
+            id.append(path.first(path.size() - 2));
+            return id;
+        }
+        QString id = path.toString();
+        if (!port.isEmpty()) {
+            id.append(u'.');
+            id.append(port);
+        }
+        return id;
+    }
+
+    // Root hub "usb<N>", or port "usb<N>-port<M>", i.e. device "<N>-<M>".
+    if (name.startsWith(QLatin1String("usb")) && name.size() > 3 && isDigit(name.at(3))) {
+        qsizetype i = 3;
+        while (i < name.size() && isDigit(name.at(i))) {
+            ++i;
+        }
+        const QStringView port = portSuffix(name, i);
+        if (!port.isEmpty()) {
+            QString id = name.sliced(3, i - 3).toString();
+            id.append(u'-');
+            id.append(port);
+            return id;
+        }
+        return name.first(i).toString();
+    }
+
+    // Host controller PCI address or USB char device id.
+    auto alias = m_aliases.constFind(name.toString());
+    if (alias != m_aliases.constEnd()) {
+        return alias.value();
+    }
+    return {};
+}
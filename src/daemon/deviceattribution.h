@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QStringView>
+
+#include "usbtypes.h"
+
+// Attribution stage between the kernel log sources and the daemon. Extracts
+// the USB bus path a kernel message refers to ("usb 1-2.3:", "usbhid
+// 1-2.3:1.0:", "usb usb1-port2:", "xhci_hcd 0000:00:14.0:") and resolves it
+// against the device table from UsbMonitor, so every event carries the bus
+// path of its device as deviceId. Bus paths name physical ports and stay the
+// same across re-enumeration, unlike device numbers.
+//
+// Lookups are single hash probes and the index is updated per hotplug event.
+class DeviceAttribution : public QObject {
+    Q_OBJECT
+public:
+    explicit DeviceAttribution(QObject *parent = nullptr);
+
+    // Device identity for a kernel message, or an empty string.
+    QString attribute(QStringView message) const;
+
+public slots:
+    void setDevices(const QList<UsbDeviceInfo> &devices);
+    void addDevice(const UsbDeviceInfo &device);
+    void removeDevice(const UsbDeviceInfo &device);
+    void processEvents(const QVector<UsbEvent> &events);
+
+signals:
+    void eventsAttributed(const QVector<UsbEvent> &events);
+
+private:
+    QString resolve(QStringView deviceName) const;
+
+    // Names the kernel uses for a device other than its bus path, built from
+    // the device table and mapped to the bus path: host controller PCI
+    // addresses and "c189:<minor>" char device ids.
+    QHash<QString, QString> m_aliases;
+};
@@ -0,0 +1,89 @@
+#include "devicestats.h"
+
+namespace {
+// usb_reset_and_verify_device() and usb_disconnect() messages, e.g.
+// "usb 1-2: reset high-speed USB device number 5 using xhci_hcd" and
+// "usb 1-2: USB disconnect, device number 5".
+bool isReset(const QString &message) {
+    return message.contains(QLatin1String("reset ")) && message.contains(QLatin1String("USB device number"));
+}
+
+bool isDisconnect(const QString &message) {
+    return message.contains(QLatin1String("USB disconnect"));
+}
+}
+
+void DeviceStats::ErrorWindow::add(qint64 timestampUs, quint32 count) {
+    const qint64 bucket = timestampUs / m_bucketUs;
+    const int slot = static_cast<int>(bucket % kBuckets);
+    if (m_bucketIds[slot] != bucket) {
+        // The slot still holds a bucket at least one window old.
+        if (m_bucketIds[slot] > bucket) {
+            return;
+        }
+        m_bucketIds[slot] = bucket;
+        m_counts[slot] = 0;
+    }
+    m_counts[slot] += count;
+}
+
+quint64 DeviceStats::ErrorWindow::count(qint64 nowUs) const {
+    const qint64 newest = nowUs / m_bucketUs;
+    quint64 total = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        if (m_bucketIds[i] > newest - kBuckets && m_bucketIds[i] <= newest) {
+            total += m_counts[i];
+        }
+    }
+    return total;
+}
+
+void DeviceStats::record(const UsbEvent &event) {
+    if (event.deviceId.isEmpty()) {
+        return;
+    }
+    const quint32 count = qMax(1u, event.repeatCount);
+    const qint64 lastUs = qMax(event.timestampUs, event.lastTimestampUs);
+    Entry &entry = m_devices[event.deviceId];
+    if (entry.totalEvents == 0 || event.timestampUs < entry.firstEventUs) {
+        entry.firstEventUs = event.timestampUs;
+    }
+    entry.totalEvents += count;
+    if (event.isError) {
+        entry.errors += count;
+        entry.lastErrorUs = qMax(entry.lastErrorUs, lastUs);
+        entry.lastMinute.add(lastUs, count);
+        entry.last15Minutes.add(lastUs, count);
+        entry.lastHour.add(lastUs, count);
+    }
+    if (isReset(event.message)) {
+        entry.resets += count;
+    } else if (isDisconnect(event.message)) {
+        entry.disconnects += count;
+    }
+}
+
+void DeviceStats::clear() {
+    m_devices.clear();
+}
+
+QList<UsbDeviceStats> DeviceStats::snapshot(qint64 nowUs) const {
+    QList<UsbDeviceStats> stats;
+    stats.reserve(m_devices.size());
+    for (auto it = m_devices.cbegin(); it != m_devices.cend(); ++it) {
+        const Entry &entry = it.value();
+        UsbDeviceStats device;
+        device.deviceId = it.key();
+        device.totalEvents = entry.totalEvents;
+        device.errors = entry.errors;
+        device.resets = entry.resets;
+        device.disconnects = entry.disconnects;
+        device.lastErrorUs = entry.lastErrorUs;
+        device.firstEventUs = entry.firstEventUs;
+        device.errorsLastMinute = entry.lastMinute.count(nowUs);
+        device.errorsLast15Minutes = entry.last15Minutes.count(nowUs);
+        device.errorsLastHour = entry.lastHour.count(nowUs);
+        stats.append(device);
+    }
+    return stats;
+}
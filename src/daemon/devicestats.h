@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+
+#include <array>
+
+#include "usbtypes.h"
+
+// Per-device counters kept up to date as events are stored, so "which port
+// is flaky" is answered without scanning history. Recording an event is one
+// hash lookup plus constant work: error rates come from rings of fixed-width
+// buckets whose stale slots are reset lazily when they are reused.
+class DeviceStats {
+public:
+    // Counts every occurrence a coalesced event stands for. Events without a
+    // device are not counted.
+    void record(const UsbEvent &event);
+    void clear();
+
+    // Counters of every device seen, with the error windows ending at nowUs.
+    QList<UsbDeviceStats> snapshot(qint64 nowUs) const;
+
+private:
+    // Errors per bucket over the last kBuckets buckets, keyed by event time.
+    class ErrorWindow {
+    public:
+        static constexpr int kBuckets = 60;
+
+        explicit ErrorWindow(qint64 bucketUs = 1000000) : m_bucketUs(bucketUs) {}
+
+        void add(qint64 timestampUs, quint32 count);
+        quint64 count(qint64 nowUs) const;
+
+    private:
+        qint64 m_bucketUs;
+        std::array<qint64, kBuckets> m_bucketIds{};
+        std::array<quint32, kBuckets> m_counts{};
+    };
+
+    struct Entry {
+        quint64 totalEvents = 0;
+        quint64 errors = 0;
+        quint64 resets = 0;
+        quint64 disconnects = 0;
+        qint64 firstEventUs = 0;
+        qint64 lastErrorUs = 0;
+        // 1 s, 15 s and 1 min buckets for the 1 min, 15 min and 1 h windows.
+        ErrorWindow lastMinute{1000000};
+        ErrorWindow last15Minutes{15 * 1000000};
+        ErrorWindow lastHour{60 * 1000000};
+    };
+
+    QHash<QString, Entry> m_devices;
+};
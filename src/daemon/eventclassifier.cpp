@@ -0,0 +1,196 @@
+#include "eventclassifier.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QVarLengthArray>
+
+namespace {
+std::shared_ptr<const EventClassifier> g_current;
+
+const int kErrorRank = 3;
+
+int levelRank(const QString &level) {
+    if (level == QLatin1String("error")) {
+        return kErrorRank;
+    }
+    if (level == QLatin1String("warning")) {
+        return 2;
+    }
+    if (level == QLatin1String("info")) {
+        return 1;
+    }
+    return 0;
+}
+
+ClassificationRule makeRule(const char *pattern, bool usb, bool error) {
+    ClassificationRule rule;
+    rule.pattern = pattern;
+    if (usb) {
+        rule.usb = true;
+    }
+    if (error) {
+        rule.error = true;
+    }
+    return rule;
+}
+}
+
+EventClassifier::EventClassifier(const QVector<ClassificationRule> &rules)
+    : m_rules(rules), m_hits(new std::atomic<quint64>[qMax<qsizetype>(1, rules.size())]()) {
+    for (int i = 0; i < m_rules.size(); ++i) {
+        const int field = m_rules.at(i).field;
+        if (m_matchers[field].addPattern(m_rules.at(i).pattern) >= 0) {
+            m_ruleOfPattern[field].append(i);
+        }
+    }
+    for (KeywordMatcher &matcher : m_matchers) {
+        matcher.build();
+    }
+}
+
+void EventClassifier::classify(QByteArrayView message, QByteArrayView subsystem, UsbEvent &event) const {
+    // A rule whose pattern occurs several times still counts once.
+    QVarLengthArray<int, 16> matched;
+    const QByteArrayView texts[kFieldCount] = {message, subsystem};
+    for (int field = 0; field < kFieldCount; ++field) {
+        const QVector<int> &ruleOfPattern = m_ruleOfPattern[field];
+        m_matchers[field].forEachMatch(texts[field], [&](int patternId) {
+            const int ruleIndex = ruleOfPattern.at(patternId);
+            if (!matched.contains(ruleIndex)) {
+                matched.append(ruleIndex);
+            }
+        });
+    }
+
+    bool usb = false;
+    bool usbVeto = false;
+    bool error = false;
+    bool errorVeto = false;
+    QString level;
+    for (int ruleIndex : matched) {
+        m_hits[ruleIndex].fetch_add(1, std::memory_order_relaxed);
+        const ClassificationRule &rule = m_rules.at(ruleIndex);
+        if (rule.usb) {
+            (*rule.usb ? usb : usbVeto) = true;
+        }
+        if (rule.error) {
+            (*rule.error ? error : errorVeto) = true;
+        }
+        if (levelRank(rule.level) > levelRank(level)) {
+            level = rule.level;
+        }
+    }
+
+    const bool errorLevel = levelRank(level) >= kErrorRank;
+    event.isUsb = usb && !usbVeto;
+    event.isError = (error || errorLevel) && !errorVeto;
+    if (event.isError) {
+        event.level = QStringLiteral("error");
+    } else if (level.isEmpty() || errorLevel) {
+        event.level = QStringLiteral("info");
+    } else {
+        event.level = level;
+    }
+}
+
+QVector<quint64> EventClassifier::hitCounts() const {
+    QVector<quint64> counts;
+    counts.reserve(m_rules.size());
+    for (int i = 0; i < m_rules.size(); ++i) {
+        counts.append(m_hits[i].load(std::memory_order_relaxed));
+    }
+    return counts;
+}
+
+QVector<ClassificationRule> EventClassifier::defaultRules() {
+    // "usbhid" is covered by "usb"; anything the kernel itself tags with the
+    // usb subsystem is USB regardless of its text.
+    ClassificationRule subsystemRule = makeRule("usb", true, false);
+    subsystemRule.field = ClassificationRule::Subsystem;
+    return {
+        makeRule("usb", true, false),
+        makeRule("xhci", true, false),
+        makeRule("hub", true, false),
+        makeRule("error", false, true),
+        makeRule("fail", false, true),
+        makeRule("timeout", false, true),
+        subsystemRule,
+    };
+}
+
+bool EventClassifier::loadRules(const QString &path, QVector<ClassificationRule> &rules, QString *errorMessage) {
+    // {"rules": [{"pattern": "...", "field": "message"|"subsystem",
+    //             "level": "...", "usb": bool, "error": bool}, ...]}
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        if (errorMessage) {
+            *errorMessage = file.errorString();
+        }
+        return false;
+    }
+    QJsonParseError parseError;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if (document.isNull()) {
+        if (errorMessage) {
+            *errorMessage = parseError.errorString();
+        }
+        return false;
+    }
+
+    QVector<ClassificationRule> parsed;
+    const QJsonArray entries = document.object().value(QLatin1String("rules")).toArray();
+    for (int i = 0; i < entries.size(); ++i) {
+        const QJsonObject entry = entries.at(i).toObject();
+        ClassificationRule rule;
+        rule.pattern = entry.value(QLatin1String("pattern")).toString().toUtf8();
+        const QString field = entry.value(QLatin1String("field")).toString(QStringLiteral("message"));
+        rule.level = entry.value(QLatin1String("level")).toString();
+        if (entry.contains(QLatin1String("usb"))) {
+            rule.usb = entry.value(QLatin1String("usb")).toBool();
+        }
+        if (entry.contains(QLatin1String("error"))) {
+            rule.error = entry.value(QLatin1String("error")).toBool();
+        }
+
+        QString problem;
+        if (rule.pattern.isEmpty()) {
+            problem = QStringLiteral("missing pattern");
+        } else if (field == QLatin1String("subsystem")) {
+            rule.field = ClassificationRule::Subsystem;
+        } else if (field != QLatin1String("message")) {
+            problem = QStringLiteral("unknown field \"%1\"").arg(field);
+        }
+        if (!rule.level.isEmpty() && levelRank(rule.level) == 0) {
+            problem = QStringLiteral("unknown level \"%1\"").arg(rule.level);
+        }
+        if (!problem.isEmpty()) {
+            if (errorMessage) {
+                *errorMessage = QStringLiteral("rule %1: %2").arg(i).arg(problem);
+            }
+            return false;
+        }
+        parsed.append(rule);
+    }
+
+    rules = parsed;
+    return true;
+}
+
+std::shared_ptr<const EventClassifier> EventClassifier::current() {
+    std::shared_ptr<const EventClassifier> classifier = std::atomic_load(&g_current);
+    if (!classifier) {
+        // First use without an explicit install(): fall back to the built-in
+        // rules. A racing install() wins over this default.
+        std::shared_ptr<const EventClassifier> expected;
+        auto fallback = std::make_shared<const EventClassifier>();
+        std::atomic_compare_exchange_strong(&g_current, &expected, fallback);
+        classifier = std::atomic_load(&g_current);
+    }
+    return classifier;
+}
+
+void EventClassifier::install(std::shared_ptr<const EventClassifier> classifier) {
+    std::atomic_store(&g_current, std::move(classifier));
+}
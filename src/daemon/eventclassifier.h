@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QByteArrayView>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+#include <optional>
+
+#include "keywordmatcher.h"
+#include "usbtypes.h"
+
+// One line of the classification rules file: when pattern occurs (ASCII
+// case-insensitively) in the given field, the event takes the rule's level
+// and usb / error tags. A tag set to false vetoes that tag, which is how
+// false positives of broader rules are suppressed.
+struct ClassificationRule {
+    enum Field { Message, Subsystem };
+
+    QByteArray pattern;
+    Field field = Message;
+    QString level;
+    std::optional<bool> usb;
+    std::optional<bool> error;
+};
+
+// Decides isUsb / isError / level for a kernel message. The patterns of all
+// rules are compiled into one automaton per field, so each field is scanned
+// once regardless of how many rules there are, and classification never
+// lowercases or copies the text. Instances are immutable apart from their hit
+// counters; reloading the rules installs a new instance.
+class EventClassifier {
+public:
+    explicit EventClassifier(const QVector<ClassificationRule> &rules = defaultRules());
+
+    void classify(QByteArrayView message, QByteArrayView subsystem, UsbEvent &event) const;
+
+    const QVector<ClassificationRule> &rules() const { return m_rules; }
+    // Number of events each rule matched, indexed like rules().
+    QVector<quint64> hitCounts() const;
+
+    static QVector<ClassificationRule> defaultRules();
+    // Parses a JSON rules file. Returns false and sets errorMessage if the
+    // file cannot be read or a rule is malformed.
+    static bool loadRules(const QString &path, QVector<ClassificationRule> &rules, QString *errorMessage);
+
+    // The classifier the log sources use; safe to call from any thread.
+    static std::shared_ptr<const EventClassifier> current();
+    static void install(std::shared_ptr<const EventClassifier> classifier);
+
+private:
+    static constexpr int kFieldCount = 2;
+
+    QVector<ClassificationRule> m_rules;
+    KeywordMatcher m_matchers[kFieldCount];
+    // Rule index for each pattern id of the matcher of a field.
+    QVector<int> m_ruleOfPattern[kFieldCount];
+    std::unique_ptr<std::atomic<quint64>[]> m_hits;
+};
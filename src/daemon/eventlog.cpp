@@ -0,0 +1,1061 @@
+#include "eventlog.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThread>
+#include <QtEndian>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Segment header: magic, format version, flags, first sequence.
+const char kSegmentMagic[8] = {'U', 'S', 'B', 'S', 'L', 'O', 'G', '1'};
+const quint32 kFormatVersion = 1;
+const qint64 kHeaderBytes = 24;
+// Records: payload length, CRC-32 of the payload, payload.
+const qint64 kRecordHeaderBytes = 8;
+const quint32 kMaxRecordBytes = 1 << 20;
+// Sequence, timestamp, monotonic time, flags.
+const quint32 kMinPayloadBytes = 25;
+// Footer: index entries (sequence, timestamp, offset), repeat entries
+// (sequence, last timestamp, repeat count) and the trailer (magic, index
+// entry count, first / last sequence, min / max timestamp, records end,
+// repeat entry count, reserved). Segments sealed before repeat entries were
+// added end in the shorter legacy trailer, which stops at records end.
+const quint32 kFooterMagic = 0x32444955;
+const quint32 kLegacyFooterMagic = 0x58444955;
+const qint64 kIndexEntryBytes = 20;
+const qint64 kRepeatEntryBytes = 20;
+const qint64 kTrailerBytes = 56;
+const qint64 kLegacyTrailerBytes = 48;
+// One index entry per this many records.
+const quint32 kIndexInterval = 64;
+const int kRetentionIntervalMsecs = 60 * 60 * 1000;
+// Header flags. Compressed segments hold blocks of records, each stored as
+// a u32 length followed by qCompress() output, and index entries point at
+// blocks. Incompressible segments were tried and kept as they are.
+const quint32 kCompressedFlag = 1 << 0;
+const quint32 kIncompressibleFlag = 1 << 1;
+const qint64 kFlagsOffset = 12;
+// Uncompressed bytes of records per compressed block.
+const qint64 kCompressionBlockBytes = 64 * 1024;
+// Compression must save at least this share of the bytes to be kept.
+const double kMaxCompressionRatio = 0.9;
+
+enum RecordFlag : quint8 {
+    UsbFlag = 1 << 0,
+    ErrorFlag = 1 << 1,
+    // Repeat update of an earlier event: sequence of that event, timestamp
+    // of the last occurrence, unused monotonic time, flags, repeat count.
+    UpdateFlag = 1 << 2,
+};
+const quint32 kUpdatePayloadBytes = kMinPayloadBytes + 4;
+
+quint32 crc32(const char *data, qsizetype size) {
+    static const auto table = [] {
+        std::array<quint32, 256> entries{};
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    quint32 crc = 0xFFFFFFFFu;
+    for (qsizetype i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<quint8>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void put(QByteArray &out, T value) {
+    const T little = qToLittleEndian(value);
+    out.append(reinterpret_cast<const char *>(&little), sizeof(T));
+}
+
+template <typename T>
+T get(const char *data) {
+    return qFromLittleEndian<T>(data);
+}
+
+void putString(QByteArray &out, const QString &value) {
+    QByteArray utf8 = value.toUtf8();
+    utf8.truncate(0xFFFF);
+    put<quint16>(out, static_cast<quint16>(utf8.size()));
+    out.append(utf8);
+}
+
+// Bounds-checked cursor over a record payload.
+class PayloadReader {
+public:
+    PayloadReader(const char *data, qsizetype size)
+        : m_data(data), m_end(data + size) {}
+
+    bool ok() const { return m_ok; }
+
+    template <typename T>
+    T read() {
+        if (!take(sizeof(T))) {
+            return T();
+        }
+        return get<T>(m_data - sizeof(T));
+    }
+
+    QString readString(qsizetype length) {
+        if (!take(length)) {
+            return {};
+        }
+        return QString::fromUtf8(m_data - length, length);
+    }
+
+private:
+    bool take(qsizetype bytes) {
+        if (!m_ok || m_end - m_data < bytes) {
+            m_ok = false;
+            return false;
+        }
+        m_data += bytes;
+        return true;
+    }
+
+    const char *m_data;
+    const char *m_end;
+    bool m_ok = true;
+};
+
+QByteArray frameRecord(const QByteArray &payload) {
+    QByteArray record;
+    record.reserve(kRecordHeaderBytes + payload.size());
+    put<quint32>(record, static_cast<quint32>(payload.size()));
+    put<quint32>(record, crc32(payload.constData(), payload.size()));
+    record.append(payload);
+    return record;
+}
+
+QByteArray encodeRecord(const UsbEvent &event) {
+    QByteArray payload;
+    payload.reserve(64 + event.message.size());
+    put<quint64>(payload, event.sequence);
+    put<qint64>(payload, event.timestampUs);
+    put<qint64>(payload, event.monotonicUs);
+    put<quint8>(payload, (event.isUsb ? UsbFlag : 0) | (event.isError ? ErrorFlag : 0));
+    putString(payload, event.level);
+    putString(payload, event.subsystem);
+    putString(payload, event.source);
+    putString(payload, event.deviceId);
+    const QByteArray message = event.message.toUtf8();
+    put<quint32>(payload, static_cast<quint32>(message.size()));
+    payload.append(message);
+    return frameRecord(payload);
+}
+
+QByteArray encodeUpdate(const UsbEvent &event) {
+    QByteArray payload;
+    payload.reserve(kUpdatePayloadBytes);
+    put<quint64>(payload, event.sequence);
+    put<qint64>(payload, event.lastTimestampUs);
+    put<qint64>(payload, 0);
+    put<quint8>(payload, UpdateFlag);
+    put<quint32>(payload, event.repeatCount);
+    return frameRecord(payload);
+}
+
+bool isUpdate(const char *payload) {
+    return static_cast<quint8>(payload[24]) & UpdateFlag;
+}
+
+bool decodePayload(const char *data, qsizetype size, UsbEvent &event) {
+    PayloadReader reader(data, size);
+    event.sequence = reader.read<quint64>();
+    event.timestampUs = reader.read<qint64>();
+    event.monotonicUs = reader.read<qint64>();
+    const quint8 flags = reader.read<quint8>();
+    event.isUsb = flags & UsbFlag;
+    event.isError = flags & ErrorFlag;
+    event.level = reader.readString(reader.read<quint16>());
+    event.subsystem = reader.readString(reader.read<quint16>());
+    event.source = reader.readString(reader.read<quint16>());
+    event.deviceId = reader.readString(reader.read<quint16>());
+    event.message = reader.readString(reader.read<quint32>());
+    event.lastTimestampUs = event.timestampUs;
+    return reader.ok();
+}
+
+bool writeAll(int fd, const QByteArray &data) {
+    const char *pos = data.constData();
+    qsizetype remaining = data.size();
+    while (remaining > 0) {
+        const ssize_t n = ::write(fd, pos, static_cast<size_t>(remaining));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += n;
+        remaining -= n;
+    }
+    return true;
+}
+
+QByteArray encodeHeader(quint64 firstSequence, quint32 flags) {
+    QByteArray header(kSegmentMagic, sizeof(kSegmentMagic));
+    put<quint32>(header, kFormatVersion);
+    put<quint32>(header, flags);
+    put<quint64>(header, firstSequence);
+    return header;
+}
+
+QString segmentFileName(quint64 firstSequence) {
+    return QStringLiteral("%1.seg").arg(firstSequence, 20, 10, QLatin1Char('0'));
+}
+}
+
+EventLog::EventLog(const QString &directory, QObject *parent)
+    : QObject(parent), m_directory(directory) {
+    m_syncTimer.setSingleShot(true);
+    m_syncTimer.setInterval(1000);
+    connect(&m_syncTimer, &QTimer::timeout, this, &EventLog::sync);
+    m_retentionTimer.setInterval(kRetentionIntervalMsecs);
+    connect(&m_retentionTimer, &QTimer::timeout, this, &EventLog::applyRetention);
+}
+
+EventLog::~EventLog() {
+    if (m_compressionThread) {
+        // A compressed file it may still write is discarded: its temporary
+        // name is never loaded.
+        m_stopCompression.store(true, std::memory_order_relaxed);
+        m_compressionThread->wait();
+        delete m_compressionThread;
+    }
+    sync();
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+QString EventLog::defaultDirectory() {
+    if (::geteuid() == 0) {
+        return QStringLiteral("/var/lib/usbscope/events");
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/events";
+}
+
+void EventLog::setSegmentBytes(qint64 bytes) {
+    // Index offsets are 32-bit.
+    m_segmentBytes = qBound<qint64>(64 * 1024, bytes, qint64(1) << 30);
+}
+
+void EventLog::setSyncInterval(int msec) {
+    m_syncTimer.setInterval(qMax(0, msec));
+}
+
+void EventLog::setRetention(qint64 maxAgeSeconds, qint64 maxBytes) {
+    m_maxAgeSeconds = qMax<qint64>(0, maxAgeSeconds);
+    m_maxBytes = qMax<qint64>(0, maxBytes);
+}
+
+void EventLog::setUncompressedSegments(int count) {
+    m_uncompressedSegments = qMax(-1, count);
+}
+
+bool EventLog::open() {
+    QDir dir(m_directory);
+    if (!dir.mkpath(QStringLiteral("."))) {
+        qWarning() << "USBscope: Cannot create event log directory" << m_directory;
+        return false;
+    }
+
+    // Left behind by compression that was interrupted.
+    for (const QString &name : dir.entryList({QStringLiteral("*.seg.compressing*")}, QDir::Files)) {
+        dir.remove(name);
+    }
+
+    // Zero-padded names sort in sequence order.
+    const QStringList names = dir.entryList({QStringLiteral("*.seg")}, QDir::Files, QDir::Name);
+    for (const QString &name : names) {
+        Segment segment;
+        if (loadSegment(dir.filePath(name), segment)) {
+            m_segments.append(segment);
+        }
+    }
+
+    // Only the newest segment may stay open for appends; an older unsealed
+    // one was interrupted while rotating and is sealed now.
+    for (int i = 0; i + 1 < m_segments.size(); ++i) {
+        if (!m_segments.at(i).sealed) {
+            m_fd = ::open(QFile::encodeName(m_segments.at(i).path).constData(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (m_fd >= 0) {
+                sealSegment(m_segments[i]);
+            }
+        }
+    }
+    if (!m_segments.isEmpty() && !m_segments.last().sealed) {
+        m_fd = ::open(QFile::encodeName(m_segments.last().path).constData(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (m_fd < 0) {
+            qWarning() << "USBscope: Cannot reopen event log segment" << m_segments.last().path;
+            m_segments.last().sealed = true;
+        }
+    }
+
+    for (const Segment &segment : std::as_const(m_segments)) {
+        for (auto it = segment.repeats.cbegin(); it != segment.repeats.cend(); ++it) {
+            m_repeats.insert(it.key(), it.value());
+        }
+    }
+
+    m_open = true;
+    applyRetention();
+    compressColdSegments();
+    m_retentionTimer.start();
+    return true;
+}
+
+quint64 EventLog::firstSequence() const {
+    for (const Segment &segment : m_segments) {
+        if (segment.recordCount > 0) {
+            return segment.firstSequence;
+        }
+    }
+    return lastSequence() + 1;
+}
+
+quint64 EventLog::lastSequence() const {
+    for (auto it = m_segments.crbegin(); it != m_segments.crend(); ++it) {
+        if (it->recordCount > 0) {
+            return it->lastSequence;
+        }
+    }
+    return 0;
+}
+
+qint64 EventLog::totalBytes() const {
+    qint64 bytes = 0;
+    for (const Segment &segment : m_segments) {
+        bytes += segment.fileBytes;
+    }
+    return bytes;
+}
+
+void EventLog::append(const UsbEvent &event) {
+    if (!m_open) {
+        return;
+    }
+    const QByteArray record = encodeRecord(event);
+    if (m_fd >= 0 && m_segments.last().recordCount > 0
+        && m_segments.last().recordsEnd + record.size() > m_segmentBytes) {
+        sealActiveSegment();
+    }
+    if (m_fd < 0 && !startSegment(event.sequence)) {
+        return;
+    }
+
+    Segment &segment = m_segments.last();
+    if (!writeAll(m_fd, record)) {
+        qWarning() << "USBscope: Writing to event log failed:" << strerror(errno);
+        // Drop a partially written record so the file stays well formed.
+        if (::ftruncate(m_fd, segment.recordsEnd) != 0) {
+            ::close(m_fd);
+            m_fd = -1;
+            segment.sealed = true;
+        }
+        return;
+    }
+    noteRecord(segment, event.sequence, event.timestampUs, segment.recordsEnd);
+    segment.recordsEnd += record.size();
+    segment.fileBytes = segment.recordsEnd;
+
+    m_dirty = true;
+    if (!m_syncTimer.isActive()) {
+        m_syncTimer.start();
+    }
+}
+
+void EventLog::appendRepeat(const UsbEvent &event) {
+    // Updates never start a segment: a segment is named after its first
+    // sequence, which an update does not have.
+    if (!m_open || m_fd < 0) {
+        return;
+    }
+    const QByteArray record = encodeUpdate(event);
+    Segment &segment = m_segments.last();
+    if (!writeAll(m_fd, record)) {
+        if (::ftruncate(m_fd, segment.recordsEnd) != 0) {
+            ::close(m_fd);
+            m_fd = -1;
+            segment.sealed = true;
+        }
+        return;
+    }
+    segment.recordsEnd += record.size();
+    segment.fileBytes = segment.recordsEnd;
+    const Repeat repeat{event.lastTimestampUs, event.repeatCount};
+    segment.repeats.insert(event.sequence, repeat);
+    m_repeats.insert(event.sequence, repeat);
+
+    m_dirty = true;
+    if (!m_syncTimer.isActive()) {
+        m_syncTimer.start();
+    }
+}
+
+void EventLog::sync() {
+    if (m_dirty && m_fd >= 0) {
+        ::fdatasync(m_fd);
+    }
+    m_dirty = false;
+}
+
+void EventLog::applyRetention() {
+    const qint64 cutoffUs = (QDateTime::currentSecsSinceEpoch() - m_maxAgeSeconds) * 1000000;
+    qint64 total = totalBytes();
+    bool removed = false;
+    // The active segment is never removed.
+    while (m_segments.size() > 1 && m_segments.first().sealed) {
+        const Segment &oldest = m_segments.first();
+        const bool expired = m_maxAgeSeconds > 0 && oldest.maxTimestampUs < cutoffUs;
+        const bool overBudget = m_maxBytes > 0 && total > m_maxBytes;
+        if (!expired && !overBudget) {
+            break;
+        }
+        if (!QFile::remove(oldest.path)) {
+            qWarning() << "USBscope: Cannot remove expired event log segment" << oldest.path;
+            break;
+        }
+        total -= oldest.fileBytes;
+        m_segments.removeFirst();
+        removed = true;
+    }
+    if (removed) {
+        const quint64 first = firstSequence();
+        for (auto it = m_repeats.begin(); it != m_repeats.end();) {
+            it = it.key() < first ? m_repeats.erase(it) : std::next(it);
+        }
+    }
+}
+
+QVector<UsbEvent> EventLog::readSince(quint64 sequence, int limit) const {
+    QVector<UsbEvent> events;
+    if (limit <= 0) {
+        return events;
+    }
+    // First segment that can hold the sequence. Only the active segment can
+    // be empty, and it is always last.
+    auto end = m_segments.cend();
+    if (!m_segments.isEmpty() && m_segments.last().recordCount == 0) {
+        --end;
+    }
+    auto it = std::lower_bound(m_segments.cbegin(), end, sequence,
+                               [](const Segment &segment, quint64 value) { return segment.lastSequence < value; });
+    for (; it != end && events.size() < limit; ++it) {
+        readSegment(*it, sequence, limit - events.size(), events);
+    }
+    applyRepeats(events);
+    return events;
+}
+
+QVector<UsbEvent> EventLog::readRange(qint64 startUs, qint64 endUs, int limit) const {
+    QVector<UsbEvent> events;
+    for (const Segment &segment : m_segments) {
+        if (events.size() >= limit) {
+            break;
+        }
+        if (segment.recordCount == 0 || segment.maxTimestampUs < startUs || segment.minTimestampUs > endUs) {
+            continue;
+        }
+        readSegmentRange(segment, startUs, endUs, limit - events.size(), events);
+    }
+    applyRepeats(events);
+    return events;
+}
+
+bool EventLog::loadSegment(const QString &path, Segment &segment) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "USBscope: Cannot read event log segment" << path;
+        return false;
+    }
+    segment.path = path;
+    segment.fileBytes = file.size();
+
+    const QByteArray header = file.read(kHeaderBytes);
+    if (header.size() < kHeaderBytes) {
+        // Crashed right after creating the segment; nothing was stored yet.
+        file.close();
+        QFile::remove(path);
+        return false;
+    }
+    if (std::memcmp(header.constData(), kSegmentMagic, sizeof(kSegmentMagic)) != 0
+        || get<quint32>(header.constData() + 8) != kFormatVersion) {
+        qWarning() << "USBscope: Ignoring event log segment with unknown format" << path;
+        return false;
+    }
+    const quint32 flags = get<quint32>(header.constData() + kFlagsOffset);
+    segment.compressed = flags & kCompressedFlag;
+    segment.incompressible = flags & kIncompressibleFlag;
+    segment.firstSequence = get<quint64>(header.constData() + 16);
+
+    // A valid trailer whose footer exactly fills the end of the file marks a
+    // sealed segment.
+    QByteArray trailer;
+    bool legacy = false;
+    if (segment.fileBytes >= kHeaderBytes + kLegacyTrailerBytes) {
+        const qint64 tailBytes = qMin(kTrailerBytes, segment.fileBytes - kHeaderBytes);
+        if (file.seek(segment.fileBytes - tailBytes)) {
+            const QByteArray tail = file.read(tailBytes);
+            if (tail.size() == kTrailerBytes && get<quint32>(tail.constData()) == kFooterMagic) {
+                trailer = tail;
+            } else if (tail.size() >= kLegacyTrailerBytes
+                       && get<quint32>(tail.constData() + tail.size() - kLegacyTrailerBytes) == kLegacyFooterMagic) {
+                trailer = tail.right(kLegacyTrailerBytes);
+                legacy = true;
+            }
+        }
+    }
+    if (!trailer.isEmpty()) {
+        const char *data = trailer.constData();
+        const quint32 entryCount = get<quint32>(data + 4);
+        const qint64 recordsEnd = get<qint64>(data + 40);
+        const quint32 repeatCount = legacy ? 0 : get<quint32>(data + 48);
+        const qint64 entryBytes = entryCount * kIndexEntryBytes;
+        const qint64 repeatBytes = repeatCount * kRepeatEntryBytes;
+        if (recordsEnd >= kHeaderBytes && recordsEnd + entryBytes + repeatBytes + trailer.size() == segment.fileBytes
+            && file.seek(recordsEnd)) {
+            const QByteArray entries = file.read(entryBytes);
+            const QByteArray repeats = file.read(repeatBytes);
+            const quint64 firstSequence = get<quint64>(data + 8);
+            const quint64 lastSequence = get<quint64>(data + 16);
+            QVector<IndexEntry> index;
+            if (entries.size() == entryBytes) {
+                index.reserve(entryCount);
+                for (quint32 i = 0; i < entryCount; ++i) {
+                    const char *entry = entries.constData() + i * kIndexEntryBytes;
+                    index.append({get<quint64>(entry), get<qint64>(entry + 8), get<quint32>(entry + 16)});
+                }
+            }
+            const bool indexValid = entries.size() == entryBytes && repeats.size() == repeatBytes
+                && isValidIndex(index, firstSequence, lastSequence, recordsEnd);
+            // Records are read linearly from the start of the damaged
+            // index's segment: uncompressed ones are rescanned below,
+            // which rebuilds the index, while compressed blocks are
+            // served without one.
+            if (indexValid || segment.compressed) {
+                if (!indexValid) {
+                    qWarning() << "USBscope: Damaged index in compressed event log segment" << path
+                               << "- reading it without one";
+                    index.clear();
+                }
+                segment.firstSequence = firstSequence;
+                segment.lastSequence = lastSequence;
+                segment.minTimestampUs = get<qint64>(data + 24);
+                segment.maxTimestampUs = get<qint64>(data + 32);
+                segment.recordsEnd = recordsEnd;
+                segment.index = index;
+                // Record count is only used to tell empty segments apart.
+                segment.recordCount = segment.lastSequence >= segment.firstSequence
+                    ? static_cast<quint32>(segment.lastSequence - segment.firstSequence + 1) : 0;
+                segment.sealed = true;
+                if (legacy || !indexValid) {
+                    collectRepeats(segment);
+                } else {
+                    segment.repeats.reserve(repeatCount);
+                    for (quint32 i = 0; i < repeatCount; ++i) {
+                        const char *entry = repeats.constData() + i * kRepeatEntryBytes;
+                        segment.repeats.insert(get<quint64>(entry),
+                                               Repeat{get<qint64>(entry + 8), get<quint32>(entry + 16)});
+                    }
+                }
+                return true;
+            }
+            qWarning() << "USBscope: Damaged index in event log segment" << path << "- rebuilding it";
+            file.close();
+            // The footer is dropped as a torn tail and written anew when
+            // the segment is sealed again.
+            return recoverSegment(segment);
+        }
+    }
+    file.close();
+    if (segment.compressed) {
+        // Compressed segments are written in one piece and renamed into
+        // place, so a missing footer means the file is damaged.
+        qWarning() << "USBscope: Ignoring damaged compressed event log segment" << path;
+        return false;
+    }
+    return recoverSegment(segment);
+}
+
+bool EventLog::isValidIndex(const QVector<IndexEntry> &index, quint64 firstSequence, quint64 lastSequence,
+                            qint64 recordsEnd) {
+    // Reads seek to entry offsets and binary search entry sequences, so
+    // both must lie within the segment and increase.
+    qint64 previousOffset = kHeaderBytes - 1;
+    quint64 previousSequence = 0;
+    for (const IndexEntry &entry : index) {
+        if (entry.offset <= previousOffset || entry.offset >= recordsEnd || entry.sequence < firstSequence
+            || entry.sequence > lastSequence || (previousSequence != 0 && entry.sequence <= previousSequence)) {
+            return false;
+        }
+        previousOffset = entry.offset;
+        previousSequence = entry.sequence;
+    }
+    return true;
+}
+
+bool EventLog::recoverSegment(Segment &segment) {
+    QFile file(segment.path);
+    if (!file.open(QIODevice::ReadWrite)) {
+        qWarning() << "USBscope: Cannot recover event log segment" << segment.path;
+        return false;
+    }
+    const qint64 size = file.size();
+    const uchar *map = file.map(0, size);
+    if (!map) {
+        return false;
+    }
+    const char *data = reinterpret_cast<const char *>(map);
+
+    // Walk the records; the first one that is incomplete, fails its checksum
+    // or breaks sequence order marks the torn tail.
+    qint64 offset = kHeaderBytes;
+    quint64 previous = 0;
+    while (offset + kRecordHeaderBytes <= size) {
+        const quint32 length = get<quint32>(data + offset);
+        const quint32 checksum = get<quint32>(data + offset + 4);
+        const char *payload = data + offset + kRecordHeaderBytes;
+        if (length < kMinPayloadBytes || length > kMaxRecordBytes
+            || offset + kRecordHeaderBytes + length > size
+            || crc32(payload, length) != checksum) {
+            break;
+        }
+        const quint64 sequence = get<quint64>(payload);
+        if (isUpdate(payload)) {
+            // Updates refer back to an event already written.
+            if (sequence > previous || length < kUpdatePayloadBytes) {
+                break;
+            }
+            segment.repeats.insert(sequence, Repeat{get<qint64>(payload + 8), get<quint32>(payload + 25)});
+        } else {
+            if (sequence <= previous) {
+                break;
+            }
+            noteRecord(segment, sequence, get<qint64>(payload + 8), offset);
+            previous = sequence;
+        }
+        offset += kRecordHeaderBytes + length;
+    }
+    file.unmap(const_cast<uchar *>(map));
+
+    if (offset < size) {
+        qWarning() << "USBscope: Truncating torn tail of event log segment" << segment.path
+                   << "at" << offset << "of" << size << "bytes";
+        if (!file.resize(offset)) {
+            return false;
+        }
+    }
+    segment.recordsEnd = offset;
+    segment.fileBytes = offset;
+    return true;
+}
+
+bool EventLog::startSegment(quint64 firstSequence) {
+    Segment segment;
+    segment.path = QDir(m_directory).filePath(segmentFileName(firstSequence));
+    segment.firstSequence = firstSequence;
+    m_fd = ::open(QFile::encodeName(segment.path).constData(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        qWarning() << "USBscope: Cannot create event log segment" << segment.path << strerror(errno);
+        return false;
+    }
+
+    if (!writeAll(m_fd, encodeHeader(firstSequence, 0))) {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    segment.recordsEnd = kHeaderBytes;
+    segment.fileBytes = kHeaderBytes;
+    m_segments.append(segment);
+    return true;
+}
+
+void EventLog::sealActiveSegment() {
+    sealSegment(m_segments.last());
+    applyRetention();
+    compressColdSegments();
+}
+
+void EventLog::compressColdSegments() {
+    if (m_uncompressedSegments < 0 || m_compressionThread) {
+        return;
+    }
+    int hot = 0;
+    for (int i = m_segments.size() - 1; i >= 0; --i) {
+        const Segment &segment = m_segments.at(i);
+        if (!segment.sealed || segment.recordCount == 0) {
+            continue;
+        }
+        if (hot < m_uncompressedSegments) {
+            ++hot;
+            continue;
+        }
+        if (!segment.compressed && !segment.incompressible) {
+            // Sealed segments never change, so the worker can read this copy
+            // while the main thread keeps serving reads of the same file.
+            m_stopCompression.store(false, std::memory_order_relaxed);
+            m_compressionThread = QThread::create([this, segment]() {
+                const Compression result = compressSegment(segment, m_stopCompression);
+                QMetaObject::invokeMethod(this, [this, result]() { finishCompression(result); },
+                                          Qt::QueuedConnection);
+            });
+            m_compressionThread->start(QThread::LowPriority);
+            return;
+        }
+    }
+}
+
+EventLog::Compression EventLog::compressSegment(const Segment &segment, const std::atomic<bool> &stop) {
+    Compression result;
+    result.path = segment.path;
+    QFile source(segment.path);
+    if (!source.open(QIODevice::ReadOnly)) {
+        return result;
+    }
+    const uchar *map = source.map(0, segment.recordsEnd);
+    if (!map) {
+        return result;
+    }
+    const char *data = reinterpret_cast<const char *>(map);
+
+    // Cut the records into blocks at record boundaries, compress each block
+    // and index it by its first record. Every record is checked first, so a
+    // damaged segment is left alone rather than read past its end.
+    Segment compressed = segment;
+    compressed.index.clear();
+    QByteArray body;
+    qint64 offset = kHeaderBytes;
+    bool damaged = false;
+    while (offset < segment.recordsEnd && !damaged) {
+        if (stop.load(std::memory_order_relaxed)) {
+            source.unmap(const_cast<uchar *>(map));
+            return result;
+        }
+        const qint64 blockStart = offset;
+        const char *first = nullptr;
+        while (offset < segment.recordsEnd && offset - blockStart < kCompressionBlockBytes) {
+            if (offset + kRecordHeaderBytes > segment.recordsEnd) {
+                damaged = true;
+                break;
+            }
+            const quint32 length = get<quint32>(data + offset);
+            const char *payload = data + offset + kRecordHeaderBytes;
+            if (length < kMinPayloadBytes || length > kMaxRecordBytes
+                || length > segment.recordsEnd - offset - kRecordHeaderBytes
+                || crc32(payload, length) != get<quint32>(data + offset + 4)) {
+                damaged = true;
+                break;
+            }
+            if (!first && !isUpdate(payload)) {
+                first = payload;
+            }
+            offset += kRecordHeaderBytes + length;
+        }
+        if (damaged) {
+            break;
+        }
+        // A block of nothing but updates is reached by scanning on from the
+        // block before it.
+        if (first) {
+            compressed.index.append({get<quint64>(first), get<qint64>(first + 8),
+                                     static_cast<quint32>(kHeaderBytes + body.size())});
+        }
+        const QByteArray block = qCompress(reinterpret_cast<const uchar *>(data + blockStart),
+                                           static_cast<qsizetype>(offset - blockStart));
+        put<quint32>(body, static_cast<quint32>(block.size()));
+        body.append(block);
+    }
+    source.unmap(const_cast<uchar *>(map));
+
+    if (damaged) {
+        qWarning() << "USBscope: Not compressing damaged event log segment" << segment.path
+                   << "at offset" << offset;
+        result.incompressible = true;
+        return result;
+    }
+    if (kHeaderBytes + body.size() > segment.recordsEnd * kMaxCompressionRatio) {
+        result.incompressible = true;
+        return result;
+    }
+
+    compressed.recordsEnd = kHeaderBytes + body.size();
+    compressed.compressed = true;
+    const QByteArray footer = encodeFooter(compressed);
+    compressed.fileBytes = compressed.recordsEnd + footer.size();
+    result.tempPath = segment.path + QStringLiteral(".compressing");
+    QSaveFile target(result.tempPath);
+    if (!target.open(QIODevice::WriteOnly)) {
+        return result;
+    }
+    target.write(encodeHeader(compressed.firstSequence, kCompressedFlag));
+    target.write(body);
+    target.write(footer);
+    if (!target.commit()) {
+        qWarning() << "USBscope: Cannot write compressed event log segment" << result.tempPath;
+        return result;
+    }
+    result.compressed = compressed;
+    result.done = true;
+    return result;
+}
+
+void EventLog::markIncompressible(const QString &path) {
+    // Remembered in the header so it is not retried on the next start.
+    QFile file(path);
+    quint32 flags = 0;
+    if (file.open(QIODevice::ReadWrite) && file.seek(kFlagsOffset)
+        && file.read(reinterpret_cast<char *>(&flags), sizeof(flags)) == sizeof(flags)) {
+        flags = qToLittleEndian(qFromLittleEndian(flags) | kIncompressibleFlag);
+        file.seek(kFlagsOffset);
+        file.write(reinterpret_cast<const char *>(&flags), sizeof(flags));
+    }
+}
+
+void EventLog::finishCompression(const Compression &result) {
+    m_compressionThread->wait();
+    delete m_compressionThread;
+    m_compressionThread = nullptr;
+
+    auto it = std::find_if(m_segments.begin(), m_segments.end(),
+                           [&result](const Segment &segment) { return segment.path == result.path; });
+    if (it == m_segments.end()) {
+        // Removed by retention meanwhile.
+        if (!result.tempPath.isEmpty()) {
+            QFile::remove(result.tempPath);
+        }
+    } else if (result.done) {
+        // Readers open segments by path for every read, so the swap only
+        // has to happen together with the new index.
+        if (::rename(QFile::encodeName(result.tempPath).constData(), QFile::encodeName(result.path).constData()) == 0) {
+            *it = result.compressed;
+        } else {
+            qWarning() << "USBscope: Cannot replace event log segment" << result.path << strerror(errno);
+            QFile::remove(result.tempPath);
+            it->incompressible = true;
+        }
+    } else if (result.incompressible) {
+        markIncompressible(result.path);
+        it->incompressible = true;
+    } else {
+        // Could not be read or written; not retried until the next start.
+        it->incompressible = true;
+    }
+    compressColdSegments();
+}
+
+QByteArray EventLog::encodeFooter(const Segment &segment) {
+    QByteArray footer;
+    footer.reserve(segment.index.size() * kIndexEntryBytes + segment.repeats.size() * kRepeatEntryBytes
+                   + kTrailerBytes);
+    for (const IndexEntry &entry : segment.index) {
+        put<quint64>(footer, entry.sequence);
+        put<qint64>(footer, entry.timestampUs);
+        put<quint32>(footer, entry.offset);
+    }
+    QList<quint64> sequences = segment.repeats.keys();
+    std::sort(sequences.begin(), sequences.end());
+    for (quint64 sequence : std::as_const(sequences)) {
+        const Repeat repeat = segment.repeats.value(sequence);
+        put<quint64>(footer, sequence);
+        put<qint64>(footer, repeat.lastTimestampUs);
+        put<quint32>(footer, repeat.repeatCount);
+    }
+    put<quint32>(footer, kFooterMagic);
+    put<quint32>(footer, static_cast<quint32>(segment.index.size()));
+    put<quint64>(footer, segment.firstSequence);
+    put<quint64>(footer, segment.lastSequence);
+    put<qint64>(footer, segment.minTimestampUs);
+    put<qint64>(footer, segment.maxTimestampUs);
+    put<qint64>(footer, segment.recordsEnd);
+    put<quint32>(footer, static_cast<quint32>(sequences.size()));
+    put<quint32>(footer, 0);
+    return footer;
+}
+
+void EventLog::sealSegment(Segment &segment) {
+    const QByteArray footer = encodeFooter(segment);
+    if (writeAll(m_fd, footer)) {
+        segment.fileBytes = segment.recordsEnd + footer.size();
+    } else {
+        // Left unsealed; the next startup recovers it by scanning.
+        qWarning() << "USBscope: Writing event log index failed:" << strerror(errno);
+    }
+    ::fdatasync(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+    m_dirty = false;
+    segment.sealed = true;
+}
+
+void EventLog::applyRepeats(QVector<UsbEvent> &events) const {
+    if (m_repeats.isEmpty()) {
+        return;
+    }
+    for (UsbEvent &event : events) {
+        const auto it = m_repeats.constFind(event.sequence);
+        if (it != m_repeats.cend()) {
+            event.lastTimestampUs = it->lastTimestampUs;
+            event.repeatCount = it->repeatCount;
+        }
+    }
+}
+
+void EventLog::noteRecord(Segment &segment, quint64 sequence, qint64 timestampUs, qint64 offset) {
+    if (segment.recordCount % kIndexInterval == 0) {
+        segment.index.append({sequence, timestampUs, static_cast<quint32>(offset)});
+    }
+    if (segment.recordCount == 0) {
+        segment.firstSequence = sequence;
+        segment.minTimestampUs = timestampUs;
+        segment.maxTimestampUs = timestampUs;
+    }
+    segment.lastSequence = sequence;
+    segment.minTimestampUs = qMin(segment.minTimestampUs, timestampUs);
+    segment.maxTimestampUs = qMax(segment.maxTimestampUs, timestampUs);
+    ++segment.recordCount;
+}
+
+template <typename Visitor>
+bool EventLog::scanRecords(const char *data, qint64 offset, qint64 end, Visitor &visit) {
+    while (offset + kRecordHeaderBytes <= end) {
+        const quint32 length = get<quint32>(data + offset);
+        if (length < kMinPayloadBytes || offset + kRecordHeaderBytes + length > end) {
+            break;
+        }
+        const char *payload = data + offset + kRecordHeaderBytes;
+        offset += kRecordHeaderBytes + length;
+        if (!visit(payload, length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Visitor>
+void EventLog::scanSegment(const Segment &segment, qint64 offset, Visitor visit) const {
+    QFile file(segment.path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    const uchar *map = file.map(0, segment.recordsEnd);
+    if (!map) {
+        return;
+    }
+    const char *data = reinterpret_cast<const char *>(map);
+    if (!segment.compressed) {
+        scanRecords(data, offset, segment.recordsEnd, visit);
+    } else {
+        // offset is the start of a block; only blocks from there on until
+        // the visitor stops are decompressed.
+        while (offset + 4 <= segment.recordsEnd) {
+            const quint32 length = get<quint32>(data + offset);
+            if (offset + 4 + length > segment.recordsEnd) {
+                break;
+            }
+            const QByteArray block = qUncompress(reinterpret_cast<const uchar *>(data + offset + 4),
+                                                 static_cast<qsizetype>(length));
+            offset += 4 + length;
+            if (block.isEmpty() || !scanRecords(block.constData(), 0, block.size(), visit)) {
+                break;
+            }
+        }
+    }
+    file.unmap(const_cast<uchar *>(map));
+}
+
+void EventLog::collectRepeats(Segment &segment) const {
+    segment.repeats.clear();
+    scanSegment(segment, kHeaderBytes, [&segment](const char *payload, quint32 length) {
+        if (isUpdate(payload) && length >= kUpdatePayloadBytes) {
+            segment.repeats.insert(get<quint64>(payload), Repeat{get<qint64>(payload + 8), get<quint32>(payload + 25)});
+        }
+        return true;
+    });
+}
+
+void EventLog::readSegment(const Segment &segment, quint64 sequence, int limit, QVector<UsbEvent> &events) const {
+    if (segment.recordCount == 0 || segment.lastSequence < sequence) {
+        return;
+    }
+    // Start at the last index entry at or before the wanted sequence.
+    qint64 offset = kHeaderBytes;
+    auto entry = std::upper_bound(segment.index.cbegin(), segment.index.cend(), sequence,
+                                  [](quint64 value, const IndexEntry &e) { return value < e.sequence; });
+    if (entry != segment.index.cbegin()) {
+        offset = std::prev(entry)->offset;
+    }
+
+    int added = 0;
+    scanSegment(segment, offset, [&](const char *payload, quint32 length) {
+        if (get<quint64>(payload) < sequence) {
+            return true;
+        }
+        // Repeat counts are applied from m_repeats afterwards.
+        if (isUpdate(payload)) {
+            return true;
+        }
+        UsbEvent event;
+        if (decodePayload(payload, length, event)) {
+            events.append(event);
+            ++added;
+        }
+        return added < limit;
+    });
+}
+
+void EventLog::readSegmentRange(const Segment &segment, qint64 startUs, qint64 endUs, int limit,
+                                QVector<UsbEvent> &events) const {
+    // Within a segment timestamps are assumed to be ordered: start one index
+    // entry before the first one at or after startUs and stop at the first
+    // record past endUs.
+    qint64 offset = kHeaderBytes;
+    auto entry = std::partition_point(segment.index.cbegin(), segment.index.cend(),
+                                      [startUs](const IndexEntry &e) { return e.timestampUs < startUs; });
+    if (entry != segment.index.cbegin()) {
+        offset = std::prev(entry)->offset;
+    }
+
+    int added = 0;
+    scanSegment(segment, offset, [&](const char *payload, quint32 length) {
+        if (isUpdate(payload)) {
+            return true;
+        }
+        const qint64 timestamp = get<qint64>(payload + 8);
+        if (timestamp > endUs) {
+            return false;
+        }
+        if (timestamp < startUs) {
+            return true;
+        }
+        UsbEvent event;
+        if (decodePayload(payload, length, event)) {
+            events.append(event);
+            ++added;
+        }
+        return added < limit;
+    });
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include <atomic>
+
+#include "usbtypes.h"
+
+// Persistent, append-only history of stored events, split into segment files
+// of bounded size in one directory. A segment starts with a small header and
+// holds length-prefixed, checksummed records in sequence order. When it is
+// full it is sealed by appending an index footer (a sparse sequence /
+// timestamp -> offset table plus a fixed-size trailer), so opening the log
+// only reads footers. Only the unsealed newest segment is scanned on
+// startup, and a torn record at its end (from a crash mid-write) is
+// truncated away.
+//
+// Writes go straight to the file; fdatasync runs at most once per sync
+// interval, which bounds how much a power loss can take. Reads map segment
+// files read-only. Whole sealed segments are deleted once they are older
+// than the age limit or the log exceeds its byte limit. Repeat counts of
+// coalesced events are appended as small update records that refer back to
+// their event. An update can land many segments after its event, so the
+// footer also lists the newest update each segment holds per event, and the
+// log keeps the newest one of every event in memory to apply to reads.
+//
+// Sealed segments that have gone cold are rewritten compressed: records are
+// cut into blocks of about 64 KiB, each compressed on its own with zlib
+// (qCompress), and the footer index points at blocks, so a read only
+// decompresses the blocks it touches. Segments that do not shrink enough
+// stay uncompressed. Compression runs on a worker thread, one segment at a
+// time, into a temporary file; the main thread only swaps it in, so neither
+// startup nor sealing waits for it.
+class QThread;
+
+class EventLog : public QObject {
+    Q_OBJECT
+public:
+    explicit EventLog(const QString &directory, QObject *parent = nullptr);
+    ~EventLog() override;
+
+    static QString defaultDirectory();
+
+    // Must be configured before open().
+    void setSegmentBytes(qint64 bytes);
+    void setSyncInterval(int msec);
+    // 0 disables the respective limit.
+    void setRetention(qint64 maxAgeSeconds, qint64 maxBytes);
+    // Sealed segments beyond the newest count are compressed; -1 disables
+    // compression.
+    void setUncompressedSegments(int count);
+
+    bool open();
+    bool isOpen() const { return m_open; }
+    // Whether cold segments are still being compressed.
+    bool isCompressing() const { return m_compressionThread != nullptr; }
+
+    // Oldest and newest sequence on disk; firstSequence() > lastSequence()
+    // when the log is empty.
+    quint64 firstSequence() const;
+    quint64 lastSequence() const;
+    qint64 totalBytes() const;
+
+    // Appends an event whose sequence field is set and greater than
+    // lastSequence(). Events become readable immediately.
+    void append(const UsbEvent &event);
+    // Records a new repeat count and last timestamp for an appended event.
+    // Readers apply it to the event when they come across both.
+    void appendRepeat(const UsbEvent &event);
+
+    // Up to limit events with sequence >= sequence, oldest first.
+    QVector<UsbEvent> readSince(quint64 sequence, int limit) const;
+    // Up to limit events with startUs <= timestamp <= endUs, oldest first.
+    // Segments outside the range are skipped by their footer timestamps and
+    // the start inside a segment is found by binary search on its index.
+    QVector<UsbEvent> readRange(qint64 startUs, qint64 endUs, int limit) const;
+
+public slots:
+    void sync();
+    void applyRetention();
+
+private:
+    struct IndexEntry {
+        quint64 sequence = 0;
+        qint64 timestampUs = 0;
+        quint32 offset = 0;
+    };
+
+    // Newest repeat count and last occurrence recorded for an event.
+    struct Repeat {
+        qint64 lastTimestampUs = 0;
+        quint32 repeatCount = 1;
+    };
+
+    struct Segment {
+        QString path;
+        quint64 firstSequence = 0;
+        quint64 lastSequence = 0;
+        qint64 minTimestampUs = 0;
+        qint64 maxTimestampUs = 0;
+        // End of the records, i.e. start of the footer once sealed.
+        qint64 recordsEnd = 0;
+        qint64 fileBytes = 0;
+        quint32 recordCount = 0;
+        bool sealed = false;
+        bool compressed = false;
+        bool incompressible = false;
+        QVector<IndexEntry> index;
+        // Updates stored in this segment, newest per event sequence.
+        QHash<quint64, Repeat> repeats;
+    };
+
+    bool loadSegment(const QString &path, Segment &segment);
+    // Whether the footer index of a sealed segment can be trusted.
+    static bool isValidIndex(const QVector<IndexEntry> &index, quint64 firstSequence, quint64 lastSequence,
+                             qint64 recordsEnd);
+    bool recoverSegment(Segment &segment);
+    // Fills segment.repeats by scanning, for segments sealed before footers
+    // listed them.
+    void collectRepeats(Segment &segment) const;
+    bool startSegment(quint64 firstSequence);
+    static QByteArray encodeFooter(const Segment &segment);
+    void sealSegment(Segment &segment);
+    void sealActiveSegment();
+    // Outcome of compressing one segment on the worker thread.
+    struct Compression {
+        QString path;
+        // The compressed segment, written next to the original.
+        QString tempPath;
+        Segment compressed;
+        bool done = false;
+        // Compression would not save enough, or the records are damaged.
+        bool incompressible = false;
+    };
+
+    // Starts compressing the next cold segment unless one is in progress.
+    void compressColdSegments();
+    static Compression compressSegment(const Segment &segment, const std::atomic<bool> &stop);
+    void finishCompression(const Compression &result);
+    static void markIncompressible(const QString &path);
+    void noteRecord(Segment &segment, quint64 sequence, qint64 timestampUs, qint64 offset);
+    // Calls visit(payload, length) for each record from offset on until it
+    // returns false. For compressed segments offset must start a block.
+    template <typename Visitor>
+    void scanSegment(const Segment &segment, qint64 offset, Visitor visit) const;
+    template <typename Visitor>
+    static bool scanRecords(const char *data, qint64 offset, qint64 end, Visitor &visit);
+    void readSegment(const Segment &segment, quint64 sequence, int limit, QVector<UsbEvent> &events) const;
+    void readSegmentRange(const Segment &segment, qint64 startUs, qint64 endUs, int limit,
+                          QVector<UsbEvent> &events) const;
+    // Gives events read from the log their newest repeat count.
+    void applyRepeats(QVector<UsbEvent> &events) const;
+
+    QString m_directory;
+    qint64 m_segmentBytes = 8 * 1024 * 1024;
+    qint64 m_maxAgeSeconds = 0;
+    qint64 m_maxBytes = 0;
+    int m_uncompressedSegments = 2;
+    // Oldest first; the last one is the active segment while the log is open.
+    QList<Segment> m_segments;
+    // Newest update of every event in the log that has one.
+    QHash<quint64, Repeat> m_repeats;
+    bool m_open = false;
+    // Descriptor of the segment being appended to, if any.
+    int m_fd = -1;
+    bool m_dirty = false;
+    QTimer m_syncTimer;
+    QTimer m_retentionTimer;
+    QThread *m_compressionThread = nullptr;
+    std::atomic<bool> m_stopCompression{false};
+};
@@ -0,0 +1,420 @@
+#include "eventring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+namespace {
+// Positions per time index entry.
+const quint64 kBlockSize = 64;
+// Storage allocated up front, unless the budget is small; both grow by
+// doubling.
+const int kInitialCapacity = 1024;
+const qint64 kInitialArenaBytes = 64 * 1024;
+// Storage is never shrunk below this. The arena must hold two of the
+// longest messages, so one always fits after skipping its unusable end.
+const int kMinCapacity = 64;
+const qint64 kMinArenaBytes = 2 * EventRing::kMaxMessageBytes;
+
+int blockCount(int capacity) {
+    // Retained positions span at most this many blocks.
+    return capacity / static_cast<int>(kBlockSize) + 2;
+}
+}
+
+EventRing::EventRing(qint64 budgetBytes)
+    : m_budget(qMax<qint64>(0, budgetBytes)) {
+    // Small budgets start with storage taking at most half of them.
+    int capacity = kInitialCapacity;
+    qint64 arenaBytes = kInitialArenaBytes;
+    while (capacity > kMinCapacity && storageBytes(capacity, arenaBytes) > m_budget / 2) {
+        capacity /= 2;
+        arenaBytes = qMax(kMinArenaBytes, arenaBytes / 2);
+    }
+    reallocate(capacity, arenaBytes);
+}
+
+void EventRing::setBudget(qint64 bytes) {
+    m_budget = qMax<qint64>(0, bytes);
+
+    // Evict until the retained events and their share of the index fit
+    // storage sized for them, then shrink the storage to that size.
+    qint64 messageBytes = 0;
+    for (quint64 position = m_firstPosition; position < m_nextPosition; ++position) {
+        messageBytes += m_messageLength.at(slot(position));
+    }
+    const auto wantedCapacity = [this]() {
+        return qMin(capacity(), qMax(kMinCapacity, static_cast<int>(qNextPowerOfTwo(static_cast<quint32>(size())))));
+    };
+    const auto wantedArena = [&]() {
+        return qMin<qint64>(m_arena.size(), qMax(kMinArenaBytes, static_cast<qint64>(qNextPowerOfTwo(
+                                                                     static_cast<quint64>(messageBytes + kMaxMessageBytes)))));
+    };
+    const qint64 indexBytes = m_search.memoryBytes();
+    const qint64 retained = size();
+    while (size() > 1
+           && storageBytes(wantedCapacity(), wantedArena()) + m_strings.memoryBytes() + indexBytes * size() / retained
+               > m_budget) {
+        messageBytes -= m_messageLength.at(slot(m_firstPosition));
+        evictOldest();
+    }
+    m_search.compact();
+    if (wantedCapacity() < capacity() || wantedArena() < m_arena.size()) {
+        reallocate(wantedCapacity(), wantedArena());
+    }
+    evictToBudget();
+}
+
+QString EventRing::truncatedMessage(const QString &message) {
+    // UTF-8 takes at most three bytes per UTF-16 code unit.
+    if (message.size() * 3 <= kMaxMessageBytes) {
+        return message;
+    }
+    const QByteArray utf8 = message.toUtf8();
+    if (utf8.size() <= kMaxMessageBytes) {
+        return message;
+    }
+    // Back up over continuation bytes to the start of the code point that
+    // does not fit.
+    qsizetype end = kMaxMessageBytes;
+    while (end > 0 && (static_cast<quint8>(utf8.at(end)) & 0xC0) == 0x80) {
+        --end;
+    }
+    return QString::fromUtf8(utf8.constData(), end);
+}
+
+void EventRing::append(const UsbEvent &event) {
+    QByteArray message = event.message.toUtf8();
+    if (message.size() > kMaxMessageBytes) {
+        message = truncatedMessage(event.message).toUtf8();
+    }
+    const quint64 length = static_cast<quint64>(message.size());
+
+    // Storage grows while the budget allows it; after that the oldest
+    // events make room.
+    for (;;) {
+        if (isEmpty()) {
+            m_arenaTail = m_arenaHead;
+        }
+        const bool slotsFull = size() == capacity();
+        const bool arenaFull = arenaPlacement(length) + length - m_arenaTail > static_cast<quint64>(m_arena.size());
+        if (!slotsFull && !arenaFull) {
+            break;
+        }
+        // Doubling, or smaller steps near the budget so less of it stays
+        // unused; quarters of the current size.
+        bool grown = false;
+        for (const int quarters : {8, 6, 5}) {
+            const int grownCapacity = slotsFull ? capacity() * quarters / 4 : capacity();
+            const qint64 grownArena = arenaFull ? m_arena.size() * quarters / 4 : m_arena.size();
+            if (isEmpty() || canGrow(grownCapacity, grownArena)) {
+                reallocate(grownCapacity, grownArena);
+                grown = true;
+                break;
+            }
+        }
+        if (!grown) {
+            evictOldest();
+        }
+    }
+
+    const quint64 position = m_nextPosition++;
+    const quint64 offset = arenaPlacement(length);
+    const int index = slot(position);
+    m_sequence[index] = event.sequence;
+    m_timestampUs[index] = event.timestampUs;
+    m_monotonicUs[index] = event.monotonicUs;
+    m_level[index] = m_strings.intern(event.level);
+    m_subsystem[index] = m_strings.intern(event.subsystem);
+    m_source[index] = m_strings.intern(event.source);
+    m_device[index] = m_strings.intern(event.deviceId);
+    m_flags[index] = (event.isUsb ? UsbFlag : 0) | (event.isError ? ErrorFlag : 0);
+    m_messageOffset[index] = offset;
+    m_messageLength[index] = static_cast<quint32>(length);
+    m_repeatCount[index] = qMax(1u, event.repeatCount);
+    m_lastTimestampUs[index] = qMax(event.timestampUs, event.lastTimestampUs);
+    const int blockIndex = block(position / kBlockSize);
+    if (position % kBlockSize == 0 || position == m_firstPosition) {
+        m_blockMinTimestampUs[blockIndex] = event.timestampUs;
+    }
+    m_maxTimestampUs = qMax(m_maxTimestampUs, event.timestampUs);
+    m_blockMaxTimestampUs[blockIndex] = m_maxTimestampUs;
+    m_blockMinTimestampUs[blockIndex] = qMin(m_blockMinTimestampUs.at(blockIndex), event.timestampUs);
+    if (length > 0) {
+        std::memcpy(m_arena.data() + offset % static_cast<quint64>(m_arena.size()), message.constData(), length);
+    }
+    m_arenaHead = offset + length;
+    m_search.add(position, SearchIndex::fold(message));
+    evictToBudget();
+}
+
+bool EventRing::updateRepeat(quint64 sequence, quint32 repeatCount, qint64 lastTimestampUs) {
+    const quint64 position = positionOf(sequence);
+    if (position == m_nextPosition || m_sequence.at(slot(position)) != sequence) {
+        return false;
+    }
+    // The time index only covers first occurrences, so it stays valid.
+    m_repeatCount[slot(position)] = repeatCount;
+    m_lastTimestampUs[slot(position)] = lastTimestampUs;
+    return true;
+}
+
+void EventRing::evictOldest() {
+    const int index = slot(m_firstPosition);
+    m_evictedSequence = m_sequence.at(index);
+    m_evictedTimestampUs = qMax(m_evictedTimestampUs, m_timestampUs.at(index));
+    ++m_firstPosition;
+    m_arenaTail = isEmpty() ? m_arenaHead : m_messageOffset.at(slot(m_firstPosition));
+    m_search.evictBefore(m_firstPosition);
+}
+
+void EventRing::evictToBudget() {
+    // Storage stays allocated, so only the index gives memory back: keep the
+    // share of the events whose postings fit three quarters of its room.
+    while (size() > 1 && usedBytes() > m_budget) {
+        const qint64 room = m_budget - allocatedBytes();
+        const qint64 indexBytes = m_search.memoryBytes();
+        if (room <= 0 || indexBytes == 0) {
+            // Evicting cannot help; the storage alone is over the budget.
+            return;
+        }
+        const qint64 keep = qMax<qint64>(1, size() * (room * 3 / 4) / indexBytes);
+        while (size() > keep) {
+            evictOldest();
+        }
+        m_search.compact();
+    }
+}
+
+bool EventRing::canGrow(int capacity, qint64 arenaBytes) const {
+    const qint64 indexBytes = isEmpty() ? 0 : m_search.memoryBytes() * capacity / size();
+    return storageBytes(capacity, arenaBytes) + m_strings.memoryBytes() + indexBytes <= m_budget;
+}
+
+qint64 EventRing::storageBytes(int capacity, qint64 arenaBytes) {
+    return capacity * kSlotBytes + arenaBytes + blockCount(capacity) * 2 * qint64(sizeof(qint64));
+}
+
+quint64 EventRing::arenaPlacement(quint64 length) const {
+    // Skip the unusable tail end rather than splitting the message.
+    const quint64 arenaSize = static_cast<quint64>(m_arena.size());
+    const quint64 physical = m_arenaHead % arenaSize;
+    return physical + length > arenaSize ? m_arenaHead + arenaSize - physical : m_arenaHead;
+}
+
+void EventRing::reallocate(int capacity, qint64 arenaBytes) {
+    const quint64 oldCapacity = static_cast<quint64>(this->capacity());
+    const quint64 newCapacity = static_cast<quint64>(capacity);
+    auto moveColumn = [&](auto &column) {
+        std::remove_reference_t<decltype(column)> moved(capacity);
+        for (quint64 position = m_firstPosition; position < m_nextPosition; ++position) {
+            moved[static_cast<int>(position % newCapacity)] = column.at(static_cast<int>(position % oldCapacity));
+        }
+        column = std::move(moved);
+    };
+    moveColumn(m_sequence);
+    moveColumn(m_timestampUs);
+    moveColumn(m_monotonicUs);
+    moveColumn(m_level);
+    moveColumn(m_subsystem);
+    moveColumn(m_source);
+    moveColumn(m_device);
+    moveColumn(m_flags);
+    moveColumn(m_messageOffset);
+    moveColumn(m_messageLength);
+    moveColumn(m_repeatCount);
+    moveColumn(m_lastTimestampUs);
+
+    // Messages are packed from the start of the new arena.
+    const quint64 oldArenaSize = static_cast<quint64>(m_arena.size());
+    const quint64 arenaSize = static_cast<quint64>(arenaBytes);
+    QByteArray arena(static_cast<qsizetype>(arenaBytes), Qt::Uninitialized);
+    quint64 head = 0;
+    for (quint64 position = m_firstPosition; position < m_nextPosition; ++position) {
+        const int index = slot(position);
+        const quint64 length = m_messageLength.at(index);
+        if (head % arenaSize + length > arenaSize) {
+            head += arenaSize - head % arenaSize;
+        }
+        if (length > 0) {
+            std::memcpy(arena.data() + head % arenaSize,
+                        m_arena.constData() + m_messageOffset.at(index) % oldArenaSize, length);
+        }
+        m_messageOffset[index] = head;
+        head += length;
+    }
+    m_arena = std::move(arena);
+    m_arenaTail = isEmpty() ? head : m_messageOffset.at(slot(m_firstPosition));
+    m_arenaHead = head;
+
+    QVector<qint64> maxima(blockCount(capacity));
+    QVector<qint64> minima(maxima.size());
+    if (!isEmpty()) {
+        for (quint64 b = m_firstPosition / kBlockSize; b <= (m_nextPosition - 1) / kBlockSize; ++b) {
+            const int index = static_cast<int>(b % static_cast<quint64>(maxima.size()));
+            maxima[index] = m_blockMaxTimestampUs.at(block(b));
+            minima[index] = m_blockMinTimestampUs.at(block(b));
+        }
+    }
+    m_blockMaxTimestampUs = std::move(maxima);
+    m_blockMinTimestampUs = std::move(minima);
+}
+
+quint64 EventRing::positionOf(quint64 sequence) const {
+    if (isEmpty() || sequence <= firstSequence()) {
+        return m_firstPosition;
+    }
+    if (sequence > lastSequence()) {
+        return m_nextPosition;
+    }
+    // Without level quotas the ring holds every sequence in its range, so
+    // the position follows from the distance to the oldest one.
+    const quint64 first = firstSequence();
+    if (lastSequence() - first == static_cast<quint64>(size() - 1)) {
+        return m_firstPosition + (sequence - first);
+    }
+    quint64 low = m_firstPosition;
+    quint64 high = m_nextPosition;
+    while (low < high) {
+        const quint64 middle = low + (high - low) / 2;
+        if (m_sequence.at(slot(middle)) < sequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+UsbEvent EventRing::at(quint64 position) const {
+    const int index = slot(position);
+    const quint64 arenaSize = static_cast<quint64>(m_arena.size());
+    UsbEvent event;
+    event.timestampUs = m_timestampUs.at(index);
+    event.monotonicUs = m_monotonicUs.at(index);
+    event.level = m_strings.at(m_level.at(index));
+    event.subsystem = m_strings.at(m_subsystem.at(index));
+    event.source = m_strings.at(m_source.at(index));
+    event.deviceId = m_strings.at(m_device.at(index));
+    event.isUsb = m_flags.at(index) & UsbFlag;
+    event.isError = m_flags.at(index) & ErrorFlag;
+    event.message = QString::fromUtf8(m_arena.constData() + m_messageOffset.at(index) % arenaSize,
+                                      static_cast<qsizetype>(m_messageLength.at(index)));
+    event.sequence = m_sequence.at(index);
+    event.repeatCount = m_repeatCount.at(index);
+    event.lastTimestampUs = m_lastTimestampUs.at(index);
+    return event;
+}
+
+QVector<UsbEvent> EventRing::newest(int limit) const {
+    QVector<UsbEvent> events;
+    const quint64 count = qMin<quint64>(static_cast<quint64>(qMax(0, limit)), static_cast<quint64>(size()));
+    events.reserve(static_cast<int>(count));
+    for (quint64 position = m_nextPosition - count; position < m_nextPosition; ++position) {
+        events.append(at(position));
+    }
+    return events;
+}
+
+QVector<UsbEvent> EventRing::eventsSince(quint64 sequence, int limit) const {
+    QVector<UsbEvent> events;
+    for (quint64 position = positionOf(sequence); position < m_nextPosition && events.size() < limit; ++position) {
+        events.append(at(position));
+    }
+    return events;
+}
+
+QVector<UsbEvent> EventRing::eventsInRange(qint64 startUs, qint64 endUs, int limit) const {
+    QVector<UsbEvent> events;
+    if (isEmpty() || limit <= 0 || endUs < startUs) {
+        return events;
+    }
+
+    // Block maxima are running maxima and so sorted: the first block whose
+    // maximum reaches startUs is where matching events can begin.
+    quint64 low = m_firstPosition / kBlockSize;
+    quint64 high = (m_nextPosition - 1) / kBlockSize + 1;
+    while (low < high) {
+        const quint64 middle = low + (high - low) / 2;
+        if (m_blockMaxTimestampUs.at(block(middle)) < startUs) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (quint64 position = qMax(m_firstPosition, low * kBlockSize);
+         position < m_nextPosition && events.size() < limit; ++position) {
+        if (position % kBlockSize == 0 && m_blockMinTimestampUs.at(block(position / kBlockSize)) > endUs) {
+            break;
+        }
+        const qint64 timestamp = m_timestampUs.at(slot(position));
+        if (timestamp >= startUs && timestamp <= endUs) {
+            events.append(at(position));
+        }
+    }
+    return events;
+}
+
+QVector<UsbEvent> EventRing::search(const QString &query, int limit) const {
+    QVector<UsbEvent> matches;
+    if (isEmpty() || limit <= 0 || query.isEmpty()) {
+        return matches;
+    }
+    const QByteArray folded = SearchIndex::fold(query.toUtf8());
+    const quint64 blockSize = SearchIndex::kBlockSize;
+    QVector<quint64> blocks;
+    if (!m_search.candidateBlocks(folded, blocks)) {
+        for (quint64 b = m_firstPosition / blockSize; b <= (m_nextPosition - 1) / blockSize; ++b) {
+            blocks.append(b);
+        }
+    }
+
+    // Walk candidates newest first so the limit keeps the most recent matches.
+    for (auto it = blocks.crbegin(); it != blocks.crend() && matches.size() < limit; ++it) {
+        const quint64 begin = qMax(m_firstPosition, *it * blockSize);
+        const quint64 end = qMin(m_nextPosition, (*it + 1) * blockSize);
+        for (quint64 position = end; position > begin && matches.size() < limit; --position) {
+            if (messageContains(position - 1, folded)) {
+                matches.append(at(position - 1));
+            }
+        }
+    }
+    std::reverse(matches.begin(), matches.end());
+    return matches;
+}
+
+bool EventRing::messageContains(quint64 position, QByteArrayView foldedQuery) const {
+    const int index = slot(position);
+    const char *message = m_arena.constData() + m_messageOffset.at(index) % static_cast<quint64>(m_arena.size());
+    const qsizetype length = static_cast<qsizetype>(m_messageLength.at(index));
+    for (qsizetype start = 0; start + foldedQuery.size() <= length; ++start) {
+        qsizetype i = 0;
+        while (i < foldedQuery.size()) {
+            char ch = message[start + i];
+            if (ch >= 'A' && ch <= 'Z') {
+                ch = static_cast<char>(ch + ('a' - 'A'));
+            }
+            if (ch != foldedQuery.at(i)) {
+                break;
+            }
+            ++i;
+        }
+        if (i == foldedQuery.size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+qint64 EventRing::usedBytes() const {
+    return allocatedBytes() + m_search.memoryBytes();
+}
+
+qint64 EventRing::allocatedBytes() const {
+    return storageBytes(capacity(), m_arena.size()) + m_strings.memoryBytes();
+}
+
+qint64 EventRing::eventBytes() const {
+    return size() * kSlotBytes + static_cast<qint64>(m_arenaHead - m_arenaTail);
+}
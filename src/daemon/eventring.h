@@ -0,0 +1,161 @@
+#pragma once
+
+#include <QByteArray>
+#include <QVector>
+
+#include "searchindex.h"
+#include "stringpool.h"
+#include "usbtypes.h"
+
+// Ring buffer of the most recent events, bounded by the bytes the events
+// occupy rather than by their number. Events keep the sequence numbers they
+// were given by the EventStore, which only need to increase; within the ring
+// each event also has a position that increases by one per event, so the
+// slot of a position is computed directly. While the ring holds consecutive
+// sequences, as it does without level quotas, a sequence is located by its
+// distance to the oldest one; otherwise by binary search.
+//
+// Events are stored column by column rather than as UsbEvent objects:
+// timestamps as plain integers, level / subsystem / source / device as
+// interned ids, the flags as bits, and the message as UTF-8 in a circular
+// byte arena. UsbEvent values are only built when events leave the daemon.
+//
+// The budget bounds all heap the ring holds: the allocated columns, arena
+// and time index, the string pool and the search index. Columns and arena
+// grow by doubling, or by smaller steps near the budget, only while that
+// total stays within it; once they cannot, the oldest events make room for
+// new ones. They are not preallocated to the budget, since how many events
+// fit depends on their message lengths; once storage has reached the
+// budget, appends evict instead of reallocating. Evicting frees index
+// postings only when the index is compacted, so when the index pushes the
+// total over the budget a quarter of its room is freed at once rather than
+// compacting after every event. Storage is shrunk when the budget is
+// lowered.
+//
+// A sparse time index keeps, per block of 64 positions, the running maximum
+// timestamp up to that block and the block's minimum, so time ranges are
+// located by binary search without touching individual events. A trigram
+// SearchIndex over the messages is maintained alongside.
+class EventRing {
+public:
+    // Column bytes charged per event.
+    static constexpr qint64 kSlotBytes = 5 * sizeof(qint64) + 6 * sizeof(quint32) + sizeof(quint8);
+    // Longer messages are truncated; kernel records are far shorter.
+    static constexpr qsizetype kMaxMessageBytes = 4096;
+
+    // message cut to at most kMaxMessageBytes of UTF-8 at a code point
+    // boundary; the text append() stores for it.
+    static QString truncatedMessage(const QString &message);
+
+    explicit EventRing(qint64 budgetBytes);
+
+    qint64 budget() const { return m_budget; }
+    // Evicts down to the new budget and releases storage no longer needed.
+    void setBudget(qint64 bytes);
+
+    // Stores the event under event.sequence, which must be greater than the
+    // sequence of every event stored before.
+    void append(const UsbEvent &event);
+    // Sets the repeat count and last timestamp of a retained event; false
+    // if it is no longer retained.
+    bool updateRepeat(quint64 sequence, quint32 repeatCount, qint64 lastTimestampUs);
+
+    int size() const { return static_cast<int>(m_nextPosition - m_firstPosition); }
+    bool isEmpty() const { return m_nextPosition == m_firstPosition; }
+
+    // Sequence of the oldest and newest retained event; 0 when empty.
+    quint64 firstSequence() const { return isEmpty() ? 0 : m_sequence.at(slot(m_firstPosition)); }
+    quint64 lastSequence() const { return isEmpty() ? 0 : m_sequence.at(slot(m_nextPosition - 1)); }
+    // Sequence and timestamp of the newest evicted event; 0 if none was.
+    quint64 evictedSequence() const { return m_evictedSequence; }
+    qint64 evictedTimestampUs() const { return m_evictedTimestampUs; }
+
+    // The newest limit events, oldest first.
+    QVector<UsbEvent> newest(int limit) const;
+    // Up to limit events with sequence >= sequence, oldest first.
+    QVector<UsbEvent> eventsSince(quint64 sequence, int limit) const;
+    // Up to limit events with startUs <= timestamp <= endUs, oldest first.
+    // Events logged after the clock stepped backwards past startUs may be
+    // missed.
+    QVector<UsbEvent> eventsInRange(qint64 startUs, qint64 endUs, int limit) const;
+    // The newest limit events whose message contains query (ASCII
+    // case-insensitively), oldest first.
+    QVector<UsbEvent> search(const QString &query, int limit) const;
+
+    // Heap bytes charged against the budget: allocatedBytes() plus the
+    // search index. Kept at or below the budget unless the smallest storage
+    // alone exceeds it.
+    qint64 usedBytes() const;
+    // Heap bytes held by the columns, the arena, the string pool and the
+    // time index.
+    qint64 allocatedBytes() const;
+    // Bytes the retained events occupy within that storage: their column
+    // bytes plus their message bytes.
+    qint64 eventBytes() const;
+    qint64 searchIndexBytes() const { return m_search.memoryBytes(); }
+
+private:
+    enum Flag : quint8 {
+        UsbFlag = 1 << 0,
+        ErrorFlag = 1 << 1,
+    };
+
+    int capacity() const { return m_timestampUs.size(); }
+    int slot(quint64 position) const {
+        return static_cast<int>(position % static_cast<quint64>(m_timestampUs.size()));
+    }
+    int block(quint64 blockNumber) const {
+        return static_cast<int>(blockNumber % static_cast<quint64>(m_blockMaxTimestampUs.size()));
+    }
+    // First position whose sequence is >= sequence.
+    quint64 positionOf(quint64 sequence) const;
+    UsbEvent at(quint64 position) const;
+    void evictOldest();
+    // Evicts until usedBytes() fits the budget again, see above.
+    void evictToBudget();
+    // Whether storage of capacity slots and arenaBytes would fit the budget
+    // together with the index the events it holds are expected to need.
+    bool canGrow(int capacity, qint64 arenaBytes) const;
+    // Heap bytes of columns, time index and arena of the given sizes.
+    static qint64 storageBytes(int capacity, qint64 arenaBytes);
+    // Arena offset at which a message of length bytes would be stored.
+    quint64 arenaPlacement(quint64 length) const;
+    // Moves the retained events into columns of capacity slots and an arena
+    // of arenaBytes, which must be large enough to hold them.
+    void reallocate(int capacity, qint64 arenaBytes);
+    bool messageContains(quint64 position, QByteArrayView foldedQuery) const;
+
+    qint64 m_budget;
+
+    QVector<quint64> m_sequence;
+    QVector<qint64> m_timestampUs;
+    QVector<qint64> m_monotonicUs;
+    QVector<quint32> m_level;
+    QVector<quint32> m_subsystem;
+    QVector<quint32> m_source;
+    QVector<quint32> m_device;
+    QVector<quint8> m_flags;
+    // Logical offset of the message in the arena; physical position is the
+    // offset modulo the arena size. Messages never wrap around the end.
+    QVector<quint64> m_messageOffset;
+    QVector<quint32> m_messageLength;
+    QVector<quint32> m_repeatCount;
+    QVector<qint64> m_lastTimestampUs;
+
+    QByteArray m_arena;
+    // Logical start of the oldest retained message and end of the newest.
+    quint64 m_arenaTail = 0;
+    quint64 m_arenaHead = 0;
+    StringPool m_strings;
+    SearchIndex m_search;
+
+    // Time index, one entry per block of positions (position / block size).
+    QVector<qint64> m_blockMaxTimestampUs;
+    QVector<qint64> m_blockMinTimestampUs;
+    qint64 m_maxTimestampUs = 0;
+
+    quint64 m_firstPosition = 0;
+    quint64 m_nextPosition = 0;
+    quint64 m_evictedSequence = 0;
+    qint64 m_evictedTimestampUs = 0;
+};
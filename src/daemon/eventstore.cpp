@@ -0,0 +1,218 @@
+#include "eventstore.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace {
+// Share of the budget always left to the shared ring.
+const qint64 kSharedMinimumDivisor = 4;
+
+// Concatenated per-ring results in sequence order.
+QVector<UsbEvent> mergeBySequence(QVector<UsbEvent> events) {
+    std::sort(events.begin(), events.end(),
+              [](const UsbEvent &a, const UsbEvent &b) { return a.sequence < b.sequence; });
+    return events;
+}
+
+// The last limit events of a sequence-ordered list.
+QVector<UsbEvent> keepNewest(QVector<UsbEvent> events, int limit) {
+    if (events.size() > limit) {
+        events.remove(0, events.size() - qMax(0, limit));
+    }
+    return events;
+}
+
+// The first limit events of a sequence-ordered list.
+QVector<UsbEvent> keepOldest(QVector<UsbEvent> events, int limit) {
+    events.resize(qBound(0, limit, static_cast<int>(events.size())));
+    return events;
+}
+}
+
+EventStore::EventStore(qint64 budgetBytes)
+    : m_budget(qMax<qint64>(0, budgetBytes)) {
+    buildRings();
+}
+
+void EventStore::setBudget(qint64 budgetBytes, const QHash<QString, qint64> &levelQuotas) {
+    QHash<QString, qint64> quotas;
+    for (auto it = levelQuotas.cbegin(); it != levelQuotas.cend(); ++it) {
+        if (!it.key().isEmpty() && it.value() > 0) {
+            quotas.insert(it.key(), it.value());
+        }
+    }
+    bool sameLevels = quotas.size() == m_quotas.size();
+    for (auto it = quotas.cbegin(); sameLevels && it != quotas.cend(); ++it) {
+        sameLevels = m_quotas.contains(it.key());
+    }
+    m_budget = qMax<qint64>(0, budgetBytes);
+    m_quotas = quotas;
+
+    if (sameLevels) {
+        buildRings();
+        return;
+    }
+
+    // Events move between rings: rebuild them from the retained events, which
+    // keeps as many of them as the new layout allows.
+    const QVector<UsbEvent> events = eventsSince(0, std::numeric_limits<int>::max());
+    m_firstSequence = firstSequence();
+    m_firstTimestampUs = firstTimestampUs();
+    m_rings.clear();
+    buildRings();
+    for (const UsbEvent &event : events) {
+        ringFor(event.level).append(event);
+    }
+}
+
+void EventStore::buildRings() {
+    qint64 quotaTotal = 0;
+    for (qint64 quota : std::as_const(m_quotas)) {
+        quotaTotal += quota;
+    }
+    const qint64 quotaLimit = m_budget - m_budget / kSharedMinimumDivisor;
+    const double scale = quotaTotal > quotaLimit ? double(quotaLimit) / double(quotaTotal) : 1.0;
+
+    // Existing rings are resized in place; new ones are created as needed.
+    if (m_rings.empty()) {
+        m_rings.push_back(std::make_unique<EventRing>(0));
+        m_ringOfLevel.clear();
+        for (auto it = m_quotas.cbegin(); it != m_quotas.cend(); ++it) {
+            m_ringOfLevel.insert(it.key(), static_cast<int>(m_rings.size()));
+            m_rings.push_back(std::make_unique<EventRing>(0));
+        }
+    }
+    qint64 assigned = 0;
+    for (auto it = m_quotas.cbegin(); it != m_quotas.cend(); ++it) {
+        const qint64 quota = static_cast<qint64>(it.value() * scale);
+        m_rings.at(static_cast<size_t>(m_ringOfLevel.value(it.key())))->setBudget(quota);
+        assigned += quota;
+    }
+    m_rings.front()->setBudget(m_budget - assigned);
+}
+
+EventRing &EventStore::ringFor(const QString &level) {
+    return *m_rings.at(static_cast<size_t>(m_ringOfLevel.value(level, 0)));
+}
+
+quint64 EventStore::append(const UsbEvent &event, quint64 sequence) {
+    skipTo(sequence);
+    UsbEvent stored = event;
+    stored.sequence = m_nextSequence++;
+    if (m_firstSequence == 0) {
+        m_firstSequence = stored.sequence;
+        m_firstTimestampUs = stored.timestampUs;
+    }
+    ringFor(stored.level).append(stored);
+    return stored.sequence;
+}
+
+bool EventStore::updateRepeat(const UsbEvent &event) {
+    return ringFor(event.level).updateRepeat(event.sequence, event.repeatCount, event.lastTimestampUs);
+}
+
+void EventStore::skipTo(quint64 sequence) {
+    m_nextSequence = qMax(m_nextSequence, sequence);
+}
+
+int EventStore::size() const {
+    int size = 0;
+    for (const auto &ring : m_rings) {
+        size += ring->size();
+    }
+    return size;
+}
+
+quint64 EventStore::firstSequence() const {
+    if (isEmpty()) {
+        return lastSequence() + 1;
+    }
+    quint64 first = m_firstSequence;
+    for (const auto &ring : m_rings) {
+        first = qMax(first, ring->evictedSequence() + 1);
+    }
+    return first;
+}
+
+qint64 EventStore::firstTimestampUs() const {
+    if (isEmpty()) {
+        return 0;
+    }
+    qint64 first = m_firstTimestampUs;
+    for (const auto &ring : m_rings) {
+        if (ring->evictedSequence() > 0) {
+            first = qMax(first, ring->evictedTimestampUs() + 1);
+        }
+    }
+    return first;
+}
+
+int EventStore::maxEvents() const {
+    return static_cast<int>(qMin<qint64>(std::numeric_limits<int>::max(), m_budget / EventRing::kSlotBytes));
+}
+
+QVector<UsbEvent> EventStore::newest(int limit) const {
+    QVector<UsbEvent> events;
+    for (const auto &ring : m_rings) {
+        events += ring->newest(limit);
+    }
+    return keepNewest(mergeBySequence(std::move(events)), limit);
+}
+
+QVector<UsbEvent> EventStore::eventsSince(quint64 sequence, int limit) const {
+    QVector<UsbEvent> events;
+    for (const auto &ring : m_rings) {
+        events += ring->eventsSince(sequence, limit);
+    }
+    return keepOldest(mergeBySequence(std::move(events)), limit);
+}
+
+QVector<UsbEvent> EventStore::eventsInRange(qint64 startUs, qint64 endUs, int limit) const {
+    QVector<UsbEvent> events;
+    for (const auto &ring : m_rings) {
+        events += ring->eventsInRange(startUs, endUs, limit);
+    }
+    return keepOldest(mergeBySequence(std::move(events)), limit);
+}
+
+QVector<UsbEvent> EventStore::search(const QString &query, int limit) const {
+    QVector<UsbEvent> matches;
+    for (const auto &ring : m_rings) {
+        matches += ring->search(query, limit);
+    }
+    return keepNewest(mergeBySequence(std::move(matches)), limit);
+}
+
+QHash<QString, qint64> EventStore::usedBytesByLevel() const {
+    QHash<QString, qint64> used;
+    used.insert(QString(), m_rings.front()->usedBytes());
+    for (auto it = m_ringOfLevel.cbegin(); it != m_ringOfLevel.cend(); ++it) {
+        used.insert(it.key(), m_rings.at(static_cast<size_t>(it.value()))->usedBytes());
+    }
+    return used;
+}
+
+qint64 EventStore::usedBytes() const {
+    qint64 used = 0;
+    for (const auto &ring : m_rings) {
+        used += ring->usedBytes();
+    }
+    return used;
+}
+
+qint64 EventStore::eventBytes() const {
+    qint64 bytes = 0;
+    for (const auto &ring : m_rings) {
+        bytes += ring->eventBytes();
+    }
+    return bytes;
+}
+
+qint64 EventStore::searchIndexBytes() const {
+    qint64 bytes = 0;
+    for (const auto &ring : m_rings) {
+        bytes += ring->searchIndexBytes();
+    }
+    return bytes;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+#include <vector>
+
+#include "eventring.h"
+#include "usbtypes.h"
+
+// In-memory history of the most recent events, bounded by a byte budget.
+// Every appended event gets the next 64-bit sequence number (starting at 1).
+//
+// Levels can be given quotas carved out of the budget. Events of such a
+// level live in an EventRing of their own and are only evicted by newer
+// events of the same level, so errors can outlive info chatter; all other
+// events share one ring holding the rest of the budget. Queries merge the
+// rings by sequence.
+class EventStore {
+public:
+    explicit EventStore(qint64 budgetBytes);
+
+    qint64 budget() const { return m_budget; }
+    const QHash<QString, qint64> &levelQuotas() const { return m_quotas; }
+    // Applies a new budget and quotas, evicting the oldest events as needed.
+    // Quotas that do not leave the shared ring at least a small share of the
+    // budget are scaled down.
+    void setBudget(qint64 budgetBytes, const QHash<QString, qint64> &levelQuotas = {});
+
+    // Stores the event and returns the sequence number assigned to it. When
+    // restoring persisted events their own sequence is passed, see skipTo().
+    quint64 append(const UsbEvent &event, quint64 sequence = 0);
+    // Applies the repeat count and last timestamp of a coalesced event to
+    // its stored copy; false if that was evicted.
+    bool updateRepeat(const UsbEvent &event);
+    // Continues numbering at sequence; lower values are ignored.
+    void skipTo(quint64 sequence);
+
+    int size() const;
+    bool isEmpty() const { return size() == 0; }
+    // Most recently assigned sequence; 0 before the first append.
+    quint64 lastSequence() const { return m_nextSequence - 1; }
+    // Oldest sequence from which on every event is retained, i.e. one past
+    // the newest evicted event; lastSequence() + 1 when empty.
+    quint64 firstSequence() const;
+    // Oldest timestamp from which on every event is retained; 0 when empty.
+    qint64 firstTimestampUs() const;
+    // Upper bound on the events the budget can hold.
+    int maxEvents() const;
+
+    // The newest limit events, oldest first.
+    QVector<UsbEvent> newest(int limit) const;
+    // Up to limit events with sequence >= sequence, oldest first.
+    QVector<UsbEvent> eventsSince(quint64 sequence, int limit) const;
+    // Up to limit events with startUs <= timestamp <= endUs, in sequence order.
+    QVector<UsbEvent> eventsInRange(qint64 startUs, qint64 endUs, int limit) const;
+    // The newest limit events whose message contains query (ASCII
+    // case-insensitively), oldest first.
+    QVector<UsbEvent> search(const QString &query, int limit) const;
+
+    // Heap bytes charged against the budget, per quota level ("" for the
+    // shared ring) and in total: storage, string pools and search indexes.
+    QHash<QString, qint64> usedBytesByLevel() const;
+    qint64 usedBytes() const;
+    // Bytes the retained events themselves occupy within that storage.
+    qint64 eventBytes() const;
+    qint64 searchIndexBytes() const;
+
+private:
+    void buildRings();
+    EventRing &ringFor(const QString &level);
+
+    qint64 m_budget;
+    QHash<QString, qint64> m_quotas;
+    // Shared ring first, then one ring per quota level.
+    std::vector<std::unique_ptr<EventRing>> m_rings;
+    QHash<QString, int> m_ringOfLevel;
+    // First event ever stored, or the retained range before the rings were
+    // rebuilt; 0 until then.
+    quint64 m_firstSequence = 0;
+    qint64 m_firstTimestampUs = 0;
+    quint64 m_nextSequence = 1;
+};
@@ -0,0 +1,114 @@
+#include "floodguard.h"
+
+#include <QDateTime>
+
+namespace {
+const qint64 kWindowUs = 1000000;
+const int kSummaryIntervalMsecs = 1000;
+// Sources silent for this long are forgotten.
+const qint64 kIdleSourceMsecs = 60000;
+}
+
+FloodGuard::FloodGuard(QObject *parent)
+    : QObject(parent), m_summaryTimer(this) {
+    m_summaryTimer.setInterval(kSummaryIntervalMsecs);
+    connect(&m_summaryTimer, &QTimer::timeout, this, &FloodGuard::flushSummaries);
+    m_summaryTimer.start();
+}
+
+void FloodGuard::setRateLimit(int eventsPerSecond) {
+    m_rateLimit = qMax(0, eventsPerSecond);
+}
+
+void FloodGuard::processEvents(const QVector<UsbEvent> &events) {
+    if (m_rateLimit == 0) {
+        emit eventsAdmitted(events);
+        return;
+    }
+
+    const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    QVector<UsbEvent> admitted;
+    admitted.reserve(events.size());
+    for (const UsbEvent &event : events) {
+        const bool isDevice = !event.deviceId.isEmpty();
+        SourceWindow &window = m_windows[isDevice ? event.deviceId : event.source];
+        window.isDevice = isDevice;
+        window.lastSeenMsecs = nowMsecs;
+        if (admit(event, window)) {
+            admitted.append(event);
+        }
+    }
+
+    if (admitted.size() == events.size()) {
+        emit eventsAdmitted(events);
+    } else if (!admitted.isEmpty()) {
+        emit eventsAdmitted(admitted);
+    }
+}
+
+bool FloodGuard::admit(const UsbEvent &event, SourceWindow &window) {
+    // Windows follow the log's own timestamps so a replayed backlog is judged
+    // by the rate it was originally written at.
+    if (event.timestampUs - window.windowStartUs >= kWindowUs || event.timestampUs < window.windowStartUs) {
+        window.previousCount = event.timestampUs - window.windowStartUs < 2 * kWindowUs ? window.count : 0;
+        window.windowStartUs = event.timestampUs;
+        window.count = 0;
+        window.overBudget = 0;
+    }
+    ++window.count;
+    if (window.count <= m_rateLimit || event.isError) {
+        return true;
+    }
+
+    // Keep roughly one budget's worth of samples per window, based on the
+    // load of this window and the previous one.
+    const int load = qMax(window.count, window.previousCount);
+    const int stride = qMax(2, load / m_rateLimit);
+    if (window.overBudget++ % stride == 0) {
+        m_sampled.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (window.suppressed == 0) {
+        window.firstSuppressedUs = event.timestampUs;
+    }
+    window.lastSuppressedUs = event.timestampUs;
+    ++window.suppressed;
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void FloodGuard::flushSummaries() {
+    const qint64 nowMsecs = QDateTime::currentMSecsSinceEpoch();
+    QVector<UsbEvent> summaries;
+    for (auto it = m_windows.begin(); it != m_windows.end();) {
+        SourceWindow &window = it.value();
+        if (window.suppressed > 0) {
+            summaries.append(summaryEvent(it.key(), window));
+            window.suppressed = 0;
+        }
+        if (nowMsecs - window.lastSeenMsecs > kIdleSourceMsecs) {
+            it = m_windows.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!summaries.isEmpty()) {
+        emit eventsAdmitted(summaries);
+    }
+}
+
+UsbEvent FloodGuard::summaryEvent(const QString &key, const SourceWindow &window) {
+    UsbEvent event;
+    event.timestampUs = window.lastSuppressedUs;
+    event.level = QStringLiteral("warning");
+    event.subsystem = QStringLiteral("usbscope");
+    event.source = QStringLiteral("usbscoped");
+    event.isUsb = window.isDevice;
+    event.deviceId = window.isDevice ? key : QString();
+    event.message = QStringLiteral("Flood protection: suppressed %1 message(s) from %2 over %3 ms")
+                        .arg(window.suppressed)
+                        .arg(key.isEmpty() ? QStringLiteral("unknown source") : key)
+                        .arg((window.lastSuppressedUs - window.firstSuppressedUs) / 1000);
+    return event;
+}
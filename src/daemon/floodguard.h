@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QTimer>
+
+#include <atomic>
+
+#include "usbtypes.h"
+
+// Flood protection stage between attribution and the daemon. Every source of
+// messages (the attributed device, or the reporting host for unattributed
+// messages) gets a budget of events per second of log time. Within budget
+// everything passes; over budget errors still pass, other events are sampled
+// with a stride that grows with the overload, and the exact number of
+// suppressed events is reported as a synthetic summary event.
+class FloodGuard : public QObject {
+    Q_OBJECT
+public:
+    explicit FloodGuard(QObject *parent = nullptr);
+
+    // Events per second per source before sampling starts; 0 disables the guard.
+    void setRateLimit(int eventsPerSecond);
+
+    // Counters since startup; readable from any thread.
+    quint64 suppressedCount() const { return m_suppressed.load(std::memory_order_relaxed); }
+    quint64 sampledCount() const { return m_sampled.load(std::memory_order_relaxed); }
+
+public slots:
+    void processEvents(const QVector<UsbEvent> &events);
+    // Emits summaries for everything suppressed since the last summary.
+    void flushSummaries();
+
+signals:
+    void eventsAdmitted(const QVector<UsbEvent> &events);
+
+private:
+    struct SourceWindow {
+        qint64 windowStartUs = 0;
+        int count = 0;
+        int previousCount = 0;
+        int overBudget = 0;
+        // Suppressed since the last summary, and the span they cover.
+        quint64 suppressed = 0;
+        qint64 firstSuppressedUs = 0;
+        qint64 lastSuppressedUs = 0;
+        bool isDevice = false;
+        qint64 lastSeenMsecs = 0;
+    };
+
+    bool admit(const UsbEvent &event, SourceWindow &window);
+    static UsbEvent summaryEvent(const QString &key, const SourceWindow &window);
+
+    int m_rateLimit = 500;
+    QHash<QString, SourceWindow> m_windows;
+    QTimer m_summaryTimer;
+    std::atomic<quint64> m_suppressed{0};
+    std::atomic<quint64> m_sampled{0};
+};
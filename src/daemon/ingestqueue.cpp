@@ -0,0 +1,46 @@
+#include "ingestqueue.h"
+
+#include <QThread>
+
+#include <chrono>
+
+namespace {
+qint64 monotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
+IngestQueue::IngestQueue(int capacity, QObject *parent)
+    : QObject(parent), m_queue(capacity) {
+}
+
+void IngestQueue::push(const QVector<UsbEvent> &events) {
+    if (events.isEmpty()) {
+        return;
+    }
+    Batch batch{events, monotonicNs()};
+    if (!m_queue.tryPush(batch)) {
+        // Backpressure: the kernel keeps buffering (journal files, or the kmsg
+        // ring with overruns reported as lost messages) while we wait.
+        m_stalls.fetch_add(1, std::memory_order_relaxed);
+        while (!m_queue.tryPush(batch)) {
+            QThread::usleep(500);
+        }
+    }
+    if (!m_drainPosted.exchange(true, std::memory_order_acq_rel)) {
+        QMetaObject::invokeMethod(this, &IngestQueue::drain, Qt::QueuedConnection);
+    }
+}
+
+void IngestQueue::drain() {
+    // Clear the flag before popping: a batch pushed after the last pop then
+    // always posts a new drain.
+    m_drainPosted.store(false, std::memory_order_release);
+    Batch batch;
+    while (m_queue.tryPop(batch)) {
+        emit batchReady(batch.events);
+        m_lastLatencyUs = (monotonicNs() - batch.enqueuedNs) / 1000;
+        m_maxLatencyUs = qMax(m_maxLatencyUs, m_lastLatencyUs);
+    }
+}
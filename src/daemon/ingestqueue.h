@@ -0,0 +1,50 @@
+#pragma once
+
+#include <QObject>
+
+#include <atomic>
+
+#include "spscqueue.h"
+#include "usbtypes.h"
+
+// Hand-off between the ingestion thread (log sources, attribution, flood
+// protection) and the daemon's main thread, which owns the event store and
+// serves D-Bus. push() runs on the ingestion thread and never waits for the
+// main thread unless the queue is full; drain() runs on the main thread and
+// emits every queued batch in order. The time from push() until the batch
+// has been stored is tracked as the ingest latency.
+class IngestQueue : public QObject {
+    Q_OBJECT
+public:
+    explicit IngestQueue(int capacity = 256, QObject *parent = nullptr);
+
+    // Latency of the most recent batch and the maximum since startup.
+    qint64 lastLatencyUs() const { return m_lastLatencyUs; }
+    qint64 maxLatencyUs() const { return m_maxLatencyUs; }
+    // Times push() had to wait because the main thread fell behind.
+    quint64 stallCount() const { return m_stalls.load(std::memory_order_relaxed); }
+
+public slots:
+    // Called from the ingestion thread; blocks while the queue is full, so
+    // whoever stops the thread has to keep calling drain() until it exits.
+    void push(const QVector<UsbEvent> &events);
+    // Called on the main thread.
+    void drain();
+
+signals:
+    void batchReady(const QVector<UsbEvent> &events);
+
+private:
+    struct Batch {
+        QVector<UsbEvent> events;
+        qint64 enqueuedNs = 0;
+    };
+
+    SpscQueue<Batch> m_queue;
+    // Set while a drain() is posted but has not started, so the producer posts
+    // at most one wake-up per drain.
+    std::atomic<bool> m_drainPosted{false};
+    std::atomic<quint64> m_stalls{0};
+    qint64 m_lastLatencyUs = 0;
+    qint64 m_maxLatencyUs = 0;
+};
@@ -1,37 +1,597 @@
 #include "journaltail.h"
 
-#include <QRegularExpression>
+#include <QDebug>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+#include <atomic>
+#include <cstdlib>
+
+#include "eventclassifier.h"
+
+namespace {
+const int kSeedEntries = 200;
+// Upper bound on entries read per batch so a long catch-up after a restart
+// yields to the event loop between batches.
+const int kMaxBatchEntries = 4096;
+
+bool isSpace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+QByteArrayView trimmed(QByteArrayView text) {
+    qsizetype begin = 0;
+    qsizetype end = text.size();
+    while (begin < end && isSpace(text.at(begin))) {
+        ++begin;
+    }
+    while (end > begin && isSpace(text.at(end - 1))) {
+        --end;
+    }
+    return text.sliced(begin, end - begin);
+}
+
+// Lines that scanJsonObject() could not follow and were parsed into a
+// QJsonDocument instead.
+std::atomic<quint64> documentParses{0};
+
+enum class JsonKind { String, EscapedString, Array, Other };
+
+// Walks the flat object on one line of `journalctl -o json` and calls
+// field(name, value, kind) for each member, with views into line: strings
+// without their quotes and still escaped, arrays with their brackets, other
+// values as written. False if the line is anything else, e.g. an object
+// with nested objects.
+template <typename Field>
+bool scanJsonObject(QByteArrayView line, Field &&field) {
+    const qsizetype size = line.size();
+    qsizetype pos = 0;
+    auto skipSpace = [&]() {
+        while (pos < size && isSpace(line.at(pos))) {
+            ++pos;
+        }
+    };
+    // Moves pos past the closing quote of the string it is on.
+    auto skipString = [&](bool &escaped) {
+        escaped = false;
+        for (++pos; pos < size; ++pos) {
+            if (line.at(pos) == '\\') {
+                escaped = true;
+                ++pos;
+            } else if (line.at(pos) == '"') {
+                ++pos;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    skipSpace();
+    if (pos >= size || line.at(pos) != '{') {
+        return false;
+    }
+    ++pos;
+    skipSpace();
+    if (pos < size && line.at(pos) == '}') {
+        return pos + 1 == size;
+    }
+    while (pos < size) {
+        skipSpace();
+        bool escaped = false;
+        const qsizetype nameStart = pos + 1;
+        // Journal field names are plain upper-case ASCII.
+        if (pos >= size || line.at(pos) != '"' || !skipString(escaped) || escaped) {
+            return false;
+        }
+        const QByteArrayView name = line.sliced(nameStart, pos - 1 - nameStart);
+        skipSpace();
+        if (pos >= size || line.at(pos) != ':') {
+            return false;
+        }
+        ++pos;
+        skipSpace();
+        if (pos >= size) {
+            return false;
+        }
+
+        const qsizetype valueStart = pos;
+        QByteArrayView value;
+        JsonKind kind = JsonKind::Other;
+        const char first = line.at(pos);
+        if (first == '"') {
+            if (!skipString(escaped)) {
+                return false;
+            }
+            value = line.sliced(valueStart + 1, pos - valueStart - 2);
+            kind = escaped ? JsonKind::EscapedString : JsonKind::String;
+        } else if (first == '[') {
+            // Byte arrays hold numbers only.
+            for (++pos; pos < size && line.at(pos) != ']'; ++pos) {
+                const char ch = line.at(pos);
+                if (ch == '[' || ch == '{' || ch == '"') {
+                    return false;
+                }
+            }
+            if (pos >= size) {
+                return false;
+            }
+            ++pos;
+            value = line.sliced(valueStart, pos - valueStart);
+            kind = JsonKind::Array;
+        } else if (first == '{') {
+            return false;
+        } else {
+            while (pos < size && line.at(pos) != ',' && line.at(pos) != '}' && !isSpace(line.at(pos))) {
+                ++pos;
+            }
+            value = line.sliced(valueStart, pos - valueStart);
+        }
+        field(name, value, kind);
+
+        skipSpace();
+        if (pos >= size) {
+            return false;
+        }
+        if (line.at(pos) == '}') {
+            ++pos;
+            skipSpace();
+            return pos == size;
+        }
+        if (line.at(pos) != ',') {
+            return false;
+        }
+        ++pos;
+    }
+    return false;
+}
+
+int hexDigit(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// The four hex digits of a unicode escape at text[pos, pos + 4); -1 if malformed.
+int hexQuad(QByteArrayView text, qsizetype pos) {
+    if (pos + 4 > text.size()) {
+        return -1;
+    }
+    int value = 0;
+    for (qsizetype i = pos; i < pos + 4; ++i) {
+        const int digit = hexDigit(text.at(i));
+        if (digit < 0) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+void appendUtf8(QByteArray &out, char32_t codePoint) {
+    if (codePoint < 0x80) {
+        out.append(static_cast<char>(codePoint));
+    } else if (codePoint < 0x800) {
+        out.append(static_cast<char>(0xC0 | (codePoint >> 6)));
+        out.append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else if (codePoint < 0x10000) {
+        out.append(static_cast<char>(0xE0 | (codePoint >> 12)));
+        out.append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        out.append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else {
+        out.append(static_cast<char>(0xF0 | (codePoint >> 18)));
+        out.append(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+        out.append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        out.append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+// The bytes a scanned value stands for. Plain strings are returned as they
+// are; escaped strings and byte arrays are decoded into storage. Null
+// gives no bytes. False if the value cannot be decoded.
+bool jsonBytes(QByteArrayView value, JsonKind kind, QByteArray &storage, QByteArrayView &bytes) {
+    switch (kind) {
+    case JsonKind::String:
+        bytes = value;
+        return true;
+    case JsonKind::EscapedString:
+        storage.clear();
+        storage.reserve(value.size());
+        for (qsizetype i = 0; i < value.size(); ++i) {
+            const char ch = value.at(i);
+            if (ch != '\\') {
+                storage.append(ch);
+                continue;
+            }
+            if (++i >= value.size()) {
+                return false;
+            }
+            switch (value.at(i)) {
+            case '"': storage.append('"'); break;
+            case '\\': storage.append('\\'); break;
+            case '/': storage.append('/'); break;
+            case 'b': storage.append('\b'); break;
+            case 'f': storage.append('\f'); break;
+            case 'n': storage.append('\n'); break;
+            case 'r': storage.append('\r'); break;
+            case 't': storage.append('\t'); break;
+            case 'u': {
+                const int high = hexQuad(value, i + 1);
+                if (high < 0) {
+                    return false;
+                }
+                char32_t codePoint = static_cast<char32_t>(high);
+                i += 4;
+                // A surrogate pair is written as two escapes.
+                if (codePoint >= 0xD800 && codePoint < 0xDC00) {
+                    const int low = i + 2 < value.size() && value.at(i + 1) == '\\' && value.at(i + 2) == 'u'
+                        ? hexQuad(value, i + 3) : -1;
+                    if (low < 0xDC00 || low >= 0xE000) {
+                        return false;
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (static_cast<char32_t>(low) - 0xDC00);
+                    i += 6;
+                } else if (codePoint >= 0xDC00 && codePoint < 0xE000) {
+                    return false;
+                }
+                appendUtf8(storage, codePoint);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        bytes = storage;
+        return true;
+    case JsonKind::Array: {
+        // "[117,115,98]": the values of the bytes.
+        storage.clear();
+        int byte = -1;
+        for (qsizetype i = 1; i < value.size(); ++i) {
+            const char ch = value.at(i);
+            if (ch >= '0' && ch <= '9') {
+                byte = (byte < 0 ? 0 : byte * 10) + (ch - '0');
+                if (byte > 255) {
+                    return false;
+                }
+            } else if (ch == ',' || ch == ']') {
+                if (byte < 0) {
+                    if (ch == ']' && storage.isEmpty()) {
+                        break;
+                    }
+                    return false;
+                }
+                storage.append(static_cast<char>(byte));
+                byte = -1;
+            } else if (!isSpace(ch)) {
+                return false;
+            }
+        }
+        bytes = storage;
+        return true;
+    }
+    case JsonKind::Other:
+        // journalctl prints null for fields it leaves out.
+        bytes = {};
+        return value == QByteArrayView("null");
+    }
+    return false;
+}
+
+// Decimal microseconds as journalctl prints timestamps; 0 if malformed.
+qint64 decimal(QByteArrayView text) {
+    qint64 value = 0;
+    for (char ch : text) {
+        if (ch < '0' || ch > '9') {
+            return 0;
+        }
+        value = value * 10 + (ch - '0');
+    }
+    return value;
+}
+
+// journalctl -o json gives a field as a string, or as an array of byte
+// values when it is not valid UTF-8.
+QByteArray jsonField(const QJsonObject &entry, QLatin1String name) {
+    const QJsonValue value = entry.value(name);
+    if (value.isString()) {
+        return value.toString().toUtf8();
+    }
+    QByteArray bytes;
+    const QJsonArray array = value.toArray();
+    for (const QJsonValue &byte : array) {
+        bytes.append(static_cast<char>(byte.toInt()));
+    }
+    return bytes;
+}
+}
 
 JournalTail::JournalTail(QObject *parent)
-    : QObject(parent) {
+    : QObject(parent), m_process(this) {
     connect(&m_process, &QProcess::readyReadStandardOutput, this, &JournalTail::handleReadyRead);
 }
 
+JournalTail::~JournalTail() {
+    delete m_journalNotifier;
+    if (m_journal) {
+        sd_journal_close(m_journal);
+    }
+}
+
+void JournalTail::setJournalDirectory(const QString &path) {
+    m_journalDirectory = path;
+}
+
+void JournalTail::setUsbSubsystemOnly(bool enabled) {
+    m_usbSubsystemOnly = enabled;
+}
+
+void JournalTail::setResumeCursor(const QByteArray &cursor) {
+    m_resumeCursor = cursor;
+}
+
+void JournalTail::setMaxReplay(int entries) {
+    m_maxReplay = qMax(0, entries);
+}
+
 void JournalTail::start() {
-    // Seed with recent kernel logs before following new entries.
-    m_process.start("journalctl", {"-k", "-n", "200", "-f", "-o", "short"});
+    if (openJournal()) {
+        return;
+    }
+
+    qWarning() << "USBscope: sd_journal unavailable, falling back to journalctl";
+
+    // Continue after the checkpointed entry, or seed with recent kernel logs,
+    // before following new entries. JSON output carries each entry's cursor
+    // and timestamps; only the other fields an event needs are asked for.
+    QStringList args = {"-k", "-f", "-o", "json", "--output-fields=MESSAGE,_KERNEL_SUBSYSTEM,_HOSTNAME"};
+    if (!m_resumeCursor.isEmpty()) {
+        args << QStringLiteral("--after-cursor=%1").arg(QString::fromUtf8(m_resumeCursor));
+    } else {
+        args << "-n" << QString::number(kSeedEntries);
+    }
+    if (!m_journalDirectory.isEmpty()) {
+        args << "-D" << m_journalDirectory;
+    }
+    if (m_usbSubsystemOnly) {
+        args << "_KERNEL_SUBSYSTEM=usb";
+    }
+    m_process.start("journalctl", args);
 }
 
-void JournalTail::handleReadyRead() {
-    while (m_process.canReadLine()) {
-        QString line = QString::fromUtf8(m_process.readLine()).trimmed();
-        if (!line.isEmpty()) {
-            emit eventParsed(parseLine(line));
+bool JournalTail::openJournal() {
+    int r = m_journalDirectory.isEmpty()
+        ? sd_journal_open(&m_journal, SD_JOURNAL_LOCAL_ONLY)
+        : sd_journal_open_directory(&m_journal, m_journalDirectory.toLocal8Bit().constData(), 0);
+    if (r < 0) {
+        m_journal = nullptr;
+        return false;
+    }
+
+    // Filter inside the journal so non-kernel entries are never read.
+    sd_journal_add_match(m_journal, "_TRANSPORT=kernel", 0);
+    if (m_usbSubsystemOnly) {
+        sd_journal_add_match(m_journal, "_KERNEL_SUBSYSTEM=usb", 0);
+    }
+
+    int fd = sd_journal_get_fd(m_journal);
+    if (fd < 0) {
+        sd_journal_close(m_journal);
+        m_journal = nullptr;
+        return false;
+    }
+    m_journalNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+    connect(m_journalNotifier, &QSocketNotifier::activated, this, &JournalTail::handleJournalActivity);
+
+    QVector<UsbEvent> events;
+    if (seekStartPosition()) {
+        events.append(eventFromJournalEntry(*EventClassifier::current()));
+    }
+    readJournalEntries(events);
+    return true;
+}
+
+bool JournalTail::seekStartPosition() {
+    // Positions the journal so that sd_journal_next() returns the first entry
+    // to deliver. Returns true if the current entry must be delivered too.
+    const QByteArray cursor = m_resumeCursor;
+    if (!cursor.isEmpty() && sd_journal_seek_cursor(m_journal, cursor.constData()) >= 0) {
+        // Measure the backlog by skipping entries without reading their data:
+        // one step onto the checkpointed entry plus up to m_maxReplay after it.
+        const int skipped = sd_journal_next_skip(m_journal, static_cast<uint64_t>(m_maxReplay) + 2);
+        if (skipped >= 0 && skipped <= m_maxReplay + 1) {
+            sd_journal_seek_cursor(m_journal, cursor.constData());
+            // The checkpointed entry was already consumed. If it has been
+            // vacuumed, next() lands on a newer entry which must not be lost.
+            if (sd_journal_next(m_journal) > 0 && sd_journal_test_cursor(m_journal, cursor.constData()) <= 0) {
+                sd_journal_previous(m_journal);
+            }
+            return false;
         }
+        qWarning() << "USBscope: journal backlog since last checkpoint exceeds" << m_maxReplay
+                   << "entries; replaying only the newest ones";
+        sd_journal_seek_tail(m_journal);
+        sd_journal_previous_skip(m_journal, static_cast<uint64_t>(m_maxReplay) + 1);
+        return false;
     }
+
+    // No checkpoint: seed with recent kernel entries before following new
+    // ones. After previous_skip() the read position is on the oldest seed entry.
+    sd_journal_seek_tail(m_journal);
+    return sd_journal_previous_skip(m_journal, kSeedEntries) > 0;
 }
 
-UsbEvent JournalTail::parseLine(const QString &line) const {
-    UsbEvent event;
-    event.timestamp = line.section(' ', 0, 2).trimmed();
-    event.source = line.section(' ', 3, 3).trimmed();
-    event.message = line.section(' ', 4).trimmed();
-    event.subsystem = QStringLiteral("kernel");
+void JournalTail::handleJournalActivity() {
+    if (!m_journal) {
+        return;
+    }
+    if (sd_journal_process(m_journal) == SD_JOURNAL_NOP) {
+        return;
+    }
+    readJournalEntries();
+}
+
+void JournalTail::readJournalEntries(QVector<UsbEvent> events) {
+    m_catchUpScheduled = false;
+    const std::shared_ptr<const EventClassifier> classifier = EventClassifier::current();
+    while (events.size() < kMaxBatchEntries && sd_journal_next(m_journal) > 0) {
+        events.append(eventFromJournalEntry(*classifier));
+    }
+    const bool more = events.size() >= kMaxBatchEntries;
+    if (events.isEmpty()) {
+        return;
+    }
+
+    emit eventsParsed(events);
+    char *cursor = nullptr;
+    if (sd_journal_get_cursor(m_journal, &cursor) >= 0) {
+        emit cursorChanged(QByteArray(cursor));
+        free(cursor);
+    }
+
+    if (more && !m_catchUpScheduled) {
+        m_catchUpScheduled = true;
+        QTimer::singleShot(0, this, [this]() { readJournalEntries(); });
+    }
+}
 
-    const QString lowered = line.toLower();
-    event.isUsb = lowered.contains("usb") || lowered.contains("xhci") || lowered.contains("usbhid") || lowered.contains("hub");
-    event.isError = lowered.contains("error") || lowered.contains("fail") || lowered.contains("timeout");
-    event.level = event.isError ? QStringLiteral("error") : QStringLiteral("info");
+QByteArray JournalTail::journalField(const char *field) const {
+    const void *data = nullptr;
+    size_t length = 0;
+    if (sd_journal_get_data(m_journal, field, &data, &length) < 0) {
+        return {};
+    }
+    // Data is returned as "FIELD=value"; skip the name and separator.
+    const size_t prefix = qstrlen(field) + 1;
+    if (length <= prefix) {
+        return {};
+    }
+    return QByteArray(static_cast<const char *>(data) + prefix, static_cast<qsizetype>(length - prefix));
+}
 
+UsbEvent JournalTail::eventFromJournalEntry(const EventClassifier &classifier) const {
+    UsbEvent event;
+    uint64_t realtimeUs = 0;
+    if (sd_journal_get_realtime_usec(m_journal, &realtimeUs) >= 0) {
+        event.timestampUs = static_cast<qint64>(realtimeUs);
+    }
+    uint64_t monotonicUs = 0;
+    sd_id128_t bootId;
+    if (sd_journal_get_monotonic_usec(m_journal, &monotonicUs, &bootId) >= 0) {
+        event.monotonicUs = static_cast<qint64>(monotonicUs);
+    }
+    const QByteArray message = journalField("MESSAGE");
+    const QByteArray subsystem = journalField("_KERNEL_SUBSYSTEM");
+    event.source = QString::fromUtf8(journalField("_HOSTNAME"));
+    event.message = QString::fromUtf8(message);
+    event.subsystem = subsystem.isEmpty() ? QStringLiteral("kernel") : QString::fromUtf8(subsystem);
+    classifier.classify(message, subsystem, event);
     return event;
 }
+
+void JournalTail::handleReadyRead() {
+    // Drain everything journalctl has written so far and parse the complete
+    // lines, one JSON entry each; a trailing partial line waits for the next
+    // read.
+    m_lineBuffer.append(m_process.readAllStandardOutput());
+    const QByteArrayView buffer(m_lineBuffer);
+
+    const std::shared_ptr<const EventClassifier> classifier = EventClassifier::current();
+    QVector<UsbEvent> events;
+    QByteArray cursor;
+    qsizetype start = 0;
+    qsizetype newline = 0;
+    while ((newline = m_lineBuffer.indexOf('\n', start)) >= 0) {
+        const QByteArrayView line = trimmed(buffer.sliced(start, newline - start));
+        start = newline + 1;
+        UsbEvent event;
+        if (!line.isEmpty() && parseJsonEntry(line, *classifier, event, cursor)) {
+            events.append(event);
+        }
+    }
+    m_lineBuffer.remove(0, start);
+
+    if (!events.isEmpty()) {
+        emit eventsParsed(events);
+    }
+    if (!cursor.isEmpty()) {
+        emit cursorChanged(cursor);
+    }
+}
+
+quint64 JournalTail::jsonDocumentParses() {
+    return documentParses.load(std::memory_order_relaxed);
+}
+
+bool JournalTail::parseJsonEntry(QByteArrayView line, const EventClassifier &classifier, UsbEvent &event,
+                                 QByteArray &cursor) {
+    enum Field { Cursor, Realtime, Monotonic, Message, Subsystem, Hostname, FieldCount };
+    static const QByteArrayView kNames[FieldCount] = {"__CURSOR", "__REALTIME_TIMESTAMP", "__MONOTONIC_TIMESTAMP",
+                                                      "MESSAGE", "_KERNEL_SUBSYSTEM", "_HOSTNAME"};
+    QByteArrayView values[FieldCount];
+    JsonKind kinds[FieldCount] = {JsonKind::Other, JsonKind::Other, JsonKind::Other,
+                                  JsonKind::Other, JsonKind::Other, JsonKind::Other};
+    bool found[FieldCount] = {};
+    bool decoded = scanJsonObject(line, [&](QByteArrayView name, QByteArrayView value, JsonKind kind) {
+        for (int field = 0; field < FieldCount; ++field) {
+            if (name == kNames[field]) {
+                values[field] = value;
+                kinds[field] = kind;
+                found[field] = true;
+                return;
+            }
+        }
+    });
+    QByteArray storage[FieldCount];
+    QByteArrayView bytes[FieldCount];
+    for (int field = 0; decoded && field < FieldCount; ++field) {
+        decoded = !found[field] || jsonBytes(values[field], kinds[field], storage[field], bytes[field]);
+    }
+    if (!decoded) {
+        documentParses.fetch_add(1, std::memory_order_relaxed);
+        return parseJsonDocument(line, classifier, event, cursor);
+    }
+
+    if (!bytes[Cursor].isEmpty()) {
+        cursor = bytes[Cursor].toByteArray();
+    }
+    event.timestampUs = decimal(bytes[Realtime]);
+    event.monotonicUs = decimal(bytes[Monotonic]);
+    event.source = QString::fromUtf8(bytes[Hostname]);
+    event.message = QString::fromUtf8(bytes[Message]);
+    event.subsystem = bytes[Subsystem].isEmpty() ? QStringLiteral("kernel") : QString::fromUtf8(bytes[Subsystem]);
+    classifier.classify(bytes[Message], bytes[Subsystem], event);
+    return true;
+}
+
+bool JournalTail::parseJsonDocument(QByteArrayView line, const EventClassifier &classifier, UsbEvent &event,
+                                    QByteArray &cursor) {
+    const QJsonDocument document = QJsonDocument::fromJson(line.toByteArray());
+    if (!document.isObject()) {
+        return false;
+    }
+    const QJsonObject entry = document.object();
+    const QByteArray entryCursor = jsonField(entry, QLatin1String("__CURSOR"));
+    if (!entryCursor.isEmpty()) {
+        cursor = entryCursor;
+    }
+
+    // Timestamps are decimal strings of microseconds.
+    event.timestampUs = jsonField(entry, QLatin1String("__REALTIME_TIMESTAMP")).toLongLong();
+    event.monotonicUs = jsonField(entry, QLatin1String("__MONOTONIC_TIMESTAMP")).toLongLong();
+    const QByteArray message = jsonField(entry, QLatin1String("MESSAGE"));
+    const QByteArray subsystem = jsonField(entry, QLatin1String("_KERNEL_SUBSYSTEM"));
+    event.source = QString::fromUtf8(jsonField(entry, QLatin1String("_HOSTNAME")));
+    event.message = QString::fromUtf8(message);
+    event.subsystem = subsystem.isEmpty() ? QStringLiteral("kernel") : QString::fromUtf8(subsystem);
+    classifier.classify(message, subsystem, event);
+    return true;
+}
@@ -2,24 +2,74 @@
 
 #include <QObject>
 #include <QProcess>
+#include <QSocketNotifier>
+
+#include <systemd/sd-journal.h>
 
 #include "usbtypes.h"
 
+class EventClassifier;
+
+// Follows kernel messages from the systemd journal. Entries are read with the
+// native sd_journal API and mapped field by field into UsbEvent; if the
+// journal cannot be opened the tail falls back to a `journalctl -k -f -o
+// json` subprocess and maps the same fields from its output. Both report
+// the cursor of the last entry delivered and resume after a given one.
 class JournalTail : public QObject {
     Q_OBJECT
 public:
     explicit JournalTail(QObject *parent = nullptr);
+    ~JournalTail() override;
+
+    // Read journal files from a local directory instead of the system
+    // journal, e.g. a copy of /var/log/journal. Must be set before start().
+    void setJournalDirectory(const QString &path);
+    // Only follow entries the kernel tagged with _KERNEL_SUBSYSTEM=usb.
+    void setUsbSubsystemOnly(bool enabled);
+    // Resume right after the entry with this cursor instead of seeding with
+    // the most recent entries. At most maxReplay entries of backlog are
+    // replayed; older ones are skipped. The journalctl fallback replays the
+    // whole backlog.
+    void setResumeCursor(const QByteArray &cursor);
+    void setMaxReplay(int entries);
 
     void start();
 
+    // Maps one line of `journalctl -o json` into event; false if it is not
+    // an entry. Sets cursor to the entry's cursor. The fields are scanned in
+    // place; only a line the scanner cannot follow is parsed into a
+    // QJsonDocument, and jsonDocumentParses() counts those.
+    static bool parseJsonEntry(QByteArrayView line, const EventClassifier &classifier, UsbEvent &event,
+                               QByteArray &cursor);
+    static quint64 jsonDocumentParses();
+
 signals:
-    void eventParsed(const UsbEvent &event);
+    // Everything that was available when the source became readable,
+    // parsed as one batch.
+    void eventsParsed(const QVector<UsbEvent> &events);
+    // Cursor of the last entry in the batch just emitted.
+    void cursorChanged(const QByteArray &cursor);
 
 private slots:
     void handleReadyRead();
+    void handleJournalActivity();
 
 private:
-    UsbEvent parseLine(const QString &line) const;
+    bool openJournal();
+    bool seekStartPosition();
+    void readJournalEntries(QVector<UsbEvent> events = {});
+    UsbEvent eventFromJournalEntry(const EventClassifier &classifier) const;
+    QByteArray journalField(const char *field) const;
+    static bool parseJsonDocument(QByteArrayView line, const EventClassifier &classifier, UsbEvent &event,
+                                  QByteArray &cursor);
 
     QProcess m_process;
+    QByteArray m_lineBuffer;
+    sd_journal *m_journal = nullptr;
+    QSocketNotifier *m_journalNotifier = nullptr;
+    QString m_journalDirectory;
+    bool m_usbSubsystemOnly = false;
+    QByteArray m_resumeCursor;
+    int m_maxReplay = 10000;
+    bool m_catchUpScheduled = false;
 };
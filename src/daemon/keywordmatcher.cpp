@@ -0,0 +1,94 @@
+#include "keywordmatcher.h"
+
+#include <QQueue>
+
+namespace {
+quint8 foldCase(char ch) {
+    const auto c = static_cast<quint8>(ch);
+    return (c >= 'A' && c <= 'Z') ? static_cast<quint8>(c + ('a' - 'A')) : c;
+}
+}
+
+int KeywordMatcher::addPattern(const QByteArray &pattern) {
+    if (pattern.isEmpty()) {
+        return -1;
+    }
+    m_patterns.append(pattern);
+    m_transitions.clear();
+    m_outputOffsets.clear();
+    m_outputIds.clear();
+    return m_patterns.size() - 1;
+}
+
+void KeywordMatcher::build() {
+    // Every byte that occurs in a pattern gets its own input class; all other
+    // bytes share class 0, which always leads back to the root.
+    m_classOf.fill(0);
+    m_classCount = 1;
+    for (const QByteArray &pattern : m_patterns) {
+        for (char ch : pattern) {
+            const quint8 c = foldCase(ch);
+            if (m_classOf[c] == 0) {
+                m_classOf[c] = static_cast<quint16>(m_classCount++);
+            }
+        }
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+        m_classOf[c] = m_classOf[c + ('a' - 'A')];
+    }
+
+    // Build the trie of all patterns.
+    QVector<int> trie(m_classCount, -1);
+    QVector<QVector<int>> output(1);
+    int stateCount = 1;
+    for (int id = 0; id < m_patterns.size(); ++id) {
+        int state = 0;
+        for (char ch : m_patterns.at(id)) {
+            const int index = state * m_classCount + m_classOf[foldCase(ch)];
+            if (trie[index] < 0) {
+                trie[index] = stateCount++;
+                trie.resize(stateCount * m_classCount, -1);
+                output.append({});
+            }
+            state = trie[index];
+        }
+        output[state].append(id);
+    }
+
+    // Breadth-first pass computing failure links, folding them into a dense
+    // transition table so a scan never has to follow them at runtime.
+    m_transitions = trie;
+    QVector<int> failure(stateCount, 0);
+    QQueue<int> queue;
+    for (int cls = 0; cls < m_classCount; ++cls) {
+        const int next = trie[cls];
+        if (next < 0) {
+            m_transitions[cls] = 0;
+        } else {
+            queue.enqueue(next);
+        }
+    }
+    while (!queue.isEmpty()) {
+        const int state = queue.dequeue();
+        output[state] += output[failure[state]];
+        for (int cls = 0; cls < m_classCount; ++cls) {
+            const int index = state * m_classCount + cls;
+            const int fallback = m_transitions[failure[state] * m_classCount + cls];
+            const int next = trie[index];
+            if (next < 0) {
+                m_transitions[index] = fallback;
+            } else {
+                failure[next] = fallback;
+                queue.enqueue(next);
+            }
+        }
+    }
+
+    m_outputOffsets.resize(stateCount + 1);
+    m_outputIds.clear();
+    for (int state = 0; state < stateCount; ++state) {
+        m_outputOffsets[state] = m_outputIds.size();
+        m_outputIds += output.at(state);
+    }
+    m_outputOffsets[stateCount] = m_outputIds.size();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QVector>
+
+#include <array>
+
+// Aho-Corasick automaton over ASCII-case-folded bytes. All patterns are found
+// in a single pass over the input, so the cost of a scan does not depend on
+// how many patterns are registered.
+class KeywordMatcher {
+public:
+    // Registers a pattern and returns its id, or -1 for an empty pattern.
+    // Invalidates a previous build().
+    int addPattern(const QByteArray &pattern);
+    void build();
+
+    int patternCount() const { return m_patterns.size(); }
+
+    // Calls onMatch(patternId) for every occurrence of a pattern in text. A
+    // pattern occurring several times is reported several times.
+    template <typename Callback>
+    void forEachMatch(QByteArrayView text, Callback &&onMatch) const {
+        if (m_transitions.isEmpty()) {
+            return;
+        }
+        const int *transitions = m_transitions.constData();
+        const int *offsets = m_outputOffsets.constData();
+        int state = 0;
+        for (char ch : text) {
+            state = transitions[state * m_classCount + m_classOf[static_cast<quint8>(ch)]];
+            for (int i = offsets[state]; i < offsets[state + 1]; ++i) {
+                onMatch(m_outputIds.at(i));
+            }
+        }
+    }
+
+private:
+    QVector<QByteArray> m_patterns;
+    std::array<quint16, 256> m_classOf{};
+    int m_classCount = 1;
+    // Dense DFA: m_transitions[state * m_classCount + class].
+    QVector<int> m_transitions;
+    // Patterns ending in state s: m_outputIds[m_outputOffsets[s] .. m_outputOffsets[s + 1]).
+    QVector<int> m_outputOffsets;
+    QVector<int> m_outputIds;
+};
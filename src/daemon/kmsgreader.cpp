@@ -0,0 +1,230 @@
+#include "kmsgreader.h"
+
+#include <QDebug>
+#include <QSysInfo>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eventclassifier.h"
+
+namespace {
+// /dev/kmsg returns exactly one record per read(); records are capped well
+// below this by the kernel (CONSOLE_EXT_LOG_MAX).
+const int kReadBufferSize = 8192;
+
+qint64 clockMicros(clockid_t clock) {
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool isHexDigit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// The kernel escapes non-printable message bytes as \xNN.
+QByteArray unescape(const QByteArray &text) {
+    if (!text.contains("\\x")) {
+        return text;
+    }
+    QByteArray out;
+    out.reserve(text.size());
+    for (qsizetype i = 0; i < text.size(); ++i) {
+        if (text.at(i) == '\\' && i + 3 < text.size() && text.at(i + 1) == 'x'
+            && isHexDigit(text.at(i + 2)) && isHexDigit(text.at(i + 3))) {
+            out.append(QByteArray::fromHex(text.mid(i + 2, 2)));
+            i += 3;
+        } else {
+            out.append(text.at(i));
+        }
+    }
+    return out;
+}
+}
+
+KmsgReader::KmsgReader(const QString &path, QObject *parent)
+    : QObject(parent), m_path(path) {
+}
+
+KmsgReader::~KmsgReader() {
+    delete m_notifier;
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+void KmsgReader::setResumeSequence(quint64 sequence) {
+    m_resumeSequence = sequence;
+    m_resuming = true;
+    m_lastSequence = sequence;
+    m_haveSequence = true;
+}
+
+void KmsgReader::start() {
+    m_hostName = QSysInfo::machineHostName();
+    // Record timestamps are microseconds since boot; anchor them to the
+    // realtime clock once instead of converting per record.
+    m_bootTimeUs = clockMicros(CLOCK_REALTIME) - clockMicros(CLOCK_MONOTONIC);
+
+    m_fd = ::open(m_path.toLocal8Bit().constData(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (m_fd < 0) {
+        qWarning() << "USBscope: cannot open" << m_path << ":" << qt_error_string(errno);
+        return;
+    }
+
+    struct stat info {};
+    m_isDevice = ::fstat(m_fd, &info) == 0 && S_ISCHR(info.st_mode);
+
+    // Opening /dev/kmsg starts at the oldest record still in the kernel ring,
+    // so the first drain doubles as the seed.
+    handleReadable();
+
+    if (m_isDevice) {
+        m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &KmsgReader::handleReadable);
+    } else {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void KmsgReader::handleReadable() {
+    m_classifier = EventClassifier::current();
+    char buffer[kReadBufferSize];
+    for (;;) {
+        const ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            consume(QByteArray::fromRawData(buffer, static_cast<qsizetype>(n)));
+            if (m_isDevice) {
+                flushRecord();
+            }
+            continue;
+        }
+        if (n == 0) {
+            // End of a captured dump.
+            flushRecord();
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EPIPE) {
+            // Records were overwritten before we read them. The next read
+            // resumes at the oldest available record and the sequence gap
+            // accounts for what was lost.
+            continue;
+        }
+        break;
+    }
+
+    if (!m_batch.isEmpty()) {
+        emit eventsParsed(m_batch);
+        m_batch.clear();
+        emit sequenceChanged(m_lastSequence);
+    }
+}
+
+void KmsgReader::consume(const QByteArray &data) {
+    m_pending.append(data);
+
+    qsizetype start = 0;
+    qsizetype newline = 0;
+    while ((newline = m_pending.indexOf('\n', start)) >= 0) {
+        const QByteArray line = m_pending.mid(start, newline - start);
+        start = newline + 1;
+        if (line.startsWith(' ')) {
+            if (!m_recordHeader.isEmpty()) {
+                m_recordFields.append(line.mid(1));
+            }
+        } else {
+            flushRecord();
+            m_recordHeader = line;
+        }
+    }
+    m_pending.remove(0, start);
+}
+
+void KmsgReader::flushRecord() {
+    if (m_recordHeader.isEmpty()) {
+        return;
+    }
+    parseRecord(m_recordHeader, m_recordFields);
+    m_recordHeader.clear();
+    m_recordFields.clear();
+}
+
+void KmsgReader::parseRecord(const QByteArray &header, const QList<QByteArray> &fields) {
+    // Header layout: "<priority>,<sequence>,<timestamp us>,<flags>[,...];<message>"
+    const qsizetype semicolon = header.indexOf(';');
+    if (semicolon < 0) {
+        return;
+    }
+    const QList<QByteArray> prefix = header.left(semicolon).split(',');
+    if (prefix.size() < 3) {
+        return;
+    }
+    bool priorityOk = false;
+    bool sequenceOk = false;
+    bool timestampOk = false;
+    const int priority = prefix.at(0).toInt(&priorityOk);
+    const quint64 sequence = prefix.at(1).toULongLong(&sequenceOk);
+    const qint64 monotonicUs = prefix.at(2).toLongLong(&timestampOk);
+    if (!priorityOk || !sequenceOk || !timestampOk) {
+        return;
+    }
+
+    // Fast path while catching up after a restart: records already
+    // delivered before the checkpoint are dropped before any decoding.
+    if (m_resuming) {
+        if (sequence <= m_resumeSequence) {
+            return;
+        }
+        m_resuming = false;
+    }
+
+    if (m_haveSequence && sequence > m_lastSequence + 1) {
+        const quint64 lost = sequence - m_lastSequence - 1;
+        m_lostMessages += lost;
+        emit messagesLost(lost);
+    }
+    m_lastSequence = sequence;
+    m_haveSequence = true;
+
+    UsbEvent event;
+    event.timestampUs = m_bootTimeUs + monotonicUs;
+    event.monotonicUs = monotonicUs;
+    event.source = m_hostName;
+    const QByteArray message = unescape(header.mid(semicolon + 1));
+    event.message = QString::fromUtf8(message);
+    event.subsystem = QStringLiteral("kernel");
+    QByteArrayView subsystem;
+    for (const QByteArray &field : fields) {
+        if (field.startsWith("SUBSYSTEM=")) {
+            subsystem = QByteArrayView(field).sliced(10);
+            event.subsystem = QString::fromUtf8(subsystem);
+        } else if (field.startsWith("DEVICE=")) {
+            // "+usb:1-2.3" names the device by bus path; char devices use
+            // "c<major>:<minor>" and are kept verbatim.
+            QByteArray device = field.mid(7);
+            if (device.startsWith("+usb:")) {
+                device = device.mid(5);
+            }
+            event.deviceId = QString::fromUtf8(device);
+        }
+    }
+
+    m_classifier->classify(message, subsystem, event);
+    const int level = priority & 7;
+    if (level <= 3) {
+        event.isError = true;
+        event.level = QStringLiteral("error");
+    } else if (level == 4 && !event.isError) {
+        event.level = QStringLiteral("warning");
+    }
+
+    m_batch.append(event);
+}
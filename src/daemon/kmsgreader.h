@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QObject>
+#include <QSocketNotifier>
+
+#include <memory>
+
+#include "usbtypes.h"
+
+class EventClassifier;
+
+// Reads kernel log records directly from /dev/kmsg (or any file holding a
+// captured kmsg dump). Each record carries the kernel sequence number and a
+// monotonic timestamp, which are mapped into UsbEvent together with the
+// SUBSYSTEM= / DEVICE= continuation fields. Gaps in the sequence numbers are
+// reported through messagesLost().
+class KmsgReader : public QObject {
+    Q_OBJECT
+public:
+    explicit KmsgReader(const QString &path = QStringLiteral("/dev/kmsg"), QObject *parent = nullptr);
+    ~KmsgReader() override;
+
+    // Skip records up to and including this sequence number, which must come
+    // from the current boot. Records lost since then are reported through
+    // messagesLost() like any other gap.
+    void setResumeSequence(quint64 sequence);
+
+    void start();
+
+    quint64 lastSequence() const { return m_lastSequence; }
+    quint64 lostMessages() const { return m_lostMessages; }
+
+signals:
+    void eventsParsed(const QVector<UsbEvent> &events);
+    void messagesLost(quint64 count);
+    // Sequence number of the last record in the batch just emitted.
+    void sequenceChanged(quint64 sequence);
+
+private slots:
+    void handleReadable();
+
+private:
+    void consume(const QByteArray &data);
+    void flushRecord();
+    void parseRecord(const QByteArray &header, const QList<QByteArray> &fields);
+
+    QString m_path;
+    int m_fd = -1;
+    bool m_isDevice = false;
+    QSocketNotifier *m_notifier = nullptr;
+    QByteArray m_pending;
+    QByteArray m_recordHeader;
+    QList<QByteArray> m_recordFields;
+    QVector<UsbEvent> m_batch;
+    // Rules in effect for the drain in progress.
+    std::shared_ptr<const EventClassifier> m_classifier;
+    qint64 m_bootTimeUs = 0;
+    QString m_hostName;
+    quint64 m_lastSequence = 0;
+    bool m_haveSequence = false;
+    quint64 m_resumeSequence = 0;
+    bool m_resuming = false;
+    quint64 m_lostMessages = 0;
+};
@@ -1,21 +1,170 @@
+#include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDBusConnection>
 #include <QDBusError>
 #include <QDebug>
+#include <QHash>
+#include <QSocketNotifier>
+#include <QThread>
 
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
 #include "dbus_adaptor.h"
 #include "dbus_helpers.h"
+#include "deviceattribution.h"
+#include "eventlog.h"
+#include "floodguard.h"
+#include "ingestqueue.h"
 #include "journaltail.h"
+#include "kmsgreader.h"
 #include "usbdaemon.h"
 #include "usbmonitor.h"
 
+namespace {
+int g_signalPipe[2] = {-1, -1};
+
+void handleSignal(int signal) {
+    const char byte = signal == SIGHUP ? 'r' : signal == SIGUSR1 ? 's' : 'q';
+    const ssize_t ignored = ::write(g_signalPipe[1], &byte, 1);
+    Q_UNUSED(ignored);
+}
+
+// Turn SIGTERM / SIGINT into a regular event-loop quit so shutdown work (such
+// as the final checkpoint flush) runs from aboutToQuit, SIGHUP into a
+// reload of the classification rules and SIGUSR1 into a snapshot.
+void installSignalHandlers(QCoreApplication &app, UsbDaemon &daemon) {
+    if (::pipe2(g_signalPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        return;
+    }
+    auto *notifier = new QSocketNotifier(g_signalPipe[0], QSocketNotifier::Read, &app);
+    QObject::connect(notifier, &QSocketNotifier::activated, &app, [&app, &daemon]() {
+        char byte = 0;
+        while (::read(g_signalPipe[0], &byte, 1) == 1) {
+            if (byte == 'r') {
+                daemon.reloadRules();
+            } else if (byte == 's') {
+                daemon.writeSnapshot();
+            } else {
+                app.quit();
+            }
+        }
+    });
+    std::signal(SIGTERM, handleSignal);
+    std::signal(SIGINT, handleSignal);
+    std::signal(SIGHUP, handleSignal);
+    std::signal(SIGUSR1, handleSignal);
+}
+}
+
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("USBscope daemon");
+    parser.addHelpOption();
+    QCommandLineOption journalDirOption("journal-dir",
+        "Read journal files from <dir> instead of the system journal.", "dir");
+    QCommandLineOption usbOnlyOption("usb-only",
+        "Only follow kernel messages tagged with _KERNEL_SUBSYSTEM=usb.");
+    QCommandLineOption sourceOption("source",
+        "Kernel log source: journal (default) or kmsg.", "source", "journal");
+    QCommandLineOption kmsgPathOption("kmsg-path",
+        "Read kmsg records from <path> (default /dev/kmsg).", "path", "/dev/kmsg");
+    parser.addOption(journalDirOption);
+    parser.addOption(usbOnlyOption);
+    parser.addOption(sourceOption);
+    QCommandLineOption stateFileOption("state-file",
+        "Store the ingestion checkpoint in <file>.", "file", Checkpoint::defaultPath());
+    QCommandLineOption checkpointIntervalOption("checkpoint-interval",
+        "Write the checkpoint at most every <seconds> (default 5).", "seconds", "5");
+    QCommandLineOption maxReplayOption("max-replay",
+        "Replay at most <count> journal entries of backlog on startup (default 10000).", "count", "10000");
+    parser.addOption(kmsgPathOption);
+    parser.addOption(stateFileOption);
+    parser.addOption(checkpointIntervalOption);
+    QCommandLineOption rulesOption("rules",
+        "Load classification rules from <file> (default /etc/usbscope/rules.json).", "file",
+        "/etc/usbscope/rules.json");
+    parser.addOption(maxReplayOption);
+    QCommandLineOption floodRateOption("flood-rate",
+        "Sample non-error messages from a source beyond <count> per second (default 500, 0 disables).",
+        "count", "500");
+    QCommandLineOption eventLogDirOption("event-log-dir",
+        "Persist event history in <dir>.", "dir", EventLog::defaultDirectory());
+    QCommandLineOption noEventLogOption("no-event-log",
+        "Keep event history in memory only.");
+    QCommandLineOption retentionDaysOption("retention-days",
+        "Delete persisted events older than <days> (default 30, 0 keeps them).", "days", "30");
+    QCommandLineOption retentionSizeOption("retention-size",
+        "Keep at most <MiB> of persisted events (default 512, 0 for no limit).", "MiB", "512");
+    QCommandLineOption syncIntervalOption("sync-interval",
+        "Flush persisted events to disk at most every <msec> (default 1000).", "msec", "1000");
+    QCommandLineOption uncompressedSegmentsOption("uncompressed-segments",
+        "Compress persisted event segments except the newest <count> (default 2, -1 disables).",
+        "count", "2");
+    QCommandLineOption memoryBudgetOption("memory-budget",
+        "Keep at most <MiB> of recent events in memory (default 16).", "MiB", "16");
+    QCommandLineOption levelQuotaOption("level-quota",
+        "Reserve <level=MiB> of the memory budget for events of that level; may be repeated.",
+        "level=MiB");
+    QCommandLineOption snapshotDirOption("snapshot-dir",
+        "Write snapshots (WriteSnapshot, SIGUSR1) to <dir>.", "dir", UsbDaemon::defaultSnapshotDirectory());
+    QCommandLineOption snapshotOnBurstOption("snapshot-on-burst",
+        "Also write a snapshot on error bursts, at most once per minute.");
+    QCommandLineOption signalBatchMsecOption("signal-batch-ms",
+        "Send new events in LogEvents batches at most <msec> after the first (default 50).", "msec", "50");
+    QCommandLineOption signalBatchEventsOption("signal-batch-events",
+        "Send a LogEvents batch early once <count> events are pending (default 256).", "count", "256");
+    QCommandLineOption noPerEventSignalOption("no-per-event-signal",
+        "Only send LogEvents batches, not one LogEvent signal per event.");
+    parser.addOption(rulesOption);
+    parser.addOption(floodRateOption);
+    parser.addOption(eventLogDirOption);
+    parser.addOption(noEventLogOption);
+    parser.addOption(retentionDaysOption);
+    parser.addOption(retentionSizeOption);
+    parser.addOption(syncIntervalOption);
+    parser.addOption(uncompressedSegmentsOption);
+    parser.addOption(memoryBudgetOption);
+    parser.addOption(levelQuotaOption);
+    parser.addOption(snapshotDirOption);
+    parser.addOption(snapshotOnBurstOption);
+    parser.addOption(signalBatchMsecOption);
+    parser.addOption(signalBatchEventsOption);
+    QCommandLineOption sharedRingEventsOption("shared-ring-events",
+        "Share the newest <count> events with local clients through a memfd (default 16384, 0 disables).",
+        "count", "16384");
+    parser.addOption(noPerEventSignalOption);
+    parser.addOption(sharedRingEventsOption);
+    parser.process(app);
+
     registerUsbDbusTypes();
 
+    QHash<QString, qint64> levelQuotas;
+    for (const QString &quota : parser.values(levelQuotaOption)) {
+        const QString level = quota.section('=', 0, 0).trimmed();
+        bool ok = false;
+        const double mebibytes = quota.section('=', 1).toDouble(&ok);
+        if (level.isEmpty() || !ok || mebibytes < 0) {
+            qWarning() << "USBscope: Ignoring invalid level quota" << quota;
+            continue;
+        }
+        levelQuotas.insert(level, static_cast<qint64>(mebibytes * 1024 * 1024));
+    }
+
     UsbDaemon daemon;
+    daemon.setMemoryBudget(qMax(1, parser.value(memoryBudgetOption).toInt()) * qint64(1024 * 1024), levelQuotas);
+    daemon.setSnapshotDirectory(parser.value(snapshotDirOption));
+    daemon.setSnapshotOnBurst(parser.isSet(snapshotOnBurstOption));
+    daemon.setRulesPath(parser.value(rulesOption));
+    daemon.reloadRules();
+    installSignalHandlers(app, daemon);
     UsbscopeDBusAdaptor adaptor(&daemon);
+    adaptor.setBatching(parser.value(signalBatchMsecOption).toInt(), parser.value(signalBatchEventsOption).toInt());
+    adaptor.setPerEventSignal(!parser.isSet(noPerEventSignalOption));
     daemon.setAdaptor(&adaptor);
 
     QDBusConnection connection = usbscopeBus();
@@ -33,14 +182,88 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    JournalTail tail;
+    EventLog eventLog(parser.value(eventLogDirOption));
+    eventLog.setSyncInterval(parser.value(syncIntervalOption).toInt());
+    eventLog.setRetention(parser.value(retentionDaysOption).toLongLong() * 24 * 3600,
+                          parser.value(retentionSizeOption).toLongLong() * 1024 * 1024);
+    eventLog.setUncompressedSegments(parser.value(uncompressedSegmentsOption).toInt());
+    if (!parser.isSet(noEventLogOption) && eventLog.open()) {
+        daemon.setEventLog(&eventLog);
+    }
+    daemon.setSharedRingEvents(parser.value(sharedRingEventsOption).toInt());
+
+    Checkpoint checkpoint(parser.value(stateFileOption));
+    checkpoint.setFlushInterval(qMax(1, parser.value(checkpointIntervalOption).toInt()) * 1000);
+    checkpoint.load();
+
+    // Reading, parsing, attribution and flood protection run on the ingestion
+    // thread; batches reach the daemon through the IngestQueue, so a busy
+    // D-Bus client never delays reading the kernel log. The ingestion objects
+    // are deleted on that thread once it finishes.
+    QThread ingestThread;
+    ingestThread.setObjectName(QStringLiteral("usbscope-ingest"));
+    auto *tail = new JournalTail;
+    tail->setJournalDirectory(parser.value(journalDirOption));
+    tail->setUsbSubsystemOnly(parser.isSet(usbOnlyOption));
+    tail->setResumeCursor(checkpoint.journalCursor());
+    tail->setMaxReplay(parser.value(maxReplayOption).toInt());
+    auto *kmsg = new KmsgReader(parser.value(kmsgPathOption));
+    if (checkpoint.hasKmsgSequence()) {
+        kmsg->setResumeSequence(checkpoint.kmsgSequence());
+    }
+    auto *attribution = new DeviceAttribution;
+    auto *floodGuard = new FloodGuard;
+    floodGuard->setRateLimit(parser.value(floodRateOption).toInt());
+    daemon.setFloodGuard(floodGuard);
+    IngestQueue ingestQueue;
+    daemon.setIngestQueue(&ingestQueue);
     UsbMonitor monitor;
 
-    QObject::connect(&tail, &JournalTail::eventParsed, &daemon, &UsbDaemon::appendEvent);
+    QObject::connect(tail, &JournalTail::eventsParsed, attribution, &DeviceAttribution::processEvents);
+    QObject::connect(kmsg, &KmsgReader::eventsParsed, attribution, &DeviceAttribution::processEvents);
+    QObject::connect(attribution, &DeviceAttribution::eventsAttributed, floodGuard, &FloodGuard::processEvents);
+    QObject::connect(floodGuard, &FloodGuard::eventsAdmitted, &ingestQueue, &IngestQueue::push,
+                     Qt::DirectConnection);
+    QObject::connect(&ingestQueue, &IngestQueue::batchReady, &daemon, &UsbDaemon::appendEvents);
+    QObject::connect(kmsg, &KmsgReader::messagesLost, &daemon, &UsbDaemon::recordLostMessages);
+    // Positions are emitted after their batch was pushed, and the queued call
+    // runs after the drain that stores it.
+    QObject::connect(tail, &JournalTail::cursorChanged, &checkpoint, &Checkpoint::setJournalCursor);
+    QObject::connect(kmsg, &KmsgReader::sequenceChanged, &checkpoint, &Checkpoint::setKmsgSequence);
     QObject::connect(&monitor, &UsbMonitor::devicesChanged, &daemon, &UsbDaemon::setDevices);
+    QObject::connect(&monitor, &UsbMonitor::deviceAdded, attribution, &DeviceAttribution::addDevice);
+    QObject::connect(&monitor, &UsbMonitor::deviceRemoved, attribution, &DeviceAttribution::removeDevice);
+
+    for (QObject *stage : std::initializer_list<QObject *>{tail, kmsg, attribution, floodGuard}) {
+        stage->moveToThread(&ingestThread);
+        QObject::connect(&ingestThread, &QThread::finished, stage, &QObject::deleteLater);
+    }
+
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, &app, [&]() {
+        // A source may be blocked in IngestQueue::push() on a full queue;
+        // keep draining so it can finish and the thread can exit.
+        ingestThread.quit();
+        while (!ingestThread.wait(10)) {
+            ingestQueue.drain();
+        }
+        // Store what was still in flight and apply the positions that go
+        // with it before the final checkpoint write.
+        ingestQueue.drain();
+        QCoreApplication::sendPostedEvents(&checkpoint, QEvent::MetaCall);
+        eventLog.sync();
+        checkpoint.flush();
+    });
 
-    tail.start();
+    // Enumerate devices first so seed events can already be attributed.
     monitor.start();
+    attribution->setDevices(monitor.devices());
+
+    ingestThread.start();
+    if (parser.value(sourceOption) == QLatin1String("kmsg")) {
+        QMetaObject::invokeMethod(kmsg, &KmsgReader::start, Qt::QueuedConnection);
+    } else {
+        QMetaObject::invokeMethod(tail, &JournalTail::start, Qt::QueuedConnection);
+    }
 
     return app.exec();
 }
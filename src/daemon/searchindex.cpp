@@ -0,0 +1,103 @@
+#include "searchindex.h"
+
+#include <QVarLengthArray>
+
+#include <algorithm>
+
+namespace {
+// Trim evicted blocks from all lists after this many blocks were evicted.
+const quint32 kCompactionBlocks = 256;
+// Hash node of a posting list: key, list header and bucket overhead.
+const qint64 kNodeBytes = qint64(sizeof(quint32) + sizeof(QVector<quint32>) + 16);
+
+quint32 trigramAt(QByteArrayView text, qsizetype pos) {
+    return (quint32(quint8(text.at(pos))) << 16) | (quint32(quint8(text.at(pos + 1))) << 8)
+        | quint32(quint8(text.at(pos + 2)));
+}
+}
+
+QByteArray SearchIndex::fold(QByteArrayView text) {
+    QByteArray folded(text.data(), text.size());
+    for (char &ch : folded) {
+        if (ch >= 'A' && ch <= 'Z') {
+            ch = static_cast<char>(ch + ('a' - 'A'));
+        }
+    }
+    return folded;
+}
+
+void SearchIndex::add(quint64 sequence, QByteArrayView foldedText) {
+    const quint32 block = static_cast<quint32>(sequence / kBlockSize);
+    for (qsizetype pos = 0; pos + kMinQueryBytes <= foldedText.size(); ++pos) {
+        const quint32 trigram = trigramAt(foldedText, pos);
+        auto it = m_postings.find(trigram);
+        if (it == m_postings.end()) {
+            it = m_postings.insert(trigram, QVector<quint32>());
+            m_memoryBytes += kNodeBytes;
+        }
+        QVector<quint32> &blocks = it.value();
+        if (blocks.isEmpty() || blocks.last() != block) {
+            const qsizetype capacity = blocks.capacity();
+            blocks.append(block);
+            m_memoryBytes += (blocks.capacity() - capacity) * qint64(sizeof(quint32));
+        }
+    }
+}
+
+void SearchIndex::evictBefore(quint64 sequence) {
+    m_firstBlock = static_cast<quint32>(sequence / kBlockSize);
+    if (m_firstBlock - m_compactedBlock >= kCompactionBlocks) {
+        compact();
+    }
+}
+
+void SearchIndex::compact() {
+    m_memoryBytes = 0;
+    for (auto it = m_postings.begin(); it != m_postings.end();) {
+        QVector<quint32> &blocks = it.value();
+        const auto live = std::lower_bound(blocks.begin(), blocks.end(), m_firstBlock);
+        blocks.erase(blocks.begin(), live);
+        if (blocks.isEmpty()) {
+            it = m_postings.erase(it);
+        } else {
+            blocks.squeeze();
+            m_memoryBytes += kNodeBytes + blocks.capacity() * qint64(sizeof(quint32));
+            ++it;
+        }
+    }
+    m_compactedBlock = m_firstBlock;
+}
+
+bool SearchIndex::candidateBlocks(QByteArrayView foldedQuery, QVector<quint64> &blocks) const {
+    blocks.clear();
+    if (foldedQuery.size() < kMinQueryBytes) {
+        return false;
+    }
+
+    // Posting lists of the distinct query trigrams, shortest first.
+    QVarLengthArray<const QVector<quint32> *, 32> lists;
+    for (qsizetype pos = 0; pos + kMinQueryBytes <= foldedQuery.size(); ++pos) {
+        const auto it = m_postings.constFind(trigramAt(foldedQuery, pos));
+        if (it == m_postings.constEnd()) {
+            return true;
+        }
+        if (!lists.contains(&it.value())) {
+            lists.append(&it.value());
+        }
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const QVector<quint32> *a, const QVector<quint32> *b) { return a->size() < b->size(); });
+
+    const QVector<quint32> &shortest = *lists.first();
+    for (auto it = std::lower_bound(shortest.cbegin(), shortest.cend(), m_firstBlock); it != shortest.cend(); ++it) {
+        bool inAll = true;
+        for (int i = 1; i < lists.size() && inAll; ++i) {
+            inAll = std::binary_search(lists.at(i)->cbegin(), lists.at(i)->cend(), *it);
+        }
+        if (inAll) {
+            blocks.append(*it);
+        }
+    }
+    return true;
+}
+
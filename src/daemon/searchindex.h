@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QHash>
+#include <QVector>
+
+// Inverted trigram index over event messages. Sequences are grouped into
+// blocks and each posting list records the blocks in which a trigram
+// occurs, which keeps repetitive kernel logs cheap to index. A query is
+// answered by intersecting the lists of its trigrams and then checking the
+// events of the surviving blocks, so any case-insensitive substring of at
+// least three bytes can be found.
+//
+// Blocks are only ever appended in increasing order, so evicted blocks sit
+// at the front of every list; they are skipped when querying and trimmed in
+// bulk once enough of them have accumulated.
+class SearchIndex {
+public:
+    static constexpr quint64 kBlockSize = 64;
+    static constexpr int kMinQueryBytes = 3;
+
+    // ASCII case folding applied to both messages and queries.
+    static QByteArray fold(QByteArrayView text);
+
+    // Indexes an already folded message.
+    void add(quint64 sequence, QByteArrayView foldedText);
+    // Forgets everything before this sequence.
+    void evictBefore(quint64 sequence);
+    // Trims evicted blocks from the posting lists now rather than once
+    // enough of them have accumulated.
+    void compact();
+
+    // Blocks, in increasing order, that contain every trigram of the folded
+    // query. Queries shorter than kMinQueryBytes cannot be answered by the
+    // index; false is returned and every block is a candidate.
+    bool candidateBlocks(QByteArrayView foldedQuery, QVector<quint64> &blocks) const;
+
+    // Approximate heap use of the posting lists and the hash table; kept
+    // up to date as lists grow, so it is cheap to ask after every add().
+    qint64 memoryBytes() const { return m_memoryBytes; }
+
+private:
+    QHash<quint32, QVector<quint32>> m_postings;
+    qint64 m_memoryBytes = 0;
+    quint32 m_firstBlock = 0;
+    quint32 m_compactedBlock = 0;
+};
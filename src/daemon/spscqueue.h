@@ -0,0 +1,65 @@
+#pragma once
+
+#include <QtGlobal>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Slots are preallocated; the producer only writes m_tail and the
+// consumer only writes m_head, each publishing with release / observing the
+// other side with acquire ordering.
+template <typename T>
+class SpscQueue {
+public:
+    // Capacity is rounded up to a power of two.
+    explicit SpscQueue(int capacity) {
+        int size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    int capacity() const { return static_cast<int>(m_mask + 1); }
+
+    // Producer side. Returns false, leaving value untouched, if full.
+    bool tryPush(T &value) {
+        const quint64 tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > static_cast<quint64>(m_mask)) {
+            return false;
+        }
+        m_slots[tail & m_mask] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if empty.
+    bool tryPop(T &value) {
+        const quint64 head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(m_slots[head & m_mask]);
+        m_slots[head & m_mask] = T();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called concurrently with push / pop.
+    int size() const {
+        return static_cast<int>(m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire));
+    }
+
+private:
+    std::vector<T> m_slots;
+    quint64 m_mask = 0;
+    // Kept on separate cache lines so producer and consumer do not contend.
+    alignas(64) std::atomic<quint64> m_head{0};
+    alignas(64) std::atomic<quint64> m_tail{0};
+};
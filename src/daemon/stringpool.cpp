@@ -0,0 +1,31 @@
+#include "stringpool.h"
+
+StringPool::StringPool() {
+    m_values.append(QString());
+    updateMemoryBytes();
+}
+
+quint32 StringPool::intern(const QString &value) {
+    if (value.isEmpty()) {
+        return 0;
+    }
+    const auto it = m_ids.constFind(value);
+    if (it != m_ids.constEnd()) {
+        return it.value();
+    }
+    const quint32 id = static_cast<quint32>(m_values.size());
+    m_values.append(value);
+    m_ids.insert(value, id);
+    // New values are rare, so recounting is cheaper than tracking.
+    updateMemoryBytes();
+    return id;
+}
+
+void StringPool::updateMemoryBytes() {
+    qint64 bytes = m_values.capacity() * qint64(sizeof(QString));
+    for (const QString &value : m_values) {
+        bytes += value.capacity() * qint64(sizeof(QChar));
+    }
+    // Hash nodes: key, value and bucket overhead.
+    m_memoryBytes = bytes + m_ids.size() * qint64(sizeof(QString) + sizeof(quint32) + 16);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+// Interns the small set of recurring strings stored with every event
+// (levels, subsystems, hosts, device ids) so each distinct value is kept once
+// and events refer to it by a 32-bit id. Id 0 is always the empty string.
+// Entries are never removed; the set of distinct values is tiny compared to
+// the number of events.
+class StringPool {
+public:
+    StringPool();
+
+    quint32 intern(const QString &value);
+    const QString &at(quint32 id) const { return m_values.at(static_cast<int>(id)); }
+
+    int size() const { return m_values.size(); }
+    // Approximate heap use of the pooled strings and the lookup table.
+    qint64 memoryBytes() const { return m_memoryBytes; }
+
+private:
+    void updateMemoryBytes();
+
+    QVector<QString> m_values;
+    QHash<QString, quint32> m_ids;
+    qint64 m_memoryBytes = 0;
+};
@@ -1,27 +1,283 @@
 #include "usbdaemon.h"
 
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QSysInfo>
+
+#include <unistd.h>
+
 #include "dbus_adaptor.h"
+#include "eventclassifier.h"
+#include "eventlog.h"
+#include "floodguard.h"
+#include "ingestqueue.h"
+#include "snapshot.h"
+
+namespace {
+// Default memory budget of the event store, see setMemoryBudget().
+const qint64 kStoreBudgetBytes = 16 * 1024 * 1024;
+// A repeat later than this after the previous occurrence starts a new event.
+const qint64 kMaxRepeatGapUs = 60 * 1000000LL;
+// Upper bound on events returned by one query, to keep replies bounded.
+const int kMaxQueryEvents = 50000;
+// Events read per call while rebuilding device statistics from the log.
+const int kStatsReplayChunk = 65536;
+// Repeat updates remembered for clients that missed their signal.
+const int kMaxTrackedUpdates = 4096;
+// Minimum time between snapshots written on error bursts.
+const qint64 kBurstSnapshotIntervalMsecs = 60 * 1000;
+// Snapshots kept in the snapshot directory; older ones are removed.
+const int kMaxSnapshots = 32;
+const char *kSnapshotSuffix = ".usbsnap";
+
+bool isWordSeparator(QChar ch) {
+    return ch == u' ' || ch == u',' || ch == u';' || ch == u'(' || ch == u')' || ch == u'[' || ch == u']'
+        || ch == u'=';
+}
+
+// A plain decimal count or timestamp: digits with at most one '.' inside.
+bool isDecimal(QStringView word) {
+    bool point = false;
+    for (qsizetype i = 0; i < word.size(); ++i) {
+        const QChar ch = word.at(i);
+        if (ch == u'.' && !point && i > 0 && i + 1 < word.size()) {
+            point = true;
+        } else if (ch < u'0' || ch > u'9') {
+            return false;
+        }
+    }
+    return !word.isEmpty();
+}
+
+// Numbers after these words name a part of the device, not a count.
+bool namesPart(QStringView word) {
+    for (const char *name : {"port", "slot", "ep", "endpoint", "interface", "config", "intf"}) {
+        if (word.compare(QLatin1String(name), Qt::CaseInsensitive) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Messages that differ only in standalone decimal numbers, such as device
+// numbers, counters and timestamps, count as repeats of each other. Bus
+// paths ("1-2.3:1.0"), PCI addresses, hex values and negative error codes
+// ("error -71") are words of their own and kept as they are, as are port,
+// slot and endpoint numbers.
+QString messageTemplate(const QString &message) {
+    QString result;
+    result.reserve(message.size());
+    QStringView previous;
+    qsizetype start = 0;
+    while (start < message.size()) {
+        qsizetype end = start;
+        while (end < message.size() && !isWordSeparator(message.at(end))) {
+            ++end;
+        }
+        const QStringView word = QStringView(message).sliced(start, end - start);
+        if (isDecimal(word) && !namesPart(previous)) {
+            result.append(QLatin1Char('#'));
+        } else {
+            result.append(word);
+        }
+        if (!word.isEmpty()) {
+            previous = word;
+        }
+        if (end < message.size()) {
+            result.append(message.at(end));
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
+// Repeats are only folded within one device: the attributed one, else the
+// "<driver> <device>" prefix dev_printk() put in front of the text, else,
+// for messages without either, the source.
+QString runKey(const UsbEvent &event) {
+    if (!event.deviceId.isEmpty()) {
+        return event.deviceId;
+    }
+    const qsizetype end = event.message.indexOf(QLatin1String(": "));
+    if (end > 0) {
+        const QStringView prefix = QStringView(event.message).first(end);
+        if (prefix.count(u' ') == 1) {
+            QString key = event.source;
+            key.append(u'|');
+            key.append(prefix);
+            return key;
+        }
+    }
+    return event.source;
+}
+
+QList<QVariantList> toVariantList(const QVector<UsbEvent> &events) {
+    QList<QVariantList> data;
+    data.reserve(events.size());
+    for (const UsbEvent &event : events) {
+        data.append(toVariant(event));
+    }
+    return data;
+}
+}
 
 UsbDaemon::UsbDaemon(QObject *parent)
-    : QObject(parent) {
+    : QObject(parent), m_store(kStoreBudgetBytes) {
 }
 
 void UsbDaemon::setAdaptor(UsbscopeDBusAdaptor *adaptor) {
     m_adaptor = adaptor;
 }
 
+void UsbDaemon::setFloodGuard(const FloodGuard *floodGuard) {
+    m_floodGuard = floodGuard;
+}
+
+void UsbDaemon::setIngestQueue(const IngestQueue *ingestQueue) {
+    m_ingestQueue = ingestQueue;
+}
+
+void UsbDaemon::setEventLog(EventLog *eventLog) {
+    m_eventLog = eventLog;
+    if (!m_eventLog || !m_eventLog->isOpen() || m_eventLog->lastSequence() == 0) {
+        return;
+    }
+    // Read no more than the budget could possibly hold; the store evicts
+    // whatever does not fit.
+    const quint64 last = m_eventLog->lastSequence();
+    const quint64 wanted = static_cast<quint64>(m_store.maxEvents());
+    const quint64 first = qMax(m_eventLog->firstSequence(), last >= wanted ? last - wanted + 1 : 1);
+    // Device statistics cover the whole log, so the older events only feed
+    // them. A repeat update stored after the end of a chunk is missed, which
+    // only undercounts a run that straddles the boundary.
+    quint64 sequence = m_eventLog->firstSequence();
+    while (sequence < first) {
+        const QVector<UsbEvent> events =
+            m_eventLog->readSince(sequence, static_cast<int>(qMin<quint64>(kStatsReplayChunk, first - sequence)));
+        if (events.isEmpty()) {
+            break;
+        }
+        for (const UsbEvent &event : events) {
+            m_deviceStats.record(event);
+        }
+        sequence = events.last().sequence + 1;
+    }
+    for (const UsbEvent &event : m_eventLog->readSince(first, m_store.maxEvents())) {
+        m_store.append(event, event.sequence);
+        m_deviceStats.record(event);
+    }
+    m_store.skipTo(last + 1);
+}
+
 void UsbDaemon::appendEvent(const UsbEvent &event) {
-    m_events.append(event);
-    if (m_events.size() > m_maxEvents) {
-        m_events.erase(m_events.begin(), m_events.begin() + (m_events.size() - m_maxEvents));
+    appendEvents({event});
+}
+
+void UsbDaemon::appendEvents(const QVector<UsbEvent> &events) {
+    if (events.isEmpty()) {
+        return;
+    }
+
+    int errorCount = 0;
+    QString lastErrorMessage;
+    QList<QString> updatedRuns;
+    for (UsbEvent event : events) {
+        // Cut to what the store keeps before anything else sees it, so
+        // clients, the log and the shared ring get the stored text.
+        event.message = EventRing::truncatedMessage(event.message);
+        m_deviceStats.record(event);
+        if (event.isError) {
+            ++errorCount;
+            lastErrorMessage = event.message;
+        }
+        if (coalesce(event, updatedRuns)) {
+            continue;
+        }
+        RepeatRun &run = m_runs[runKey(event)];
+        flushRun(run);
+        UsbEvent stored = event;
+        stored.sequence = m_store.append(event);
+        stored.lastTimestampUs = event.timestampUs;
+        if (m_eventLog) {
+            m_eventLog->append(stored);
+        }
+        m_sharedRing.write(stored);
+        if (m_adaptor) {
+            m_adaptor->emitLogEvent(stored);
+        }
+        run = RepeatRun{stored, messageTemplate(stored.message), false};
+    }
+
+    // Clients and the log get one update per coalesced event and batch.
+    for (const QString &key : std::as_const(updatedRuns)) {
+        flushRun(m_runs[key]);
+    }
+
+    if (errorCount > 0) {
+        recordErrorBurst(errorCount, lastErrorMessage);
+    }
+}
+
+bool UsbDaemon::coalesce(const UsbEvent &event, QList<QString> &updatedRuns) {
+    const QString key = runKey(event);
+    auto it = m_runs.find(key);
+    if (it == m_runs.end()) {
+        return false;
+    }
+    RepeatRun &run = it.value();
+    const UsbEvent &first = run.event;
+    if (event.level != first.level || event.isError != first.isError || event.isUsb != first.isUsb
+        || event.subsystem != first.subsystem
+        || event.timestampUs < first.lastTimestampUs
+        || event.timestampUs - first.lastTimestampUs > kMaxRepeatGapUs
+        || messageTemplate(event.message) != run.messageTemplate) {
+        return false;
+    }
+
+    UsbEvent updated = first;
+    updated.repeatCount = first.repeatCount + 1;
+    updated.lastTimestampUs = event.timestampUs;
+    // Evicted meanwhile: the repeat is stored as a new event instead.
+    if (!m_store.updateRepeat(updated)) {
+        return false;
+    }
+    run.event = updated;
+    if (!run.updated) {
+        run.updated = true;
+        updatedRuns.append(key);
     }
+    ++m_coalescedCount;
+    return true;
+}
 
+void UsbDaemon::flushRun(RepeatRun &run) {
+    if (!run.updated) {
+        return;
+    }
+    run.updated = false;
+    if (m_eventLog) {
+        m_eventLog->appendRepeat(run.event);
+    }
+    m_sharedRing.updateRepeat(run.event);
     if (m_adaptor) {
-        m_adaptor->emitLogEvent(event);
+        m_adaptor->emitLogEventUpdated(run.event);
     }
 
-    if (event.isError) {
-        recordErrorBurst(event);
+    // A run is usually updated many times in a row, so its previous update
+    // is found near the end.
+    for (qsizetype i = m_repeatUpdates.size() - 1; i >= 0; --i) {
+        if (m_repeatUpdates[i].sequence == run.event.sequence) {
+            m_repeatUpdates.removeAt(i);
+            break;
+        }
+    }
+    m_repeatUpdates.append(RepeatUpdate{run.event.sequence, m_store.lastSequence()});
+    if (m_repeatUpdates.size() > kMaxTrackedUpdates) {
+        m_droppedUpdatesAt = m_repeatUpdates.first().sentAt;
+        m_repeatUpdates.removeFirst();
     }
 }
 
@@ -32,16 +288,110 @@ void UsbDaemon::setDevices(const QList<UsbDeviceInfo> &devices) {
     }
 }
 
-QList<QVariantList> UsbDaemon::recentEventsVariant(int limit) const {
-    QList<QVariantList> data;
+void UsbDaemon::recordLostMessages(quint64 count) {
+    m_lostMessages += count;
+
+    UsbEvent event;
+    event.timestampUs = QDateTime::currentMSecsSinceEpoch() * 1000;
+    event.level = QStringLiteral("warning");
+    event.subsystem = QStringLiteral("usbscope");
+    event.source = QStringLiteral("usbscoped");
+    event.message = QStringLiteral("Kernel log overrun: %1 message(s) lost").arg(count);
+    appendEvent(event);
+}
+
+void UsbDaemon::setRulesPath(const QString &path) {
+    m_rulesPath = path;
+}
+
+void UsbDaemon::setMemoryBudget(qint64 budgetBytes, const QHash<QString, qint64> &levelQuotas) {
+    m_store.setBudget(budgetBytes, levelQuotas);
+}
+
+bool UsbDaemon::reloadRules() {
+    QVector<ClassificationRule> rules = EventClassifier::defaultRules();
+    if (!m_rulesPath.isEmpty() && QFile::exists(m_rulesPath)) {
+        QString error;
+        if (!EventClassifier::loadRules(m_rulesPath, rules, &error)) {
+            qWarning() << "USBscope: Keeping previous classification rules;" << m_rulesPath
+                       << "is invalid:" << error;
+            return false;
+        }
+    }
+    EventClassifier::install(std::make_shared<const EventClassifier>(rules));
+    return true;
+}
+
+QVector<UsbEvent> UsbDaemon::recentEvents(int limit) const {
+    return m_store.newest(limit);
+}
+
+QVector<UsbEvent> UsbDaemon::eventsSince(quint64 sequence, int limit) const {
+    limit = qMin(limit, kMaxQueryEvents);
     if (limit <= 0) {
-        return data;
+        return {};
     }
-    int start = qMax(0, m_events.size() - limit);
-    for (int i = start; i < m_events.size(); ++i) {
-        data.append(toVariant(m_events.at(i)));
+    // Older than what memory holds completely: the persisted log has
+    // everything up to the newest event, so it answers the whole query.
+    if (sequence < m_store.firstSequence() && m_eventLog) {
+        return m_eventLog->readSince(sequence, limit);
     }
-    return data;
+    return m_store.eventsSince(sequence, limit);
+}
+
+QVector<UsbEvent> UsbDaemon::updatedEventsSince(quint64 sequence, bool &complete) const {
+    complete = sequence > m_droppedUpdatesAt;
+    QVector<UsbEvent> events;
+    for (const RepeatUpdate &update : m_repeatUpdates) {
+        if (update.sentAt < sequence) {
+            continue;
+        }
+        // Events evicted from memory are read back from the log, which
+        // applies their newest repeat count.
+        const QVector<UsbEvent> stored = eventsSince(update.sequence, 1);
+        if (!stored.isEmpty() && stored.first().sequence == update.sequence) {
+            events.append(stored.first());
+        }
+    }
+    return events;
+}
+
+quint64 UsbDaemon::firstAvailableSequence() const {
+    if (m_eventLog && m_eventLog->firstSequence() <= m_eventLog->lastSequence()) {
+        return qMin(m_eventLog->firstSequence(), m_store.firstSequence());
+    }
+    return m_store.firstSequence();
+}
+
+QVector<UsbEvent> UsbDaemon::eventsInRange(qint64 startUs, qint64 endUs, int limit) const {
+    limit = qMin(limit, kMaxQueryEvents);
+    if (limit <= 0) {
+        return {};
+    }
+    if (m_eventLog && (m_store.isEmpty() || startUs < m_store.firstTimestampUs())) {
+        return m_eventLog->readRange(startUs, endUs, limit);
+    }
+    return m_store.eventsInRange(startUs, endUs, limit);
+}
+
+QVector<UsbEvent> UsbDaemon::searchEvents(const QString &query, int limit) const {
+    return m_store.search(query, qMin(limit, kMaxQueryEvents));
+}
+
+QList<QVariantList> UsbDaemon::recentEventsVariant(int limit) const {
+    return toVariantList(recentEvents(limit));
+}
+
+QList<QVariantList> UsbDaemon::eventsSinceVariant(quint64 sequence, int limit) const {
+    return toVariantList(eventsSince(sequence, limit));
+}
+
+QList<QVariantList> UsbDaemon::eventsInRangeVariant(qint64 startUs, qint64 endUs, int limit) const {
+    return toVariantList(eventsInRange(startUs, endUs, limit));
+}
+
+QList<QVariantList> UsbDaemon::searchEventsVariant(const QString &query, int limit) const {
+    return toVariantList(searchEvents(query, limit));
 }
 
 QList<QVariantList> UsbDaemon::currentDevicesVariant() const {
@@ -52,24 +402,160 @@ QList<QVariantList> UsbDaemon::currentDevicesVariant() const {
     return data;
 }
 
+QList<QVariantList> UsbDaemon::deviceStatsVariant() const {
+    QList<QVariantList> data;
+    for (const UsbDeviceStats &stats : m_deviceStats.snapshot(QDateTime::currentMSecsSinceEpoch() * 1000)) {
+        data.append(toVariant(stats));
+    }
+    return data;
+}
+
 QVariantList UsbDaemon::stateSummary() const {
     QVariantList summary;
-    summary.append(m_events.size());
+    summary.append(m_store.size());
     summary.append(m_devices.size());
+    summary.append(m_lostMessages);
+    summary.append(m_floodGuard ? m_floodGuard->suppressedCount() : quint64(0));
+    summary.append(m_floodGuard ? m_floodGuard->sampledCount() : quint64(0));
+    summary.append(m_ingestQueue ? m_ingestQueue->lastLatencyUs() : qint64(0));
+    summary.append(m_ingestQueue ? m_ingestQueue->maxLatencyUs() : qint64(0));
+    summary.append(m_ingestQueue ? m_ingestQueue->stallCount() : quint64(0));
+    summary.append(m_store.searchIndexBytes());
+    summary.append(m_store.budget());
+    summary.append(m_store.usedBytes());
+    summary.append(m_store.eventBytes());
+    // Per quota level, bytes used and the quota; "" is the shared ring.
+    QVariantMap levels;
+    const QHash<QString, qint64> used = m_store.usedBytesByLevel();
+    for (auto it = used.cbegin(); it != used.cend(); ++it) {
+        levels.insert(it.key(), QVariantList{it.value(), m_store.levelQuotas().value(it.key())});
+    }
+    summary.append(levels);
+    summary.append(m_coalescedCount);
     return summary;
 }
 
-void UsbDaemon::recordErrorBurst(const UsbEvent &event) {
-    QDateTime now = QDateTime::currentDateTimeUtc();
-    m_errorTimes.append(now);
-    const int windowSeconds = 5;
+QList<QVariantList> UsbDaemon::ruleHitsVariant() const {
+    // Counters restart whenever the rules are reloaded.
+    const std::shared_ptr<const EventClassifier> classifier = EventClassifier::current();
+    const QVector<quint64> hits = classifier->hitCounts();
+    QList<QVariantList> data;
+    for (int i = 0; i < hits.size(); ++i) {
+        const ClassificationRule &rule = classifier->rules().at(i);
+        data.append(QVariantList{
+            QString::fromUtf8(rule.pattern),
+            rule.field == ClassificationRule::Subsystem ? QStringLiteral("subsystem") : QStringLiteral("message"),
+            rule.level,
+            hits.at(i),
+        });
+    }
+    return data;
+}
+
+void UsbDaemon::recordErrorBurst(int errorCount, const QString &lastMessage) {
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_errorTimes.append(ErrorSample{now, errorCount});
+    m_errorsInWindow += errorCount;
+    const qint64 windowMsecs = 5000;
     const int threshold = 5;
 
-    while (!m_errorTimes.isEmpty() && m_errorTimes.first().secsTo(now) > windowSeconds) {
+    while (!m_errorTimes.isEmpty() && now - m_errorTimes.first().timeMsecs > windowMsecs) {
+        m_errorsInWindow -= m_errorTimes.first().count;
         m_errorTimes.removeFirst();
     }
 
-    if (m_errorTimes.size() >= threshold && m_adaptor) {
-        m_adaptor->emitErrorBurst(m_errorTimes.size(), event.message);
+    if (m_errorsInWindow < threshold) {
+        return;
+    }
+    if (m_adaptor) {
+        m_adaptor->emitErrorBurst(m_errorsInWindow, lastMessage);
+    }
+    if (m_snapshotOnBurst && now - m_lastBurstSnapshotMsecs >= kBurstSnapshotIntervalMsecs) {
+        m_lastBurstSnapshotMsecs = now;
+        writeSnapshot();
+    }
+}
+
+QString UsbDaemon::defaultSnapshotDirectory() {
+    if (::geteuid() == 0) {
+        return QStringLiteral("/var/lib/usbscope/snapshots");
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/snapshots";
+}
+
+void UsbDaemon::setSnapshotDirectory(const QString &directory) {
+    m_snapshotDirectory = directory;
+}
+
+void UsbDaemon::setSnapshotOnBurst(bool enabled) {
+    m_snapshotOnBurst = enabled;
+}
+
+QString UsbDaemon::writeSnapshot(const QString &fileName) {
+    QString name = fileName;
+    if (name.isEmpty()) {
+        name = QStringLiteral("usbscope-%1.usbsnap")
+                   .arg(QDateTime::currentDateTime().toString(QStringLiteral("yyyyMMdd-hhmmss-zzz")));
+    }
+    // Only plain names, so clients cannot make the daemon write elsewhere.
+    if (name.contains(QLatin1Char('/')) || name == QLatin1String(".") || name == QLatin1String("..")) {
+        qWarning() << "USBscope: Invalid snapshot name" << fileName;
+        return {};
+    }
+    // Every snapshot carries the suffix, so pruning never touches other files.
+    if (!name.endsWith(QLatin1String(kSnapshotSuffix))) {
+        name += QLatin1String(kSnapshotSuffix);
+    }
+    const QString directory = m_snapshotDirectory.isEmpty() ? defaultSnapshotDirectory() : m_snapshotDirectory;
+    if (!QDir().mkpath(directory)) {
+        qWarning() << "USBscope: Cannot create snapshot directory" << directory;
+        return {};
+    }
+
+    QMap<QString, QString> metadata;
+    metadata.insert(QStringLiteral("host"), QSysInfo::machineHostName());
+    metadata.insert(QStringLiteral("kernel"), QSysInfo::kernelVersion());
+    metadata.insert(QStringLiteral("writer"), QStringLiteral("usbscoped"));
+    metadata.insert(QStringLiteral("firstSequence"), QString::number(m_store.firstSequence()));
+    metadata.insert(QStringLiteral("lastSequence"), QString::number(m_store.lastSequence()));
+    metadata.insert(QStringLiteral("lostMessages"), QString::number(m_lostMessages));
+
+    const QString path = QDir(directory).filePath(name);
+    if (QFileInfo::exists(path)) {
+        qWarning() << "USBscope: Not overwriting existing snapshot" << path;
+        return {};
+    }
+    QString error;
+    if (!Snapshot::write(path, m_store.newest(m_store.size()), m_devices,
+                         m_deviceStats.snapshot(QDateTime::currentMSecsSinceEpoch() * 1000), metadata, &error)) {
+        qWarning() << "USBscope: Cannot write snapshot" << path << error;
+        return {};
+    }
+    pruneSnapshots(directory);
+    return path;
+}
+
+void UsbDaemon::pruneSnapshots(const QString &directory) {
+    const QFileInfoList snapshots = QDir(directory).entryInfoList(
+        {QStringLiteral("*") + QLatin1String(kSnapshotSuffix)}, QDir::Files, QDir::Time);
+    for (int i = kMaxSnapshots; i < snapshots.size(); ++i) {
+        if (!QFile::remove(snapshots.at(i).filePath())) {
+            qWarning() << "USBscope: Cannot remove old snapshot" << snapshots.at(i).filePath();
+        }
+    }
+}
+
+bool UsbDaemon::setSharedRingEvents(int slotCount) {
+    if (slotCount <= 0) {
+        m_sharedRing.close();
+        return true;
+    }
+    if (!m_sharedRing.create(slotCount)) {
+        qWarning() << "USBscope: Cannot create the shared event ring";
+        return false;
+    }
+    for (const UsbEvent &event : m_store.newest(slotCount)) {
+        m_sharedRing.write(event);
     }
+    return true;
 }
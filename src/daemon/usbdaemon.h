@@ -3,8 +3,14 @@
 #include <QDateTime>
 #include <QObject>
 
+#include "devicestats.h"
+#include "eventstore.h"
+#include "sharedeventring.h"
 #include "usbtypes.h"
 
+class EventLog;
+class FloodGuard;
+class IngestQueue;
 class UsbscopeDBusAdaptor;
 
 class UsbDaemon : public QObject {
@@ -13,20 +19,123 @@ public:
     explicit UsbDaemon(QObject *parent = nullptr);
 
     void setAdaptor(UsbscopeDBusAdaptor *adaptor);
+    // Source of the suppressed / sampled counters in the state summary.
+    void setFloodGuard(const FloodGuard *floodGuard);
+    // Source of the ingest latency figures in the state summary.
+    void setIngestQueue(const IngestQueue *ingestQueue);
+    // Persists every stored event and restores the newest persisted ones
+    // into memory, continuing their sequence numbers. Device statistics are
+    // rebuilt from the whole log.
+    void setEventLog(EventLog *eventLog);
 
     void appendEvent(const UsbEvent &event);
+    void appendEvents(const QVector<UsbEvent> &events);
     void setDevices(const QList<UsbDeviceInfo> &devices);
+    void recordLostMessages(quint64 count);
+
+    // Bytes of memory the in-memory history may use, and quotas within it
+    // for levels whose events should outlive the others. Takes effect
+    // immediately, evicting the oldest events as needed.
+    void setMemoryBudget(qint64 budgetBytes, const QHash<QString, qint64> &levelQuotas);
+
+    // Classification rules file; a missing file means the built-in rules.
+    void setRulesPath(const QString &path);
+    // Compiles the rules file and installs it for all log sources. On error
+    // the rules in effect are kept and false is returned.
+    bool reloadRules();
+
+    static QString defaultSnapshotDirectory();
+    // Directory writeSnapshot() writes to; created when needed.
+    void setSnapshotDirectory(const QString &directory);
+    // Also write a snapshot when an error burst is reported, at most once
+    // per minute.
+    void setSnapshotOnBurst(bool enabled);
+    // Writes the in-memory history, the device table and the device
+    // statistics as a Snapshot named fileName (a timestamped name if empty,
+    // ".usbsnap" appended if missing) in the snapshot directory. Existing
+    // files are never overwritten, and only the newest 32 snapshots are
+    // kept. Returns the path written, or an empty string on failure.
+    QString writeSnapshot(const QString &fileName = QString());
+
+    // Mirrors the newest slotCount stored events into a SharedEventRing
+    // that local clients map read-only (GetEventRing); 0 disables it.
+    // Seeded with the events already in memory.
+    bool setSharedRingEvents(int slotCount);
+    const SharedEventRing &sharedRing() const { return m_sharedRing; }
+
+    QVector<UsbEvent> recentEvents(int limit) const;
+    QVector<UsbEvent> eventsSince(quint64 sequence, int limit) const;
+    QVector<UsbEvent> eventsInRange(qint64 startUs, qint64 endUs, int limit) const;
+    QVector<UsbEvent> searchEvents(const QString &query, int limit) const;
+    const QList<UsbDeviceInfo> &devices() const { return m_devices; }
+    // Oldest sequence from which on eventsSince() returns every event, from
+    // memory or the persisted log, and the newest sequence.
+    quint64 firstAvailableSequence() const;
+    quint64 lastSequence() const { return m_store.lastSequence(); }
+    // Current copies of the stored events whose repeat count changed after
+    // event sequence was stored, in the order of their latest update.
+    // complete is false if updates that old are no longer remembered.
+    QVector<UsbEvent> updatedEventsSince(quint64 sequence, bool &complete) const;
 
     QList<QVariantList> recentEventsVariant(int limit) const;
+    QList<QVariantList> eventsSinceVariant(quint64 sequence, int limit) const;
+    QList<QVariantList> eventsInRangeVariant(qint64 startUs, qint64 endUs, int limit) const;
+    QList<QVariantList> searchEventsVariant(const QString &query, int limit) const;
     QList<QVariantList> currentDevicesVariant() const;
+    QList<QVariantList> deviceStatsVariant() const;
     QVariantList stateSummary() const;
+    QList<QVariantList> ruleHitsVariant() const;
 
 private:
-    void recordErrorBurst(const UsbEvent &event);
+    // Errors seen in one appended batch, for the sliding burst window.
+    struct ErrorSample {
+        qint64 timeMsecs = 0;
+        int count = 0;
+    };
+
+    // The event run of one device (or host) that the next repeat of its
+    // message is folded into.
+    struct RepeatRun {
+        UsbEvent event;
+        QString messageTemplate;
+        bool updated = false;
+    };
+
+    // The latest repeat update of an event and the newest sequence stored
+    // when it was sent.
+    struct RepeatUpdate {
+        quint64 sequence = 0;
+        quint64 sentAt = 0;
+    };
+
+    // Folds event into the run of its source if it repeats it; false if it
+    // has to be stored as a new event.
+    bool coalesce(const UsbEvent &event, QList<QString> &updatedRuns);
+    // Sends a pending repeat update of the run to clients and the log.
+    void flushRun(RepeatRun &run);
+    void recordErrorBurst(int errorCount, const QString &lastMessage);
+    // Removes all but the newest kMaxSnapshots snapshots in directory.
+    void pruneSnapshots(const QString &directory);
 
-    QList<UsbEvent> m_events;
+    EventStore m_store;
+    SharedEventRing m_sharedRing;
+    DeviceStats m_deviceStats;
+    QHash<QString, RepeatRun> m_runs;
+    quint64 m_coalescedCount = 0;
+    // Oldest update first, one per event, bounded.
+    QList<RepeatUpdate> m_repeatUpdates;
+    // sentAt of the newest update dropped from m_repeatUpdates; 0 if none.
+    quint64 m_droppedUpdatesAt = 0;
     QList<UsbDeviceInfo> m_devices;
-    QList<QDateTime> m_errorTimes;
-    int m_maxEvents = 5000;
+    QList<ErrorSample> m_errorTimes;
+    int m_errorsInWindow = 0;
+    quint64 m_lostMessages = 0;
+    QString m_rulesPath;
     UsbscopeDBusAdaptor *m_adaptor = nullptr;
+    const FloodGuard *m_floodGuard = nullptr;
+    const IngestQueue *m_ingestQueue = nullptr;
+    EventLog *m_eventLog = nullptr;
+    QString m_snapshotDirectory;
+    bool m_snapshotOnBurst = false;
+    qint64 m_lastBurstSnapshotMsecs = 0;
 };
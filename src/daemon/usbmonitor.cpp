@@ -28,19 +28,22 @@ void UsbMonitor::start() {
         return;
     }
 
-    emit devicesChanged(buildDeviceList());
-
+    // Start listening before enumerating so no hotplug event falls between
+    // the snapshot and the first notification.
     m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
-    if (!m_monitor) {
-        return;
-    }
+    if (m_monitor) {
+        udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "usb", "usb_device");
+        udev_monitor_enable_receiving(m_monitor);
 
-    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "usb", nullptr);
-    udev_monitor_enable_receiving(m_monitor);
+        int fd = udev_monitor_get_fd(m_monitor);
+        m_notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &UsbMonitor::handleUdevEvent);
+    }
 
-    int fd = udev_monitor_get_fd(m_monitor);
-    m_notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
-    connect(m_notifier, &QSocketNotifier::activated, this, &UsbMonitor::handleUdevEvent);
+    for (const UsbDeviceInfo &info : buildDeviceList()) {
+        m_devices.insert(info.sysPath, info);
+    }
+    emit devicesChanged(m_devices.values());
 }
 
 void UsbMonitor::handleUdevEvent() {
@@ -49,11 +52,48 @@ void UsbMonitor::handleUdevEvent() {
     }
 
     udev_device *dev = udev_monitor_receive_device(m_monitor);
-    if (dev) {
-        udev_device_unref(dev);
+    if (!dev) {
+        return;
     }
 
-    emit devicesChanged(buildDeviceList());
+    const QString action = safeStr(udev_device_get_action(dev));
+    const QString sysPath = safeStr(udev_device_get_syspath(dev));
+    bool changed = false;
+    if (action == QLatin1String("remove")) {
+        auto it = m_devices.find(sysPath);
+        if (it != m_devices.end()) {
+            const UsbDeviceInfo info = it.value();
+            m_devices.erase(it);
+            emit deviceRemoved(info);
+            changed = true;
+        }
+    } else if (action == QLatin1String("add") || action == QLatin1String("change")) {
+        const UsbDeviceInfo info = deviceInfo(dev);
+        m_devices.insert(sysPath, info);
+        emit deviceAdded(info);
+        changed = true;
+    }
+    udev_device_unref(dev);
+
+    if (changed) {
+        emit devicesChanged(m_devices.values());
+    }
+}
+
+UsbDeviceInfo UsbMonitor::deviceInfo(udev_device *dev) const {
+    UsbDeviceInfo info;
+    info.busId = safeStr(udev_device_get_sysname(dev));
+    info.deviceId = safeStr(udev_device_get_property_value(dev, "ID_SERIAL_SHORT"));
+    info.vendorId = safeStr(udev_device_get_sysattr_value(dev, "idVendor"));
+    info.productId = safeStr(udev_device_get_sysattr_value(dev, "idProduct"));
+    info.summary = safeStr(udev_device_get_property_value(dev, "ID_MODEL_FROM_DATABASE"));
+    if (info.summary.isEmpty()) {
+        info.summary = safeStr(udev_device_get_property_value(dev, "ID_MODEL"));
+    }
+    info.sysPath = safeStr(udev_device_get_syspath(dev));
+    info.busNumber = safeStr(udev_device_get_sysattr_value(dev, "busnum")).toInt();
+    info.deviceNumber = safeStr(udev_device_get_sysattr_value(dev, "devnum")).toInt();
+    return info;
 }
 
 QList<UsbDeviceInfo> UsbMonitor::buildDeviceList() {
@@ -85,18 +125,7 @@ QList<UsbDeviceInfo> UsbMonitor::buildDeviceList() {
             continue;
         }
 
-        UsbDeviceInfo info;
-        info.busId = safeStr(udev_device_get_sysname(dev));
-        info.deviceId = safeStr(udev_device_get_property_value(dev, "ID_SERIAL_SHORT"));
-        info.vendorId = safeStr(udev_device_get_sysattr_value(dev, "idVendor"));
-        info.productId = safeStr(udev_device_get_sysattr_value(dev, "idProduct"));
-        info.summary = safeStr(udev_device_get_property_value(dev, "ID_MODEL_FROM_DATABASE"));
-        if (info.summary.isEmpty()) {
-            info.summary = safeStr(udev_device_get_property_value(dev, "ID_MODEL"));
-        }
-        info.sysPath = safeStr(path);
-
-        devices.append(info);
+        devices.append(deviceInfo(dev));
         udev_device_unref(dev);
     }
 
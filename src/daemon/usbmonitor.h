@@ -1,5 +1,6 @@
 #pragma once
 
+#include <QMap>
 #include <QObject>
 #include <QSocketNotifier>
 
@@ -7,6 +8,9 @@
 
 #include "usbtypes.h"
 
+// Tracks the connected USB devices through udev. The device table is
+// enumerated once at start and then updated incrementally from hotplug
+// events, keyed by sysfs path.
 class UsbMonitor : public QObject {
     Q_OBJECT
 public:
@@ -15,16 +19,22 @@ public:
 
     void start();
 
+    QList<UsbDeviceInfo> devices() const { return m_devices.values(); }
+
 signals:
     void devicesChanged(const QList<UsbDeviceInfo> &devices);
+    void deviceAdded(const UsbDeviceInfo &device);
+    void deviceRemoved(const UsbDeviceInfo &device);
 
 private slots:
     void handleUdevEvent();
 
 private:
     QList<UsbDeviceInfo> buildDeviceList();
+    UsbDeviceInfo deviceInfo(udev_device *dev) const;
 
     struct udev *m_udev = nullptr;
     struct udev_monitor *m_monitor = nullptr;
     QSocketNotifier *m_notifier = nullptr;
+    QMap<QString, UsbDeviceInfo> m_devices;
 };
@@ -23,8 +23,17 @@ TrayIcon::TrayIcon(QObject *parent)
         }
     });
 
+    // Only USB errors are shown, so let the daemon send nothing else.
+    EventFilter usbErrors;
+    usbErrors.setUsb(true);
+    usbErrors.setError(true);
+    m_client.setFilter(usbErrors);
     connect(&m_client, &UsbscopeDBusClient::LogEvent, this, &TrayIcon::handleLogEvent);
+    // A repeat of a coalesced error is a new occurrence of it.
+    connect(&m_client, &UsbscopeDBusClient::LogEventUpdated, this, &TrayIcon::handleLogEvent);
     connect(&m_client, &UsbscopeDBusClient::ErrorBurst, this, &TrayIcon::handleErrorBurst);
+    // Only new errors matter here, so continue after the daemon's newest.
+    connect(&m_client, &UsbscopeDBusClient::HistoryReset, this, [this]() { m_client.startSync(1); });
 
     connect(&m_tooltipTimer, &QTimer::timeout, this, &TrayIcon::updateTooltip);
     m_tooltipTimer.start(5000);
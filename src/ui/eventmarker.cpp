@@ -52,8 +52,13 @@ void EventMarker::hoverEnterEvent(QGraphicsSceneHoverEvent *event) {
         "<b>Message:</b> %4"
     ).arg(m_event.subsystem)
      .arg(m_event.level)
-     .arg(m_event.timestamp)
+     .arg(formatTimestamp(m_event.timestampUs))
      .arg(m_event.message.length() > 100 ? m_event.message.left(100) + "..." : m_event.message);
+    if (m_event.repeatCount > 1) {
+        tooltipText += QString("<br><b>Repeated:</b> %1 times, last at %2")
+            .arg(m_event.repeatCount)
+            .arg(formatTimestamp(m_event.lastTimestampUs));
+    }
 
     QToolTip::showText(event->screenPos(), tooltipText);
 
@@ -87,7 +92,7 @@ void EventMarker::contextMenuEvent(QGraphicsSceneContextMenuEvent *event) {
 
     if (selected == copyAction) {
         QStringList fields;
-        fields << m_event.timestamp
+        fields << formatTimestamp(m_event.timestampUs)
                << m_event.level
                << m_event.subsystem
                << m_event.source
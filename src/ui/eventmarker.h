@@ -10,6 +10,7 @@ public:
     explicit EventMarker(const UsbEvent &event, qreal x, qreal y, qreal size = 8.0);
 
     const UsbEvent &event() const { return m_event; }
+    void setEvent(const UsbEvent &event) { m_event = event; }
 
 protected:
     void hoverEnterEvent(QGraphicsSceneHoverEvent *event) override;
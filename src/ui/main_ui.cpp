@@ -1,4 +1,5 @@
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QIcon>
 
 #include "dbus_helpers.h"
@@ -15,12 +16,25 @@ void ensureDaemonAndTrayRunning() {
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("USBscope");
+    parser.addHelpOption();
+    parser.addPositionalArgument("snapshot", "Open a snapshot file instead of the live event stream.", "[snapshot]");
+    parser.process(app);
+
     registerUsbDbusTypes();
-    ensureDaemonAndTrayRunning();
+    // A snapshot is viewed offline, without a daemon.
+    const QStringList arguments = parser.positionalArguments();
+    if (arguments.isEmpty()) {
+        ensureDaemonAndTrayRunning();
+    }
 
     MainWindow window;
     app.setWindowIcon(loadUsbScopeIcon());
     window.setWindowIcon(loadUsbScopeIcon());
+    if (!arguments.isEmpty()) {
+        window.openSnapshot(arguments.first());
+    }
     window.show();
 
     return app.exec();
@@ -12,6 +12,8 @@
 #include <QDateTime>
 #include <QDateTimeEdit>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QHash>
 #include <QHeaderView>
 #include <QHBoxLayout>
 #include <QLabel>
@@ -21,12 +23,18 @@
 #include <QPushButton>
 #include <QSizePolicy>
 #include <QSplitter>
+#include <QStatusBar>
+#include <QSysInfo>
 #include <QTabWidget>
 #include <QTextStream>
 #include <QToolBar>
 #include <QVBoxLayout>
 
 namespace {
+// Newest events of a snapshot drawn on the timeline; every marker is a
+// scene item, so the whole snapshot would make the view crawl.
+const int kSnapshotTimelineEvents = 5000;
+
 QColor eventColor(const UsbEvent &event) {
     if (event.isError) {
         return QColor("#da4453"); // Breeze Red
@@ -55,7 +63,7 @@ int UsbLogModel::rowCount(const QModelIndex &parent) const {
     if (parent.isValid()) {
         return 0;
     }
-    return m_events.size();
+    return m_snapshot ? m_snapshot->eventCount() : m_events.size();
 }
 
 int UsbLogModel::columnCount(const QModelIndex &parent) const {
@@ -66,14 +74,14 @@ int UsbLogModel::columnCount(const QModelIndex &parent) const {
 }
 
 QVariant UsbLogModel::data(const QModelIndex &index, int role) const {
-    if (!index.isValid() || index.row() >= m_events.size()) {
+    if (!index.isValid() || index.row() >= rowCount()) {
         return {};
     }
-    const UsbEvent &event = m_events.at(index.row());
+    const UsbEvent event = eventAt(index.row());
     if (role == Qt::DisplayRole) {
         switch (index.column()) {
         case 0:
-            return event.timestamp;
+            return formatTimestamp(event.timestampUs);
         case 1:
             return event.level;
         case 2:
@@ -81,6 +89,12 @@ QVariant UsbLogModel::data(const QModelIndex &index, int role) const {
         case 3:
             return event.source;
         case 4:
+            if (event.repeatCount > 1) {
+                return QStringLiteral("%1 (repeated %2 times, last at %3)")
+                    .arg(event.message)
+                    .arg(event.repeatCount)
+                    .arg(formatTimestamp(event.lastTimestampUs));
+            }
             return event.message;
         default:
             return {};
@@ -114,18 +128,65 @@ QVariant UsbLogModel::headerData(int section, Qt::Orientation orientation, int r
 
 void UsbLogModel::setEvents(const QList<UsbEvent> &events) {
     beginResetModel();
+    m_snapshot.reset();
     m_events = events;
     endResetModel();
 }
 
+void UsbLogModel::setSnapshot(const std::shared_ptr<const Snapshot> &snapshot) {
+    beginResetModel();
+    m_events.clear();
+    m_snapshot = snapshot;
+    endResetModel();
+}
+
 void UsbLogModel::appendEvent(const UsbEvent &event) {
+    if (m_snapshot) {
+        return;
+    }
     beginInsertRows(QModelIndex(), m_events.size(), m_events.size());
     m_events.append(event);
     endInsertRows();
 }
 
-const UsbEvent &UsbLogModel::eventAt(int row) const {
-    return m_events.at(row);
+void UsbLogModel::appendEvents(const QList<UsbEvent> &events) {
+    if (m_snapshot || events.isEmpty()) {
+        return;
+    }
+    beginInsertRows(QModelIndex(), m_events.size(), m_events.size() + events.size() - 1);
+    m_events.append(events);
+    endInsertRows();
+}
+
+void UsbLogModel::updateEvent(const UsbEvent &event) {
+    // Updates are for recent events, so search from the end.
+    for (int row = m_events.size() - 1; row >= 0; --row) {
+        if (m_events.at(row).sequence == event.sequence) {
+            m_events[row] = event;
+            emit dataChanged(index(row, 0), index(row, columnCount() - 1));
+            return;
+        }
+    }
+}
+
+UsbEvent UsbLogModel::eventAt(int row) const {
+    return m_snapshot ? m_snapshot->event(row) : m_events.at(row);
+}
+
+quint64 UsbLogModel::sequenceAt(int row) const {
+    return m_snapshot ? m_snapshot->sequence(row) : m_events.at(row).sequence;
+}
+
+qint64 UsbLogModel::timestampAt(int row) const {
+    return m_snapshot ? m_snapshot->timestampUs(row) : m_events.at(row).timestampUs;
+}
+
+bool UsbLogModel::isUsbAt(int row) const {
+    return m_snapshot ? m_snapshot->isUsb(row) : m_events.at(row).isUsb;
+}
+
+bool UsbLogModel::isErrorAt(int row) const {
+    return m_snapshot ? m_snapshot->isError(row) : m_events.at(row).isError;
 }
 
 UsbLogFilterProxyModel::UsbLogFilterProxyModel(QObject *parent)
@@ -173,8 +234,8 @@ void UsbLogFilterProxyModel::setFilterPreset(FilterPreset preset) {
 }
 
 void UsbLogFilterProxyModel::setDateRange(const QDateTime &start, const QDateTime &end) {
-    m_startDate = start;
-    m_endDate = end;
+    m_startUs = start.toMSecsSinceEpoch() * 1000;
+    m_endUs = end.toMSecsSinceEpoch() * 1000;
     m_useDateFilter = true;
     beginFilterChange();
     endFilterChange();
@@ -196,24 +257,18 @@ bool UsbLogFilterProxyModel::filterAcceptsRow(int sourceRow, const QModelIndex &
     if (!model) {
         return false;
     }
-    const UsbEvent &event = model->eventAt(sourceRow);
-
-    if (m_usbOnly && !event.isUsb) {
+    // Field accessors, so snapshot rows are not decoded just to filter.
+    if (m_usbOnly && !model->isUsbAt(sourceRow)) {
         return false;
     }
-    if (m_errorsOnly && !event.isError) {
+    if (m_errorsOnly && !model->isErrorAt(sourceRow)) {
         return false;
     }
 
-    if (m_useDateFilter) {
-        QDateTime eventTime = QDateTime::fromString(event.timestamp, Qt::ISODate);
-        if (!eventTime.isValid()) {
-            eventTime = QDateTime::fromString(event.timestamp, "MMM dd hh:mm:ss");
-        }
-        if (eventTime.isValid()) {
-            if (eventTime < m_startDate || eventTime > m_endDate) {
-                return false;
-            }
+    const qint64 timestampUs = model->timestampAt(sourceRow);
+    if (m_useDateFilter && timestampUs != 0) {
+        if (timestampUs < m_startUs || timestampUs > m_endUs) {
+            return false;
         }
     }
 
@@ -228,8 +283,24 @@ MainWindow::MainWindow(QWidget *parent)
     setupUi();
     loadInitialData();
 
-    connect(&m_client, &UsbscopeDBusClient::LogEvent, this, &MainWindow::handleLogEvent);
+    connect(&m_client, &UsbscopeDBusClient::LogEvents, this, &MainWindow::handleLogEvents);
+    connect(&m_client, &UsbscopeDBusClient::LogEventUpdated, this, &MainWindow::handleLogEventUpdated);
     connect(&m_client, &UsbscopeDBusClient::DevicesChanged, this, &MainWindow::refreshDevices);
+    connect(&m_client, &UsbscopeDBusClient::DeviceStatsReceived, this, [this](const QList<UsbDeviceStats> &stats) {
+        // A reply can arrive after a snapshot was opened.
+        if (!m_snapshot) {
+            applyDeviceStats(stats);
+        }
+    });
+    connect(&m_client, &UsbscopeDBusClient::EventsMissed, this, [this](quint64 count) {
+        statusBar()->showMessage(
+            QString("%1 event(s) were evicted by the daemon before they could be fetched").arg(count), 10000);
+    });
+    connect(&m_client, &UsbscopeDBusClient::HistoryReset, this, [this]() {
+        if (!m_snapshot) {
+            loadInitialData();
+        }
+    });
 }
 
 void MainWindow::setupActions() {
@@ -240,6 +311,18 @@ void MainWindow::setupActions() {
     m_exportDevicesAction = new QAction(QIcon::fromTheme("document-export"), "Export Devices to CSV...", this);
     connect(m_exportDevicesAction, &QAction::triggered, this, &MainWindow::exportDevicesToCsv);
 
+    m_openSnapshotAction = new QAction(QIcon::fromTheme("document-open"), "Open Snapshot...", this);
+    m_openSnapshotAction->setShortcut(QKeySequence::Open);
+    connect(m_openSnapshotAction, &QAction::triggered, this, &MainWindow::openSnapshotFile);
+
+    m_saveSnapshotAction = new QAction(QIcon::fromTheme("document-save"), "Save Snapshot...", this);
+    m_saveSnapshotAction->setShortcut(QKeySequence::Save);
+    connect(m_saveSnapshotAction, &QAction::triggered, this, &MainWindow::saveSnapshot);
+
+    m_liveViewAction = new QAction(QIcon::fromTheme("view-refresh"), "Return to Live View", this);
+    m_liveViewAction->setEnabled(false);
+    connect(m_liveViewAction, &QAction::triggered, this, &MainWindow::returnToLiveView);
+
     m_copyAction = new QAction(QIcon::fromTheme("edit-copy"), "Copy Selection", this);
     m_copyAction->setShortcut(QKeySequence::Copy);
     connect(m_copyAction, &QAction::triggered, this, &MainWindow::copySelection);
@@ -269,6 +352,10 @@ void MainWindow::setupMenuBar() {
     QMenuBar *menuBar = new QMenuBar(this);
 
     QMenu *fileMenu = menuBar->addMenu("&File");
+    fileMenu->addAction(m_openSnapshotAction);
+    fileMenu->addAction(m_saveSnapshotAction);
+    fileMenu->addAction(m_liveViewAction);
+    fileMenu->addSeparator();
     fileMenu->addAction(m_exportCsvAction);
     fileMenu->addAction(m_exportDevicesAction);
     fileMenu->addSeparator();
@@ -484,26 +571,42 @@ void MainWindow::setupUi() {
     connect(m_endDate, &QDateTimeEdit::dateTimeChanged, this, &MainWindow::onDateRangeChanged);
 
     connect(&m_daemonStatusTimer, &QTimer::timeout, this, &MainWindow::updateDaemonStatusLabel);
+    connect(&m_daemonStatusTimer, &QTimer::timeout, this, &MainWindow::refreshDeviceStats);
+    // Picks up events whose signals were lost with no later event to
+    // reveal the gap.
+    connect(&m_daemonStatusTimer, &QTimer::timeout, &m_client, &UsbscopeDBusClient::resync);
     m_daemonStatusTimer.start(5000);
     updateDaemonStatusLabel();
 }
 
 void MainWindow::loadInitialData() {
-    QList<UsbEvent> events = m_client.getRecentEvents(500);
+    QList<UsbEvent> events = m_client.startSync(500);
     m_model.setEvents(events);
     m_timelineScene->setEvents(events);
     m_timelineView->fitToView();
     refreshDevices();
 }
 
-void MainWindow::handleLogEvent(const UsbEvent &event) {
-    m_model.appendEvent(event);
-    m_timelineScene->addEvent(event);
+void MainWindow::handleLogEvents(const QList<UsbEvent> &events) {
+    if (m_snapshot) {
+        return;
+    }
+    // One row insertion per batch, however many events it holds.
+    m_model.appendEvents(events);
+    m_timelineScene->addEvents(events);
+}
+
+void MainWindow::handleLogEventUpdated(const UsbEvent &event) {
+    if (m_snapshot) {
+        return;
+    }
+    m_model.updateEvent(event);
+    m_timelineScene->updateEvent(event);
 }
 
 void MainWindow::refreshDevices() {
     m_deviceList->clear();
-    const QList<UsbDeviceInfo> devices = m_client.getCurrentDevices();
+    const QList<UsbDeviceInfo> devices = m_snapshot ? m_snapshot->devices() : m_client.getCurrentDevices();
     for (const UsbDeviceInfo &device : devices) {
         QString label = device.summary;
         if (label.isEmpty()) {
@@ -514,12 +617,72 @@ void MainWindow::refreshDevices() {
         }
         QListWidgetItem *item = new QListWidgetItem(label, m_deviceList);
         item->setData(Qt::UserRole, QVariant::fromValue(toVariant(device)));
+        item->setData(Qt::UserRole + 1, label);
+    }
+    refreshDeviceStats();
+}
+
+void MainWindow::refreshDeviceStats() {
+    if (m_snapshot) {
+        applyDeviceStats(m_snapshot->deviceStats());
+    } else {
+        m_client.requestDeviceStats();
+    }
+}
+
+void MainWindow::applyDeviceStats(const QList<UsbDeviceStats> &deviceStats) {
+    QHash<QString, UsbDeviceStats> statsById;
+    for (const UsbDeviceStats &stats : deviceStats) {
+        statsById.insert(stats.deviceId, stats);
+    }
+    for (int row = 0; row < m_deviceList->count(); ++row) {
+        QListWidgetItem *item = m_deviceList->item(row);
+        const UsbDeviceInfo device = deviceFromVariant(item->data(Qt::UserRole).toList());
+        const QString label = item->data(Qt::UserRole + 1).toString();
+        // Events are attributed to the bus id of a device.
+        const auto it = statsById.constFind(device.busId);
+        if (it == statsById.constEnd()) {
+            item->setText(label);
+            item->setToolTip(QString());
+            continue;
+        }
+        const UsbDeviceStats &stats = it.value();
+        item->setText(stats.errors > 0
+            ? QStringLiteral("%1: %2 error(s), %3 in the last hour").arg(label).arg(stats.errors).arg(stats.errorsLastHour)
+            : label);
+        item->setForeground(stats.errorsLastHour > 0 ? QBrush(QColor("#da4453")) : QBrush());
+        item->setToolTip(QStringLiteral(
+            "Events: %1\nErrors: %2\nResets: %3\nDisconnects: %4\nLast error: %5\n"
+            "Errors in the last minute / 15 minutes / hour: %6 / %7 / %8\nCounted since: %9")
+            .arg(stats.totalEvents)
+            .arg(stats.errors)
+            .arg(stats.resets)
+            .arg(stats.disconnects)
+            .arg(stats.lastErrorUs > 0 ? formatTimestamp(stats.lastErrorUs) : QStringLiteral("never"))
+            .arg(stats.errorsLastMinute)
+            .arg(stats.errorsLast15Minutes)
+            .arg(stats.errorsLastHour)
+            .arg(stats.firstEventUs > 0 ? formatTimestamp(stats.firstEventUs) : QStringLiteral("unknown")));
     }
 }
 
 void MainWindow::onFilterPresetChanged(int index) {
     auto preset = static_cast<UsbLogFilterProxyModel::FilterPreset>(m_filterPreset->itemData(index).toInt());
     m_filterModel.setFilterPreset(preset);
+
+    // Have the daemon send only what the preset shows, and reload so the
+    // view holds exactly that.
+    EventFilter filter;
+    if (preset == UsbLogFilterProxyModel::UsbEventsOnly || preset == UsbLogFilterProxyModel::UsbErrors) {
+        filter.setUsb(true);
+    }
+    if (preset == UsbLogFilterProxyModel::ErrorsOnly || preset == UsbLogFilterProxyModel::UsbErrors) {
+        filter.setError(true);
+    }
+    m_client.setFilter(filter);
+    if (!m_snapshot) {
+        loadInitialData();
+    }
 }
 
 void MainWindow::onDateRangeChanged() {
@@ -572,6 +735,88 @@ void MainWindow::exportToCsv() {
         QString("Exported %1 events to %2").arg(m_filterModel.rowCount()).arg(fileName));
 }
 
+void MainWindow::openSnapshotFile() {
+    const QString fileName = QFileDialog::getOpenFileName(
+        this,
+        "Open Snapshot",
+        QString(),
+        "USBscope Snapshots (*.usbsnap);;All Files (*)");
+    if (!fileName.isEmpty()) {
+        openSnapshot(fileName);
+    }
+}
+
+bool MainWindow::openSnapshot(const QString &path) {
+    auto snapshot = std::make_shared<Snapshot>();
+    if (!snapshot->open(path)) {
+        QMessageBox::warning(this, "Open Failed",
+            QString("Could not open %1: %2").arg(path, snapshot->errorString()));
+        return false;
+    }
+    m_snapshot = snapshot;
+    m_model.setSnapshot(m_snapshot);
+
+    QList<UsbEvent> timelineEvents;
+    const int count = m_snapshot->eventCount();
+    for (int i = qMax(0, count - kSnapshotTimelineEvents); i < count; ++i) {
+        timelineEvents.append(m_snapshot->event(i));
+    }
+    m_timelineScene->setEvents(timelineEvents);
+    m_timelineView->fitToView();
+    refreshDevices();
+
+    const QMap<QString, QString> metadata = m_snapshot->metadata();
+    setWindowTitle(QString("USBscope - %1 (%2, %3)")
+        .arg(QFileInfo(path).fileName())
+        .arg(metadata.value("host", "unknown host"))
+        .arg(formatTimestamp(m_snapshot->createdUs())));
+    m_saveSnapshotAction->setEnabled(false);
+    m_liveViewAction->setEnabled(true);
+    // A snapshot does not change; the daemon is polled again in live view.
+    m_daemonStatusTimer.stop();
+    return true;
+}
+
+void MainWindow::saveSnapshot() {
+    QString fileName = QFileDialog::getSaveFileName(
+        this,
+        "Save Snapshot",
+        "usbscope.usbsnap",
+        "USBscope Snapshots (*.usbsnap);;All Files (*)");
+
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    QVector<UsbEvent> events;
+    events.reserve(m_model.rowCount());
+    for (int row = 0; row < m_model.rowCount(); ++row) {
+        events.append(m_model.eventAt(row));
+    }
+    QMap<QString, QString> metadata;
+    metadata.insert("host", QSysInfo::machineHostName());
+    metadata.insert("kernel", QSysInfo::kernelVersion());
+    metadata.insert("writer", "usbscope-ui");
+
+    QString error;
+    if (!Snapshot::write(fileName, events, m_client.getCurrentDevices(), m_client.getDeviceStats(), metadata, &error)) {
+        QMessageBox::warning(this, "Save Failed", QString("Could not write %1: %2").arg(fileName, error));
+        return;
+    }
+    QMessageBox::information(this, "Snapshot Saved",
+        QString("Saved %1 events to %2").arg(events.size()).arg(fileName));
+}
+
+void MainWindow::returnToLiveView() {
+    m_snapshot.reset();
+    setWindowTitle("USBscope");
+    m_saveSnapshotAction->setEnabled(true);
+    m_liveViewAction->setEnabled(false);
+    loadInitialData();
+    m_daemonStatusTimer.start();
+    updateDaemonStatusLabel();
+}
+
 void MainWindow::copySelection() {
     QModelIndexList indexes = m_logView->selectionModel()->selectedRows();
     if (indexes.isEmpty()) {
@@ -719,10 +964,15 @@ void MainWindow::onTimelineEventClicked(const UsbEvent &event) {
         QModelIndex proxyIndex = m_filterModel.index(row, 0);
         QModelIndex sourceIndex = m_filterModel.mapToSource(proxyIndex);
 
-        const UsbEvent &rowEvent = m_model.eventAt(sourceIndex.row());
+        const int sourceRow = sourceIndex.row();
 
-        // Match by timestamp and message (unique enough)
-        if (rowEvent.timestamp == event.timestamp && rowEvent.message == event.message) {
+        // Sequence numbers identify stored events exactly; older daemons do
+        // not send them, so fall back to timestamp and message.
+        const bool matches = event.sequence != 0
+            ? m_model.sequenceAt(sourceRow) == event.sequence
+            : m_model.timestampAt(sourceRow) == event.timestampUs
+                && m_model.eventAt(sourceRow).message == event.message;
+        if (matches) {
             m_logView->selectRow(row);
             m_logView->scrollTo(proxyIndex, QAbstractItemView::PositionAtCenter);
             break;
@@ -13,7 +13,10 @@
 #include <QTimer>
 #include <QLabel>
 
+#include <memory>
+
 #include "dbus_helpers.h"
+#include "snapshot.h"
 
 class TimelineView;
 class TimelineScene;
@@ -29,11 +32,23 @@ public:
     QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
 
     void setEvents(const QList<UsbEvent> &events);
+    // Shows the events of a snapshot, decoded row by row as they are read,
+    // instead of the events set or appended.
+    void setSnapshot(const std::shared_ptr<const Snapshot> &snapshot);
     void appendEvent(const UsbEvent &event);
-    const UsbEvent &eventAt(int row) const;
+    void appendEvents(const QList<UsbEvent> &events);
+    // Replaces the event with the same sequence, if shown.
+    void updateEvent(const UsbEvent &event);
+    UsbEvent eventAt(int row) const;
+    // Single fields of a row, cheap for snapshot rows as well.
+    quint64 sequenceAt(int row) const;
+    qint64 timestampAt(int row) const;
+    bool isUsbAt(int row) const;
+    bool isErrorAt(int row) const;
 
 private:
     QList<UsbEvent> m_events;
+    std::shared_ptr<const Snapshot> m_snapshot;
 };
 
 class UsbLogFilterProxyModel : public QSortFilterProxyModel {
@@ -64,8 +79,8 @@ private:
     bool m_usbOnly = false;
     bool m_errorsOnly = false;
     bool m_useDateFilter = false;
-    QDateTime m_startDate;
-    QDateTime m_endDate;
+    qint64 m_startUs = 0;
+    qint64 m_endUs = 0;
 };
 
 class MainWindow : public QMainWindow {
@@ -73,14 +88,26 @@ class MainWindow : public QMainWindow {
 public:
     explicit MainWindow(QWidget *parent = nullptr);
 
+    // Shows a snapshot file instead of the daemon's live events; false
+    // (after telling the user) if it cannot be opened.
+    bool openSnapshot(const QString &path);
+
 private slots:
-    void handleLogEvent(const UsbEvent &event);
+    void handleLogEvents(const QList<UsbEvent> &events);
+    void handleLogEventUpdated(const UsbEvent &event);
     void refreshDevices();
+    // Shows the snapshot's statistics, or asks the daemon for its current
+    // ones without blocking.
+    void refreshDeviceStats();
+    void applyDeviceStats(const QList<UsbDeviceStats> &deviceStats);
     void onFilterPresetChanged(int index);
     void onDateRangeChanged();
     void showAboutDialog();
     void exportToCsv();
     void exportDevicesToCsv();
+    void openSnapshotFile();
+    void saveSnapshot();
+    void returnToLiveView();
     void copySelection();
     void copyDevicesSelection();
     void showContextMenu(const QPoint &pos);
@@ -99,6 +126,8 @@ private:
     void loadInitialData();
 
     UsbscopeDBusClient m_client;
+    // Snapshot being viewed; live events are ignored while one is open.
+    std::shared_ptr<const Snapshot> m_snapshot;
     UsbLogModel m_model;
     UsbLogFilterProxyModel m_filterModel;
 
@@ -119,6 +148,9 @@ private:
     // Actions
     QAction *m_exportCsvAction = nullptr;
     QAction *m_exportDevicesAction = nullptr;
+    QAction *m_openSnapshotAction = nullptr;
+    QAction *m_saveSnapshotAction = nullptr;
+    QAction *m_liveViewAction = nullptr;
     QAction *m_copyAction = nullptr;
     QAction *m_quitAction = nullptr;
     QAction *m_refreshAction = nullptr;
@@ -7,6 +7,8 @@
 #include <QGraphicsSceneMouseEvent>
 #include <QPen>
 
+#include <limits>
+
 TimelineScene::TimelineScene(QObject *parent)
     : QGraphicsScene(parent) {
     setSceneRect(0, 0, m_sceneWidth, m_sceneHeight);
@@ -18,64 +20,76 @@ void TimelineScene::setEvents(const QList<UsbEvent> &events) {
 
     // Determine time range
     if (!events.isEmpty()) {
-        QDateTime minTime = QDateTime::currentDateTime();
-        QDateTime maxTime = QDateTime::fromSecsSinceEpoch(0);
-
+        m_startUs = std::numeric_limits<qint64>::max();
+        m_endUs = std::numeric_limits<qint64>::min();
         for (const UsbEvent &event : events) {
-            QDateTime eventTime = QDateTime::fromString(event.timestamp, Qt::ISODate);
-            if (!eventTime.isValid()) {
-                eventTime = QDateTime::fromString(event.timestamp, "MMM dd hh:mm:ss");
-            }
-            if (eventTime.isValid()) {
-                if (eventTime < minTime) minTime = eventTime;
-                if (eventTime > maxTime) maxTime = eventTime;
-            }
+            m_startUs = qMin(m_startUs, event.timestampUs);
+            m_endUs = qMax(m_endUs, event.timestampUs);
         }
-
-        m_startTime = minTime;
-        m_endTime = maxTime;
     }
 
     rebuildScene();
 }
 
 void TimelineScene::addEvent(const UsbEvent &event) {
-    m_events.append(event);
-
-    // Update time range if needed
-    QDateTime eventTime = QDateTime::fromString(event.timestamp, Qt::ISODate);
-    if (!eventTime.isValid()) {
-        eventTime = QDateTime::fromString(event.timestamp, "MMM dd hh:mm:ss");
-    }
+    addEvents({event});
+}
 
-    if (eventTime.isValid()) {
-        if (!m_startTime.isValid() || eventTime < m_startTime) {
-            m_startTime = eventTime;
-            rebuildScene();
-            return;
+void TimelineScene::addEvents(const QList<UsbEvent> &events) {
+    // The scene is rebuilt at most once per batch.
+    bool rebuild = false;
+    for (const UsbEvent &event : events) {
+        m_events.append(event);
+
+        // Update time range if needed
+        if (!hasTimeRange() || event.timestampUs < m_startUs) {
+            m_startUs = event.timestampUs;
+            m_endUs = qMax(m_endUs, event.timestampUs);
+            rebuild = true;
+            continue;
+        }
+        if (event.timestampUs > m_endUs) {
+            m_endUs = event.timestampUs;
         }
-        if (!m_endTime.isValid() || eventTime > m_endTime) {
-            m_endTime = eventTime;
+        if (rebuild) {
+            continue;
         }
 
         // Add single marker without rebuilding
-        qreal x = timestampToX(event.timestamp);
+        qreal x = timestampToX(event.timestampUs);
         qreal y = eventTypeToY(event);
         EventMarker *marker = new EventMarker(event, x, y, 14.0);
         addItem(marker);
+        m_markers.insert(event.sequence, marker);
+    }
+    if (rebuild) {
+        rebuildScene();
+    }
+}
+
+void TimelineScene::updateEvent(const UsbEvent &event) {
+    for (int i = m_events.size() - 1; i >= 0; --i) {
+        if (m_events.at(i).sequence == event.sequence) {
+            m_events[i] = event;
+            break;
+        }
+    }
+    if (EventMarker *marker = m_markers.value(event.sequence)) {
+        marker->setEvent(event);
     }
 }
 
 void TimelineScene::updateTimeRange(const QDateTime &start, const QDateTime &end) {
-    m_startTime = start;
-    m_endTime = end;
+    m_startUs = start.toMSecsSinceEpoch() * 1000;
+    m_endUs = end.toMSecsSinceEpoch() * 1000;
     rebuildScene();
 }
 
 void TimelineScene::rebuildScene() {
     clear();
+    m_markers.clear();
 
-    if (m_events.isEmpty() || !m_startTime.isValid() || !m_endTime.isValid()) {
+    if (m_events.isEmpty() || !hasTimeRange()) {
         return;
     }
 
@@ -96,11 +110,12 @@ void TimelineScene::rebuildScene() {
 
     // Add event markers
     for (const UsbEvent &event : m_events) {
-        qreal x = timestampToX(event.timestamp);
+        qreal x = timestampToX(event.timestampUs);
         qreal y = eventTypeToY(event);
 
         EventMarker *marker = new EventMarker(event, x, y, 14.0);
         addItem(marker);
+        m_markers.insert(event.sequence, marker);
     }
 
     // Draw time axis
@@ -112,28 +127,19 @@ void TimelineScene::rebuildScene() {
     setSceneRect(bounds);
 }
 
-qreal TimelineScene::timestampToX(const QString &timestamp) const {
-    if (!m_startTime.isValid() || !m_endTime.isValid()) {
-        return 0;
-    }
-
-    QDateTime eventTime = QDateTime::fromString(timestamp, Qt::ISODate);
-    if (!eventTime.isValid()) {
-        eventTime = QDateTime::fromString(timestamp, "MMM dd hh:mm:ss");
-    }
-
-    if (!eventTime.isValid()) {
+qreal TimelineScene::timestampToX(qint64 timestampUs) const {
+    if (!hasTimeRange()) {
         return 0;
     }
 
-    qint64 totalSeconds = m_startTime.secsTo(m_endTime);
-    if (totalSeconds <= 0) {
+    const qint64 totalUs = m_endUs - m_startUs;
+    if (totalUs <= 0) {
         return m_sceneWidth / 2;
     }
 
-    qint64 eventSeconds = m_startTime.secsTo(eventTime);
+    const qint64 eventUs = timestampUs - m_startUs;
     qreal margin = 50.0;
-    return margin + ((m_sceneWidth - 2 * margin) * eventSeconds) / totalSeconds;
+    return margin + ((m_sceneWidth - 2 * margin) * eventUs) / totalUs;
 }
 
 qreal TimelineScene::eventTypeToY(const UsbEvent &event) const {
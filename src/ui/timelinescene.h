@@ -2,6 +2,7 @@
 
 #include <QGraphicsScene>
 #include <QDateTime>
+#include <QHash>
 
 #include "usbtypes.h"
 
@@ -14,6 +15,9 @@ public:
 
     void setEvents(const QList<UsbEvent> &events);
     void addEvent(const UsbEvent &event);
+    void addEvents(const QList<UsbEvent> &events);
+    // Replaces the event with the same sequence and its marker, if shown.
+    void updateEvent(const UsbEvent &event);
     void updateTimeRange(const QDateTime &start, const QDateTime &end);
 
 signals:
@@ -24,12 +28,16 @@ protected:
 
 private:
     void rebuildScene();
-    qreal timestampToX(const QString &timestamp) const;
+    bool hasTimeRange() const { return m_endUs >= m_startUs; }
+    qreal timestampToX(qint64 timestampUs) const;
     qreal eventTypeToY(const UsbEvent &event) const;
 
     QList<UsbEvent> m_events;
-    QDateTime m_startTime;
-    QDateTime m_endTime;
+    // Markers by event sequence, for updates to coalesced events.
+    QHash<quint64, EventMarker *> m_markers;
+    // Empty range (end < start) until the first event arrives.
+    qint64 m_startUs = 0;
+    qint64 m_endUs = -1;
     qreal m_sceneWidth = 10000.0;
     qreal m_sceneHeight = 300.0;
     qreal m_laneHeight = 60.0;
@@ -0,0 +1,84 @@
+// Repeated kernel messages are folded into one event only when they come
+// from the same device and differ in nothing but counters.
+
+#include <QtTest>
+
+#include "usbdaemon.h"
+
+namespace {
+UsbEvent kernelEvent(qint64 timestampUs, const QString &message, const QString &deviceId = QString()) {
+    UsbEvent event;
+    event.timestampUs = timestampUs;
+    event.lastTimestampUs = timestampUs;
+    event.level = QStringLiteral("error");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("host");
+    event.deviceId = deviceId;
+    event.message = message;
+    event.isUsb = true;
+    event.isError = true;
+    return event;
+}
+}
+
+class TestCoalescing : public QObject {
+    Q_OBJECT
+
+private slots:
+    void keepsDevicesAndErrorsApart();
+    void foldsIdenticalMessages();
+    void foldsCounters();
+};
+
+void TestCoalescing::keepsDevicesAndErrorsApart() {
+    UsbDaemon daemon;
+    // Neither device is attributed, as for most kernel lines.
+    daemon.appendEvents({kernelEvent(1000, QStringLiteral("usb 1-2: device descriptor read/64, error -71")),
+                         kernelEvent(2000, QStringLiteral("usb 3-4: device descriptor read/64, error -110")),
+                         kernelEvent(3000, QStringLiteral("usb 1-2: device descriptor read/64, error -110")),
+                         kernelEvent(4000, QStringLiteral("usb 3-4: device descriptor read/64, error -71"))});
+
+    const QVector<UsbEvent> events = daemon.recentEvents(10);
+    QCOMPARE(events.size(), 4);
+    QCOMPARE(events.at(0).message, QStringLiteral("usb 1-2: device descriptor read/64, error -71"));
+    QCOMPARE(events.at(1).message, QStringLiteral("usb 3-4: device descriptor read/64, error -110"));
+    QCOMPARE(events.at(2).message, QStringLiteral("usb 1-2: device descriptor read/64, error -110"));
+    QCOMPARE(events.at(3).message, QStringLiteral("usb 3-4: device descriptor read/64, error -71"));
+    for (const UsbEvent &event : events) {
+        QCOMPARE(event.repeatCount, 1u);
+    }
+}
+
+void TestCoalescing::foldsIdenticalMessages() {
+    UsbDaemon daemon;
+    daemon.appendEvents({kernelEvent(1000, QStringLiteral("usb 1-2: device descriptor read/64, error -71")),
+                         kernelEvent(2000, QStringLiteral("usb 1-2: device descriptor read/64, error -71")),
+                         kernelEvent(3000, QStringLiteral("usb 3-4: device descriptor read/64, error -71")),
+                         kernelEvent(4000, QStringLiteral("usb 1-2: device descriptor read/64, error -71"))});
+
+    const QVector<UsbEvent> events = daemon.recentEvents(10);
+    QCOMPARE(events.size(), 2);
+    QCOMPARE(events.at(0).message, QStringLiteral("usb 1-2: device descriptor read/64, error -71"));
+    QCOMPARE(events.at(0).repeatCount, 3u);
+    QCOMPARE(events.at(0).lastTimestampUs, 4000LL);
+    QCOMPARE(events.at(1).message, QStringLiteral("usb 3-4: device descriptor read/64, error -71"));
+    QCOMPARE(events.at(1).repeatCount, 1u);
+}
+
+void TestCoalescing::foldsCounters() {
+    UsbDaemon daemon;
+    daemon.appendEvents(
+        {kernelEvent(1000, QStringLiteral("usb 1-2: reset high-speed USB device number 5 using xhci_hcd"), "1-2"),
+         kernelEvent(2000, QStringLiteral("usb 1-2: reset high-speed USB device number 6 using xhci_hcd"), "1-2"),
+         kernelEvent(3000, QStringLiteral("hub 1-0:1.0: port 2 disabled by hub (EMI?), re-enabling..."), "usb1"),
+         kernelEvent(4000, QStringLiteral("hub 1-0:1.0: port 3 disabled by hub (EMI?), re-enabling..."), "usb1")});
+
+    const QVector<UsbEvent> events = daemon.recentEvents(10);
+    QCOMPARE(events.size(), 3);
+    QCOMPARE(events.at(0).repeatCount, 2u);
+    QCOMPARE(events.at(1).message, QStringLiteral("hub 1-0:1.0: port 2 disabled by hub (EMI?), re-enabling..."));
+    QCOMPARE(events.at(2).message, QStringLiteral("hub 1-0:1.0: port 3 disabled by hub (EMI?), re-enabling..."));
+}
+
+QTEST_GUILESS_MAIN(TestCoalescing)
+#include "test_coalescing.moc"
@@ -0,0 +1,140 @@
+// Repeat updates reach the events read from the persistent log, however
+// far behind the event the update was stored.
+
+#include <QtTest>
+
+#include "eventlog.h"
+
+namespace {
+UsbEvent logEvent(quint64 sequence) {
+    UsbEvent event;
+    event.sequence = sequence;
+    event.timestampUs = 1700000000000000LL + static_cast<qint64>(sequence) * 1000;
+    event.monotonicUs = static_cast<qint64>(sequence) * 1000;
+    event.lastTimestampUs = event.timestampUs;
+    event.level = QStringLiteral("error");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("host");
+    event.deviceId = QStringLiteral("1-2");
+    // Long enough that a few thousand events fill several segments.
+    event.message = QStringLiteral("usb 1-2: device descriptor read/64, error -71 ") + QString(200, u'x');
+    event.isUsb = true;
+    event.isError = true;
+    return event;
+}
+
+UsbEvent repeated(quint64 sequence, quint32 repeatCount) {
+    UsbEvent event = logEvent(sequence);
+    event.repeatCount = repeatCount;
+    event.lastTimestampUs = event.timestampUs + 500;
+    return event;
+}
+}
+
+class TestEventLog : public QObject {
+    Q_OBJECT
+
+private slots:
+    void updateAfterReadLimit();
+    void updateAfterRangeEnd();
+    void updateInLaterSegment();
+
+private:
+    void checkRepeat(const EventLog &log, quint64 sequence, quint32 repeatCount);
+};
+
+void TestEventLog::checkRepeat(const EventLog &log, quint64 sequence, quint32 repeatCount) {
+    const QVector<UsbEvent> since = log.readSince(sequence, 1);
+    QCOMPARE(since.size(), 1);
+    QCOMPARE(since.first().sequence, sequence);
+    QCOMPARE(since.first().repeatCount, repeatCount);
+    QCOMPARE(since.first().lastTimestampUs, since.first().timestampUs + 500);
+
+    const qint64 timestamp = logEvent(sequence).timestampUs;
+    const QVector<UsbEvent> range = log.readRange(timestamp, timestamp, 10);
+    QCOMPARE(range.size(), 1);
+    QCOMPARE(range.first().repeatCount, repeatCount);
+}
+
+void TestEventLog::updateAfterReadLimit() {
+    QTemporaryDir dir;
+    EventLog log(dir.path());
+    QVERIFY(log.open());
+    for (quint64 sequence = 1; sequence <= 3; ++sequence) {
+        log.append(logEvent(sequence));
+    }
+    log.appendRepeat(repeated(1, 4));
+
+    // The update is stored after event 3, past the one event asked for.
+    const QVector<UsbEvent> events = log.readSince(1, 1);
+    QCOMPARE(events.size(), 1);
+    QCOMPARE(events.first().repeatCount, 4u);
+}
+
+void TestEventLog::updateAfterRangeEnd() {
+    QTemporaryDir dir;
+    EventLog log(dir.path());
+    QVERIFY(log.open());
+    for (quint64 sequence = 1; sequence <= 3; ++sequence) {
+        log.append(logEvent(sequence));
+    }
+    log.appendRepeat(repeated(2, 7));
+
+    // The range ends at event 2; its update follows event 3.
+    const QVector<UsbEvent> events = log.readRange(logEvent(1).timestampUs, logEvent(2).timestampUs, 10);
+    QCOMPARE(events.size(), 2);
+    QCOMPARE(events.at(0).repeatCount, 1u);
+    QCOMPARE(events.at(1).repeatCount, 7u);
+}
+
+void TestEventLog::updateInLaterSegment() {
+    QTemporaryDir dir;
+    {
+        EventLog log(dir.path());
+        log.setSegmentBytes(64 * 1024);
+        log.setUncompressedSegments(-1);
+        QVERIFY(log.open());
+        for (quint64 sequence = 1; sequence <= 2000; ++sequence) {
+            log.append(logEvent(sequence));
+        }
+        // Event 1 sits in a sealed segment; the update goes to the newest.
+        log.appendRepeat(repeated(1, 3));
+        for (quint64 sequence = 2001; sequence <= 2500; ++sequence) {
+            log.append(logEvent(sequence));
+        }
+        log.appendRepeat(repeated(2400, 2));
+        checkRepeat(log, 1, 3);
+        checkRepeat(log, 2400, 2);
+    }
+
+    // Reopened, the sealed footers and the rescanned active segment hold
+    // the updates.
+    {
+        EventLog log(dir.path());
+        log.setSegmentBytes(64 * 1024);
+        log.setUncompressedSegments(-1);
+        QVERIFY(log.open());
+        checkRepeat(log, 1, 3);
+        checkRepeat(log, 2400, 2);
+    }
+
+    // Compressed segments carry them over in their footers.
+    {
+        EventLog log(dir.path());
+        log.setSegmentBytes(64 * 1024);
+        log.setUncompressedSegments(0);
+        QVERIFY(log.open());
+        QTRY_VERIFY_WITH_TIMEOUT(!log.isCompressing(), 30000);
+        checkRepeat(log, 1, 3);
+    }
+    {
+        EventLog log(dir.path());
+        log.setUncompressedSegments(-1);
+        QVERIFY(log.open());
+        checkRepeat(log, 1, 3);
+        checkRepeat(log, 2400, 2);
+    }
+}
+
+QTEST_GUILESS_MAIN(TestEventLog)
+#include "test_eventlog.moc"
@@ -0,0 +1,88 @@
+// The journalctl fallback parser: every line journalctl prints must be
+// mapped by scanning it in place, without building a QJsonDocument.
+
+#include <QtTest>
+
+#include "eventclassifier.h"
+#include "journaltail.h"
+
+class TestJournalTail : public QObject {
+    Q_OBJECT
+
+private slots:
+    void parsesEntries_data();
+    void parsesEntries();
+    void rejectsOtherLines();
+    void countsDocumentParses();
+
+private:
+    const EventClassifier m_classifier;
+};
+
+void TestJournalTail::parsesEntries_data() {
+    QTest::addColumn<QByteArray>("line");
+    QTest::addColumn<QString>("message");
+    QTest::addColumn<QString>("subsystem");
+
+    const QByteArray prefix = R"({"__CURSOR":"s=1a2b;i=3f;b=9c;m=42;t=5f;x=7d","__REALTIME_TIMESTAMP":"1700000000123456",)"
+                              R"("__MONOTONIC_TIMESTAMP":"42000001","_BOOT_ID":"9c",)";
+    QTest::newRow("plain") << prefix + R"("MESSAGE":"usb 1-2: device descriptor read/64, error -71",)"
+                                       R"("_KERNEL_SUBSYSTEM":"usb","_HOSTNAME":"host"})"
+                           << "usb 1-2: device descriptor read/64, error -71" << "usb";
+    QTest::newRow("escaped") << prefix + R"("MESSAGE":"usb 1-2: Product: \"K\u00e9yboard\" \ud83d\ude00\\","_HOSTNAME":"host"})"
+                             << QString::fromUtf8("usb 1-2: Product: \"K\xc3\xa9yboard\" \xf0\x9f\x98\x80\\")
+                             << "kernel";
+    // Data that is not valid UTF-8 comes as an array of byte values.
+    QTest::newRow("byte array") << prefix + R"("MESSAGE":[117,115,98,32,49,45,50,58,32,255],"_HOSTNAME":"host"})"
+                                << QString::fromUtf8("usb 1-2: \xff") << "kernel";
+    QTest::newRow("null field") << prefix + R"("MESSAGE":"hub 2-0:1.0: 4 ports detected","_KERNEL_SUBSYSTEM":null,)"
+                                            R"("_HOSTNAME":"host"})"
+                                << "hub 2-0:1.0: 4 ports detected" << "kernel";
+    QTest::newRow("spaced") << QByteArray(R"( { "__CURSOR" : "s=1a2b;i=3f;b=9c;m=42;t=5f;x=7d" , "__REALTIME_TIMESTAMP" : )"
+                               R"("1700000000123456" , "__MONOTONIC_TIMESTAMP" : "42000001" , "MESSAGE" : )"
+                               R"("usb 1-2: USB disconnect, device number 5" , "_HOSTNAME" : "host" } )")
+                            << "usb 1-2: USB disconnect, device number 5" << "kernel";
+}
+
+void TestJournalTail::parsesEntries() {
+    QFETCH(QByteArray, line);
+    QFETCH(QString, message);
+    QFETCH(QString, subsystem);
+
+    const quint64 documentParses = JournalTail::jsonDocumentParses();
+    UsbEvent event;
+    QByteArray cursor;
+    QVERIFY(JournalTail::parseJsonEntry(line, m_classifier, event, cursor));
+    QCOMPARE(JournalTail::jsonDocumentParses(), documentParses);
+
+    QCOMPARE(cursor, QByteArray("s=1a2b;i=3f;b=9c;m=42;t=5f;x=7d"));
+    QCOMPARE(event.timestampUs, 1700000000123456LL);
+    QCOMPARE(event.monotonicUs, 42000001LL);
+    QCOMPARE(event.message, message);
+    QCOMPARE(event.subsystem, subsystem);
+    QCOMPARE(event.source, QStringLiteral("host"));
+}
+
+void TestJournalTail::rejectsOtherLines() {
+    UsbEvent event;
+    QByteArray cursor;
+    QVERIFY(!JournalTail::parseJsonEntry("-- No entries --", m_classifier, event, cursor));
+    QVERIFY(!JournalTail::parseJsonEntry(R"({"MESSAGE":"cut off)", m_classifier, event, cursor));
+    QVERIFY(cursor.isEmpty());
+}
+
+void TestJournalTail::countsDocumentParses() {
+    // Nested objects are never printed by journalctl, so the scanner hands
+    // them on; the fallback still maps the fields it knows.
+    const quint64 documentParses = JournalTail::jsonDocumentParses();
+    UsbEvent event;
+    QByteArray cursor;
+    QVERIFY(JournalTail::parseJsonEntry(R"({"__CURSOR":"s=1","MESSAGE":"usb 1-2: reset","X":{"y":1}})", m_classifier,
+                                        event, cursor));
+    QCOMPARE(JournalTail::jsonDocumentParses(), documentParses + 1);
+    QCOMPARE(event.message, QStringLiteral("usb 1-2: reset"));
+    QCOMPARE(cursor, QByteArray("s=1"));
+}
+
+QTEST_GUILESS_MAIN(TestJournalTail)
+#include "test_journaltail.moc"
@@ -0,0 +1,73 @@
+// A client that missed signals catches up with SyncEvents and
+// GetUpdatedEvents; both must report the repeat count an event has now,
+// also once the event only survives in the persistent log.
+
+#include <QtTest>
+
+#include "eventlog.h"
+#include "usbdaemon.h"
+
+namespace {
+UsbEvent kernelEvent(qint64 timestampUs, const QString &message, const QString &deviceId) {
+    UsbEvent event;
+    event.timestampUs = timestampUs;
+    event.lastTimestampUs = timestampUs;
+    event.level = QStringLiteral("error");
+    event.subsystem = QStringLiteral("usb");
+    event.source = QStringLiteral("host");
+    event.deviceId = deviceId;
+    event.message = message;
+    event.isUsb = true;
+    event.isError = true;
+    return event;
+}
+}
+
+class TestResync : public QObject {
+    Q_OBJECT
+
+private slots:
+    void gapThenUpdate();
+};
+
+void TestResync::gapThenUpdate() {
+    QTemporaryDir dir;
+    EventLog log(dir.path());
+    QVERIFY(log.open());
+    UsbDaemon daemon;
+    daemon.setEventLog(&log);
+    daemon.setMemoryBudget(64 * 1024, {});
+
+    const QString flaky = QStringLiteral("usb 1-2: device descriptor read/64, error -71");
+    daemon.appendEvents({kernelEvent(1000, flaky, "1-2")});
+    // The client delivered event 1 and then lost the signals of what
+    // follows: a repeat of event 1 and enough other events to push event 1
+    // out of memory.
+    const quint64 last = daemon.lastSequence();
+    QCOMPARE(last, quint64(1));
+    daemon.appendEvents({kernelEvent(2000, flaky, "1-2")});
+    QVector<UsbEvent> others;
+    for (int i = 0; i < 3000; ++i) {
+        others.append(kernelEvent(3000 + i, QStringLiteral("usb 3-4: reset id 0x%1").arg(i, 0, 16), "3-4"));
+    }
+    daemon.appendEvents(others);
+    QVERIFY(daemon.recentEvents(100000).first().sequence > last);
+
+    // SyncEvents(last) starts with the last delivered event, read back from
+    // the log.
+    const QVector<UsbEvent> synced = daemon.eventsSince(last, 10);
+    QVERIFY(!synced.isEmpty());
+    QCOMPARE(synced.first().sequence, last);
+    QCOMPARE(synced.first().repeatCount, 2u);
+    QCOMPARE(synced.first().lastTimestampUs, 2000LL);
+
+    bool complete = false;
+    const QVector<UsbEvent> updated = daemon.updatedEventsSince(last, complete);
+    QVERIFY(complete);
+    QCOMPARE(updated.size(), 1);
+    QCOMPARE(updated.first().sequence, last);
+    QCOMPARE(updated.first().repeatCount, 2u);
+}
+
+QTEST_GUILESS_MAIN(TestResync)
+#include "test_resync.moc"